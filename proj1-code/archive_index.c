@@ -0,0 +1,369 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "archive_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+
+#define INDEX_MAGIC "MTARIDX3"
+#define INITIAL_CAPACITY 16
+
+/*
+ * On-disk layout of a sidecar: one index_file_header_t followed by 'count'
+ * entries, each an index_file_entry_t immediately followed by the member's
+ * name (without a null terminator). Integers are stored in native byte order,
+ * since the sidecar is a local cache that is rebuilt whenever it fails to
+ * validate.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t archive_ino;
+    uint64_t end_offset;
+    uint64_t count;
+} index_file_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t data_offset;
+    uint64_t size;
+    uint64_t real_size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint32_t name_len;
+    uint32_t flags;
+} index_file_entry_t;
+
+void archive_index_init(archive_index_t *index) {
+    index->members = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->end_offset = 0;
+    arena_init(&index->arena);
+    index->slots = NULL;
+    index->num_slots = 0;
+}
+
+/*
+ * Adds a copy of 'member' whose name is the first 'name_len' bytes of 'name'
+ * Returns 0 on success or 1 if an error occurs
+ */
+static int add_member(archive_index_t *index, const char *name, size_t name_len,
+                      const archive_member_t *member) {
+    if (index->count == index->capacity) {
+        int new_capacity = index->capacity == 0 ? INITIAL_CAPACITY : index->capacity * 2;
+        archive_member_t *members =
+            realloc(index->members, sizeof(archive_member_t) * new_capacity);
+        if (members == NULL) {
+            return 1;
+        }
+        index->members = members;
+        index->capacity = new_capacity;
+    }
+
+    archive_member_t *added = &index->members[index->count];
+    *added = *member;
+    added->name = arena_strndup(&index->arena, name, name_len);
+    if (added->name == NULL) {
+        return 1;
+    }
+    index->count++;
+    return 0;
+}
+
+int archive_index_add_member(archive_index_t *index, const archive_member_t *member) {
+    return add_member(index, member->name, strlen(member->name), member);
+}
+
+void archive_index_clear(archive_index_t *index) {
+    arena_clear(&index->arena);
+    free(index->members);
+    free(index->slots);
+    archive_index_init(index);
+}
+
+// FNV-1a hash of a member name
+static unsigned hash_name(const char *name) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; name[i] != '\0'; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns the slot holding the member named 'name', or the empty slot where
+ * it would go
+ */
+static int *find_slot(const archive_index_t *index, const char *name) {
+    unsigned mask = index->num_slots - 1;
+    for (unsigned i = hash_name(name) & mask;; i = (i + 1) & mask) {
+        int *slot = &index->slots[i];
+        if (*slot < 0 || strcmp(index->members[*slot].name, name) == 0) {
+            return slot;
+        }
+    }
+}
+
+int archive_index_build_lookup(archive_index_t *index) {
+    // Keep the table at most half full so probe sequences stay short
+    int num_slots = 16;
+    while (num_slots < 2 * index->count) {
+        num_slots *= 2;
+    }
+    int *slots = malloc(sizeof(int) * num_slots);
+    if (slots == NULL) {
+        return -1;
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->num_slots = num_slots;
+    for (int i = 0; i < num_slots; i++) {
+        slots[i] = -1;
+    }
+
+    // Later members overwrite earlier ones, leaving the latest of each name
+    for (int i = 0; i < index->count; i++) {
+        *find_slot(index, index->members[i].name) = i;
+    }
+    return 0;
+}
+
+int archive_index_find(const archive_index_t *index, const char *name) {
+    if (index->num_slots == 0) {
+        return -1;
+    }
+    return *find_slot(index, name);
+}
+
+/*
+ * Returns a newly allocated string holding the sidecar's file name, or NULL
+ * if memory could not be allocated
+ */
+static char *sidecar_name(const char *archive_name) {
+    size_t len = strlen(archive_name);
+    char *name = malloc(len + sizeof(INDEX_SUFFIX));
+    if (name != NULL) {
+        memcpy(name, archive_name, len);
+        memcpy(name + len, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+    }
+    return name;
+}
+
+static void fill_file_header(index_file_header_t *header, const struct stat *archive_stat,
+                             const archive_index_t *index) {
+    memset(header, 0, sizeof(index_file_header_t));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->archive_size = archive_stat->st_size;
+    header->archive_mtime_sec = archive_stat->st_mtim.tv_sec;
+    header->archive_mtime_nsec = archive_stat->st_mtim.tv_nsec;
+    header->archive_ino = archive_stat->st_ino;
+    header->end_offset = index->end_offset;
+    header->count = index->count;
+}
+
+/*
+ * Writes the entries for members [first, index->count) to 'fd' at its
+ * current position
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_entries(int fd, const archive_index_t *index, int first) {
+    for (int i = first; i < index->count; i++) {
+        const archive_member_t *member = &index->members[i];
+        index_file_entry_t entry = {.offset = member->offset,
+                                    .data_offset = member->data_offset,
+                                    .size = member->size,
+                                    .real_size = member->real_size,
+                                    .mtime = member->mtime,
+                                    .mtime_nsec = member->mtime_nsec,
+                                    .name_len = strlen(member->name),
+                                    .flags = member->flags};
+        if (write_all(fd, NULL, &entry, sizeof(entry)) != 0 ||
+            write_all(fd, NULL, member->name, entry.name_len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int archive_index_exists(const char *archive_name) {
+    char *path = sidecar_name(archive_name);
+    if (path == NULL) {
+        return 0;
+    }
+    int exists = access(path, F_OK) == 0;
+    free(path);
+    return exists;
+}
+
+/*
+ * Parses the sidecar contents held in 'data' into 'index'
+ * Returns 0 if the contents are well formed and describe the archive in
+ * 'archive_stat', 1 otherwise, or -1 if memory could not be allocated
+ */
+static int parse_sidecar(const char *data, size_t data_len, const struct stat *archive_stat,
+                         archive_index_t *index) {
+    index_file_header_t header;
+    if (data_len < sizeof(header)) {
+        return 1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.archive_size != (uint64_t) archive_stat->st_size ||
+        header.archive_mtime_sec != archive_stat->st_mtim.tv_sec ||
+        header.archive_mtime_nsec != archive_stat->st_mtim.tv_nsec ||
+        header.archive_ino != (uint64_t) archive_stat->st_ino) {
+        return 1;
+    }
+
+    size_t pos = sizeof(header);
+    for (uint64_t i = 0; i < header.count; i++) {
+        index_file_entry_t entry;
+        if (data_len - pos < sizeof(entry)) {
+            return 1;
+        }
+        memcpy(&entry, data + pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (data_len - pos < entry.name_len) {
+            return 1;
+        }
+        archive_member_t member = {.offset = entry.offset,
+                                   .data_offset = entry.data_offset,
+                                   .size = entry.size,
+                                   .real_size = entry.real_size,
+                                   .mtime = entry.mtime,
+                                   .mtime_nsec = entry.mtime_nsec,
+                                   .flags = entry.flags};
+        if (add_member(index, data + pos, entry.name_len, &member) != 0) {
+            return -1;
+        }
+        pos += entry.name_len;
+    }
+    if (pos != data_len) {
+        return 1;
+    }
+    index->end_offset = header.end_offset;
+    return 0;
+}
+
+int archive_index_load(const char *archive_name, const struct stat *archive_stat,
+                       archive_index_t *index) {
+    char *path = sidecar_name(archive_name);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    struct stat sidecar_stat;
+    if (fstat(fd, &sidecar_stat) != 0) {
+        close(fd);
+        return -1;
+    }
+    char *data = malloc(sidecar_stat.st_size > 0 ? sidecar_stat.st_size : 1);
+    if (data == NULL) {
+        close(fd);
+        return -1;
+    }
+    ssize_t data_len = read_all(fd, NULL, data, sidecar_stat.st_size);
+    close(fd);
+    if (data_len < 0) {
+        free(data);
+        return -1;
+    }
+
+    int result = parse_sidecar(data, data_len, archive_stat, index);
+    free(data);
+    if (result != 0) {
+        archive_index_clear(index);
+    }
+    return result;
+}
+
+int archive_index_save(const char *archive_name, const struct stat *archive_stat,
+                       const archive_index_t *index) {
+    char *path = sidecar_name(archive_name);
+    if (path == NULL) {
+        return -1;
+    }
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + sizeof(".tmp"));
+    if (tmp_path == NULL) {
+        free(path);
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    // Write a complete new sidecar first and then rename it into place, so
+    // readers only ever see an old or a new sidecar, never a partial one
+    int result = -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0) {
+        index_file_header_t header;
+        fill_file_header(&header, archive_stat, index);
+        if (write_all(fd, NULL, &header, sizeof(header)) == 0 &&
+            write_entries(fd, index, 0) == 0) {
+            result = 0;
+        }
+        if (close(fd) != 0) {
+            result = -1;
+        }
+        if (result == 0 && rename(tmp_path, path) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(path);
+    return result;
+}
+
+int archive_index_append(const char *archive_name, const struct stat *archive_stat,
+                         const archive_index_t *index, int first_new) {
+    char *path = sidecar_name(archive_name);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDWR);
+    free(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // New entries go after the existing ones; only once they are written is
+    // the header updated to describe the grown archive. A crash in between
+    // leaves a header that no longer matches the archive, so the sidecar is
+    // simply rebuilt the next time it is used.
+    index_file_header_t header;
+    off_t header_offset = 0;
+    if (read_all(fd, &header_offset, &header, sizeof(header)) != sizeof(header) ||
+        header.count != (uint64_t) first_new || lseek(fd, 0, SEEK_END) < 0 ||
+        write_entries(fd, index, first_new) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    fill_file_header(&header, archive_stat, index);
+    header_offset = 0;
+    if (write_all(fd, &header_offset, &header, sizeof(header)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
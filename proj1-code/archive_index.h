@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _ARCHIVE_INDEX_H
+#define _ARCHIVE_INDEX_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "arena.h"
+
+// Suffix appended to an archive's name to form the name of its index sidecar
+#define INDEX_SUFFIX ".idx"
+
+// Flag set on a member stored in the sparse format (see sparse.h)
+#define MEMBER_SPARSE 1
+// Flag set on a member stored deduplicated (see dedup.h)
+#define MEMBER_DEDUP 2
+
+// Location and metadata of one member, as recorded in its tar header
+typedef struct {
+    // Full member name, stored in the index's arena
+    char *name;
+    // Offset of the member's first block within the archive: its extended
+    // header if it has one, otherwise its tar header
+    off_t offset;
+    // Offset of the data following the member's tar header
+    off_t data_offset;
+    // Number of data bytes following the header (before padding)
+    off_t size;
+    // Size of the file the member extracts to, which for a sparse member
+    // counts its holes but not its map, and for a deduplicated member counts
+    // the chunks stored elsewhere
+    off_t real_size;
+    // Modification time of the member in Unix epoch time
+    time_t mtime;
+    // Nanoseconds past 'mtime', when an extended header gave them, or else 0
+    long mtime_nsec;
+    // MEMBER_SPARSE, MEMBER_DEDUP or 0
+    int flags;
+} archive_member_t;
+
+// All members of an archive, in the order they appear
+typedef struct {
+    archive_member_t *members;
+    int count;
+    int capacity;
+    // Offset of the end-of-archive marker, which is where new members go
+    off_t end_offset;
+    // Holds the member names; freed all at once by archive_index_clear
+    arena_t arena;
+    // Hash table from name to the position of the latest member with that
+    // name (-1 marks an empty slot), built by archive_index_build_lookup;
+    // 'num_slots' is a power of two
+    int *slots;
+    int num_slots;
+} archive_index_t;
+
+// Initialize a new, empty index
+void archive_index_init(archive_index_t *index);
+
+// Add a copy of 'member', whose name is copied too, to the end of the index
+// Returns 0 on success or 1 if an error occurs
+int archive_index_add_member(archive_index_t *index, const archive_member_t *member);
+
+// Remove all members from the index and free any memory associated with them
+void archive_index_clear(archive_index_t *index);
+
+// Prepare 'index' for archive_index_find; members added afterwards are not
+// found until the lookup is built again
+// Returns 0 on success or -1 if an error occurs
+int archive_index_build_lookup(archive_index_t *index);
+
+// Returns the position of the latest member named 'name', or -1 if there is
+// none. archive_index_build_lookup must have been called first.
+int archive_index_find(const archive_index_t *index, const char *name);
+
+/*
+ * The sidecar file stores an index next to its archive so that members can be
+ * located without reading every header. It records the size, modification
+ * time and inode of the archive it describes; a sidecar that does not match
+ * 'archive_stat' is stale and must not be trusted.
+ */
+
+// Load the sidecar of 'archive_name' into the empty 'index'
+// Returns 0 if a valid sidecar was loaded, 1 if it is missing, stale or
+// malformed (leaving 'index' empty), or -1 if an error occurs
+int archive_index_load(const char *archive_name, const struct stat *archive_stat,
+                       archive_index_t *index);
+
+// Write the complete sidecar for 'archive_name', replacing any existing one
+// Returns 0 on success or -1 if an error occurs
+int archive_index_save(const char *archive_name, const struct stat *archive_stat,
+                       const archive_index_t *index);
+
+// Add the members of 'index' from 'first_new' onward to an existing sidecar
+// that was valid for the archive before those members were appended
+// Returns 0 on success or -1 if an error occurs
+int archive_index_append(const char *archive_name, const struct stat *archive_stat,
+                         const archive_index_t *index, int first_new);
+
+// Returns 1 if a sidecar exists for 'archive_name', 0 otherwise
+int archive_index_exists(const char *archive_name);
+
+#endif    // _ARCHIVE_INDEX_H
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGN sizeof(void *)
+
+void arena_init(arena_t *arena) {
+    arena->blocks = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    arena_block_t *block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < size) {
+        // Blocks double in size up to a limit; oversized requests get a
+        // block of their own
+        size_t capacity = block == NULL ? MIN_BLOCK_SIZE : block->capacity * 2;
+        if (capacity > MAX_BLOCK_SIZE) {
+            capacity = MAX_BLOCK_SIZE;
+        }
+        if (capacity < size) {
+            capacity = size;
+        }
+        block = malloc(sizeof(arena_block_t) + capacity);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->blocks = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void arena_clear(arena_t *arena) {
+    arena_block_t *block = arena->blocks;
+    while (block != NULL) {
+        arena_block_t *to_free = block;
+        block = block->next;
+        free(to_free);
+    }
+    arena->blocks = NULL;
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+// One block of arena memory; allocations are carved from 'data' in order
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} arena_block_t;
+
+// A bump allocator: many small allocations that are all freed together
+typedef struct {
+    // Most recently allocated block, linked to the older ones
+    arena_block_t *blocks;
+} arena_t;
+
+// Initialize a new, empty arena
+void arena_init(arena_t *arena);
+
+// Allocate 'size' bytes, suitably aligned for any pointer or integer type
+// Returns a pointer to the memory or NULL if an error occurs
+void *arena_alloc(arena_t *arena, size_t size);
+
+// Copy the first 'len' bytes of 'str' into the arena as a null-terminated string
+// Returns a pointer to the copy or NULL if an error occurs
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+// Free every allocation made from the arena at once
+void arena_clear(arena_t *arena);
+
+#endif    // _ARENA_H
@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "copy_engine.h"
+#include "stats.h"
+
+// A larger pipe lets the tar side run further ahead of the compressor
+#define PIPE_SIZE (1 << 20)
+// Window bits telling zlib to write a gzip wrapper, or to accept one on input
+#define GZIP_WINDOW_BITS (15 + 16)
+#define AUTO_WINDOW_BITS (15 + 32)
+
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+compress_format_t compress_detect(int fd) {
+    unsigned char magic[sizeof(zstd_magic)];
+    ssize_t bytes_read = pread(fd, magic, sizeof(magic), 0);
+    if (bytes_read >= (ssize_t) sizeof(gzip_magic) &&
+        memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) {
+        return COMPRESS_GZIP;
+    }
+    if (bytes_read >= (ssize_t) sizeof(zstd_magic) &&
+        memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) {
+        return COMPRESS_ZSTD;
+    }
+    return COMPRESS_NONE;
+}
+
+/*
+ * Reads up to 'len' bytes from 'fd', retrying if interrupted
+ * Returns the number of bytes read, 0 at end of file, or -1 upon error
+ */
+static ssize_t read_some(int fd, void *buf, size_t len) {
+    ssize_t bytes_read;
+    do {
+        STATS_START(timer);
+        bytes_read = read(fd, buf, len);
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_READ_CALLS, 1);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read > 0) {
+        STATS_COUNT(STATS_BYTES_READ, bytes_read);
+    }
+    return bytes_read;
+}
+
+/*
+ * Thread body for gzip compression: deflates everything arriving on the pipe
+ * into the archive file until the tar side closes its end
+ */
+static void *gzip_compress(void *arg) {
+    compress_stage_t *stage = arg;
+    size_t chunk_size = copy_get_chunk_size();
+    unsigned char *in = malloc(chunk_size);
+    unsigned char *out = malloc(chunk_size);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    int result = -1;
+    if (in != NULL && out != NULL &&
+        deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                     Z_DEFAULT_STRATEGY) == Z_OK) {
+        int flush = Z_NO_FLUSH;
+        int failed = 0;
+        while (flush != Z_FINISH && !failed) {
+            ssize_t bytes_read = read_some(stage->pipe_fd, in, chunk_size);
+            if (bytes_read < 0) {
+                failed = 1;
+                break;
+            }
+            flush = bytes_read == 0 ? Z_FINISH : Z_NO_FLUSH;
+            stream.next_in = in;
+            stream.avail_in = bytes_read;
+            // Keep deflating until zlib stops filling the whole output buffer
+            do {
+                stream.next_out = out;
+                stream.avail_out = chunk_size;
+                deflate(&stream, flush);
+                if (write_all(stage->file_fd, NULL, out, chunk_size - stream.avail_out) != 0) {
+                    failed = 1;
+                    break;
+                }
+            } while (stream.avail_out == 0);
+        }
+        result = failed ? -1 : 0;
+        deflateEnd(&stream);
+    }
+    if (result != 0) {
+        perror("Error: Failed to compress archive");
+    }
+
+    // Closing our end makes a still-running tar side fail rather than block
+    close(stage->pipe_fd);
+    free(in);
+    free(out);
+    stage->status = result;
+    return NULL;
+}
+
+/*
+ * Thread body for gzip decompression: inflates the archive file, which may
+ * hold several concatenated gzip members, into the pipe. The tar side may
+ * close its end once it reaches the end-of-archive blocks, which ends the
+ * stage early without an error.
+ */
+static void *gzip_decompress(void *arg) {
+    compress_stage_t *stage = arg;
+    size_t chunk_size = copy_get_chunk_size();
+    unsigned char *in = malloc(chunk_size);
+    unsigned char *out = malloc(chunk_size);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    int result = -1;
+    if (in != NULL && out != NULL && inflateInit2(&stream, AUTO_WINDOW_BITS) == Z_OK) {
+        // Set between gzip members, where the input may validly end
+        int at_boundary = 0;
+        while (1) {
+            if (stream.avail_in == 0) {
+                ssize_t bytes_read = read_some(stage->file_fd, in, chunk_size);
+                if (bytes_read <= 0) {
+                    if (bytes_read < 0) {
+                        perror("Error: Failed to read compressed archive");
+                    } else if (!at_boundary) {
+                        fprintf(stderr, "Error: Compressed archive is truncated\n");
+                    }
+                    result = bytes_read == 0 && at_boundary ? 0 : -1;
+                    break;
+                }
+                stream.next_in = in;
+                stream.avail_in = bytes_read;
+            }
+
+            stream.next_out = out;
+            stream.avail_out = chunk_size;
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "Error: Compressed archive is corrupt\n");
+                break;
+            }
+            at_boundary = 0;
+            if (write_all(stage->pipe_fd, NULL, out, chunk_size - stream.avail_out) != 0) {
+                // The tar side has everything it needs and stopped reading
+                result = errno == EPIPE ? 0 : -1;
+                break;
+            }
+            if (ret == Z_STREAM_END) {
+                inflateReset(&stream);
+                at_boundary = 1;
+            }
+        }
+        inflateEnd(&stream);
+    }
+    if (in == NULL || out == NULL) {
+        perror("Error: Failed to allocate decompression buffers");
+    }
+
+    close(stage->pipe_fd);
+    free(in);
+    free(out);
+    stage->status = result;
+    return NULL;
+}
+
+/*
+ * Runs 'zstd' with 'child_stdin' and 'child_stdout' as its standard input and
+ * output, passing it 'mode' ("-d" to decompress) if not NULL
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int spawn_zstd(compress_stage_t *stage, int child_stdin, int child_stdout,
+                      const char *mode) {
+    stage->pid = fork();
+    if (stage->pid < 0) {
+        perror("Error: Failed to start zstd");
+        return -1;
+    }
+    if (stage->pid == 0) {
+        // Let zstd die quietly if the tar side stops reading early
+        signal(SIGPIPE, SIG_DFL);
+        if (dup2(child_stdin, STDIN_FILENO) < 0 || dup2(child_stdout, STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        execlp("zstd", "zstd", "-q", "-c", mode, (char *) NULL);
+        perror("Error: Failed to run zstd");
+        _exit(127);
+    }
+    return 0;
+}
+
+/*
+ * Creates the pipe between the caller and the stage, and sets up the common
+ * fields of 'stage'. 'pipe_fds' receives the read and write ends.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int open_stage_pipe(compress_stage_t *stage, compress_format_t format, int file_fd,
+                           int compressing, int pipe_fds[2]) {
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        perror("Error: Failed to create pipe");
+        return -1;
+    }
+    fcntl(pipe_fds[0], F_SETPIPE_SZ, PIPE_SIZE);
+
+    // A stage that stops early must show up as a write error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    stage->format = format;
+    stage->file_fd = file_fd;
+    stage->compressing = compressing;
+    stage->pid = -1;
+    stage->status = 0;
+    return 0;
+}
+
+int compress_start(compress_stage_t *stage, compress_format_t format, int out_fd) {
+    int pipe_fds[2];
+    if (open_stage_pipe(stage, format, out_fd, 1, pipe_fds) != 0) {
+        return -1;
+    }
+    stage->fd = pipe_fds[1];
+    stage->pipe_fd = pipe_fds[0];
+
+    int result;
+    if (format == COMPRESS_GZIP) {
+        result = pthread_create(&stage->thread, NULL, gzip_compress, stage) == 0 ? 0 : -1;
+        if (result != 0) {
+            fprintf(stderr, "Error: Failed to start compression thread\n");
+            close(stage->pipe_fd);
+        }
+    } else {
+        // The child has its own copy of our end of the pipe
+        result = spawn_zstd(stage, stage->pipe_fd, out_fd, NULL);
+        close(stage->pipe_fd);
+    }
+    if (result != 0) {
+        close(stage->fd);
+    }
+    return result;
+}
+
+int decompress_start(compress_stage_t *stage, compress_format_t format, int in_fd) {
+    int pipe_fds[2];
+    if (open_stage_pipe(stage, format, in_fd, 0, pipe_fds) != 0) {
+        return -1;
+    }
+    stage->fd = pipe_fds[0];
+    stage->pipe_fd = pipe_fds[1];
+
+    int result;
+    if (format == COMPRESS_GZIP) {
+        result = pthread_create(&stage->thread, NULL, gzip_decompress, stage) == 0 ? 0 : -1;
+        if (result != 0) {
+            fprintf(stderr, "Error: Failed to start decompression thread\n");
+            close(stage->pipe_fd);
+        }
+    } else {
+        // The child has its own copy of our end of the pipe
+        result = spawn_zstd(stage, in_fd, stage->pipe_fd, "-d");
+        close(stage->pipe_fd);
+    }
+    if (result != 0) {
+        close(stage->fd);
+    }
+    return result;
+}
+
+int compress_finish(compress_stage_t *stage) {
+    close(stage->fd);
+    if (stage->format == COMPRESS_GZIP) {
+        pthread_join(stage->thread, NULL);
+        return stage->status;
+    }
+
+    int status;
+    while (waitpid(stage->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Error: Failed to wait for zstd");
+            return -1;
+        }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 0;
+    }
+    if (!stage->compressing && WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE) {
+        return 0;
+    }
+    fprintf(stderr, "Error: zstd failed\n");
+    return -1;
+}
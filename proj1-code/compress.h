@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// Compression applied to a whole archive stream
+typedef enum {
+    COMPRESS_NONE,
+    // gzip, done in-process with zlib on a separate thread
+    COMPRESS_GZIP,
+    // zstd, done by a child 'zstd' process
+    COMPRESS_ZSTD,
+} compress_format_t;
+
+/*
+ * A compression stage sits between the tar reader or writer and the archive
+ * file, connected to it by a pipe. The stage runs concurrently with the
+ * caller, so compressing one part of the archive overlaps with reading files
+ * for (or writing files from) the next.
+ */
+typedef struct {
+    compress_format_t format;
+    // End of the pipe the caller writes uncompressed data to (compression)
+    // or reads uncompressed data from (decompression)
+    int fd;
+    // The stage's end of the pipe and the compressed file it works on
+    int pipe_fd;
+    int file_fd;
+    int compressing;
+    pthread_t thread;
+    pid_t pid;
+    // Result of the stage's work: 0 on success or -1 if an error occurred
+    int status;
+} compress_stage_t;
+
+// Returns the compression format whose magic number begins the file open as
+// 'fd', or COMPRESS_NONE if there is none or the file cannot be read by offset
+compress_format_t compress_detect(int fd);
+
+// Start compressing, in 'format', everything written to 'stage->fd' into
+// 'out_fd' at its current position
+// Returns 0 on success or -1 if an error occurs
+int compress_start(compress_stage_t *stage, compress_format_t format, int out_fd);
+
+// Start decompressing 'in_fd', in 'format', from its current position, making
+// the uncompressed data available for reading from 'stage->fd'
+// Returns 0 on success or -1 if an error occurs
+int decompress_start(compress_stage_t *stage, compress_format_t format, int in_fd);
+
+// Close the caller's end of the pipe and wait for the stage to finish. When
+// compressing, this flushes the end of the compressed stream. When
+// decompressing, the caller may stop reading before the end of the stream.
+// Returns 0 if the stage succeeded or -1 if it failed
+int compress_finish(compress_stage_t *stage);
+
+#endif    // _COMPRESS_H
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "content_hash.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "copy_engine.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define STRIPE_LEN 32
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads, so the hash is the same on every host
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t value) {
+    acc ^= round64(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+static void consume_stripe(content_hash_t *hash, const unsigned char *p) {
+    for (int i = 0; i < 4; i++) {
+        hash->acc[i] = round64(hash->acc[i], read64(p + 8 * i));
+    }
+}
+
+void content_hash_init(content_hash_t *hash) {
+    hash->acc[0] = PRIME1 + PRIME2;
+    hash->acc[1] = PRIME2;
+    hash->acc[2] = 0;
+    hash->acc[3] = -PRIME1;
+    hash->total_len = 0;
+    hash->buffered = 0;
+}
+
+void content_hash_update(content_hash_t *hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    hash->total_len += len;
+
+    if (hash->buffered > 0) {
+        size_t fill = STRIPE_LEN - hash->buffered;
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(hash->buffer + hash->buffered, p, fill);
+        hash->buffered += fill;
+        p += fill;
+        len -= fill;
+        if (hash->buffered < STRIPE_LEN) {
+            return;
+        }
+        consume_stripe(hash, hash->buffer);
+        hash->buffered = 0;
+    }
+
+    while (len >= STRIPE_LEN) {
+        consume_stripe(hash, p);
+        p += STRIPE_LEN;
+        len -= STRIPE_LEN;
+    }
+    memcpy(hash->buffer, p, len);
+    hash->buffered = len;
+}
+
+uint64_t content_hash_final(const content_hash_t *hash) {
+    uint64_t result;
+    if (hash->total_len >= STRIPE_LEN) {
+        result = rotl(hash->acc[0], 1) + rotl(hash->acc[1], 7) + rotl(hash->acc[2], 12) +
+                 rotl(hash->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            result = merge_round(result, hash->acc[i]);
+        }
+    } else {
+        result = hash->acc[2] + PRIME5;
+    }
+    result += hash->total_len;
+
+    const unsigned char *p = hash->buffer;
+    size_t len = hash->buffered;
+    for (; len >= 8; p += 8, len -= 8) {
+        result ^= round64(0, read64(p));
+        result = rotl(result, 27) * PRIME1 + PRIME4;
+    }
+    if (len >= 4) {
+        result ^= (uint64_t) read32(p) * PRIME1;
+        result = rotl(result, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        result ^= *p * PRIME5;
+        result = rotl(result, 11) * PRIME1;
+    }
+
+    result ^= result >> 33;
+    result *= PRIME2;
+    result ^= result >> 29;
+    result *= PRIME3;
+    result ^= result >> 32;
+    return result;
+}
+
+int content_hash_fd(int fd, off_t offset, off_t nbytes, uint64_t *result) {
+    size_t buffer_size = copy_get_chunk_size();
+    char *buffer = malloc(buffer_size);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    content_hash_t hash;
+    content_hash_init(&hash);
+    while (nbytes > 0) {
+        size_t to_read = nbytes < (off_t) buffer_size ? (size_t) nbytes : buffer_size;
+        ssize_t bytes_read = read_all(fd, &offset, buffer, to_read);
+        if (bytes_read != (ssize_t) to_read) {
+            if (bytes_read >= 0) {
+                errno = ENODATA;
+            }
+            free(buffer);
+            return -1;
+        }
+        content_hash_update(&hash, buffer, to_read);
+        nbytes -= to_read;
+    }
+    free(buffer);
+    *result = content_hash_final(&hash);
+    return 0;
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _CONTENT_HASH_H
+#define _CONTENT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Streaming XXH64 hash of file contents. It is not cryptographic; it is used
+ * to notice whether data changed, at close to memory bandwidth.
+ */
+typedef struct {
+    uint64_t acc[4];
+    uint64_t total_len;
+    // Input not yet consumed because it does not fill a 32-byte stripe
+    unsigned char buffer[32];
+    size_t buffered;
+} content_hash_t;
+
+// Start a new hash
+void content_hash_init(content_hash_t *hash);
+
+// Add 'len' bytes of 'data' to the hash
+void content_hash_update(content_hash_t *hash, const void *data, size_t len);
+
+// Returns the hash of everything added so far
+uint64_t content_hash_final(const content_hash_t *hash);
+
+// Hash 'nbytes' bytes of 'fd' starting at 'offset' into '*result'
+// Returns 0 on success or -1 if an error occurs, including when the file
+// holds fewer than 'nbytes' bytes
+int content_hash_fd(int fd, off_t offset, off_t nbytes, uint64_t *result);
+
+#endif    // _CONTENT_HASH_H
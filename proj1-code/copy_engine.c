@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "copy_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define PAGE_ALIGN 4096
+#define ZERO_BUF_SIZE 4096
+
+static size_t chunk_size = DEFAULT_COPY_CHUNK_SIZE;
+// Cleared once the kernel reports that copy_file_range is not implemented
+static int have_copy_file_range = 1;
+
+void copy_set_chunk_size(size_t new_size) {
+    if (new_size == 0) {
+        new_size = DEFAULT_COPY_CHUNK_SIZE;
+    }
+    // Clamping first also keeps the round-up below from wrapping to 0
+    if (new_size > MAX_COPY_CHUNK_SIZE) {
+        new_size = MAX_COPY_CHUNK_SIZE;
+    }
+    chunk_size = (new_size + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+}
+
+size_t copy_get_chunk_size(void) {
+    return chunk_size;
+}
+
+static size_t next_chunk(off_t remaining) {
+    return remaining < (off_t) chunk_size ? (size_t) remaining : chunk_size;
+}
+
+// Errors that mean "this kernel copy method does not apply to these
+// descriptors", as opposed to a genuine I/O failure
+static int is_unsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+           err == EBADF || err == ESPIPE;
+}
+
+/*
+ * Each try_* helper below moves as much of '*remaining' as its method allows.
+ * They return 0 either when everything was copied or when the method does
+ * not apply (leaving the rest of '*remaining' for the next method), and -1 on
+ * a real error. Hitting end of file on the source early is reported as an
+ * ENODATA error, since callers always know exactly how much data to expect.
+ */
+static int try_copy_file_range(int out_fd, off_t *out_off, int in_fd, off_t *in_off,
+                               off_t *remaining) {
+    while (*remaining > 0) {
+        loff_t in_pos = in_off ? *in_off : 0;
+        loff_t out_pos = out_off ? *out_off : 0;
+        STATS_START(timer);
+        ssize_t n = copy_file_range(in_fd, in_off ? &in_pos : NULL, out_fd,
+                                    out_off ? &out_pos : NULL, next_chunk(*remaining), 0);
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_COPY_CALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOSYS) {
+                have_copy_file_range = 0;
+            }
+            return is_unsupported(errno) ? 0 : -1;
+        }
+        if (n == 0) {
+            errno = ENODATA;
+            return -1;
+        }
+        STATS_COUNT(STATS_BYTES_READ, n);
+        STATS_COUNT(STATS_BYTES_WRITTEN, n);
+        if (in_off) {
+            *in_off = in_pos;
+        }
+        if (out_off) {
+            *out_off = out_pos;
+        }
+        *remaining -= n;
+    }
+    return 0;
+}
+
+static int try_sendfile(int out_fd, int in_fd, off_t *in_off, off_t *remaining) {
+    while (*remaining > 0) {
+        STATS_START(timer);
+        ssize_t n = sendfile(out_fd, in_fd, in_off, next_chunk(*remaining));
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_COPY_CALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported(errno) ? 0 : -1;
+        }
+        if (n == 0) {
+            errno = ENODATA;
+            return -1;
+        }
+        STATS_COUNT(STATS_BYTES_READ, n);
+        STATS_COUNT(STATS_BYTES_WRITTEN, n);
+        *remaining -= n;
+    }
+    return 0;
+}
+
+static int try_splice(int out_fd, off_t *out_off, int in_fd, off_t *remaining) {
+    while (*remaining > 0) {
+        loff_t out_pos = out_off ? *out_off : 0;
+        STATS_START(timer);
+        ssize_t n = splice(in_fd, NULL, out_fd, out_off ? &out_pos : NULL,
+                           next_chunk(*remaining), SPLICE_F_MOVE | SPLICE_F_MORE);
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_COPY_CALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported(errno) ? 0 : -1;
+        }
+        if (n == 0) {
+            errno = ENODATA;
+            return -1;
+        }
+        STATS_COUNT(STATS_BYTES_READ, n);
+        STATS_COUNT(STATS_BYTES_WRITTEN, n);
+        if (out_off) {
+            *out_off = out_pos;
+        }
+        *remaining -= n;
+    }
+    return 0;
+}
+
+static int copy_through_buffer(int out_fd, off_t *out_off, int in_fd, off_t *in_off,
+                               off_t *remaining) {
+    size_t buf_size = next_chunk(*remaining);
+    buf_size = (buf_size + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+    void *buffer;
+    int err = posix_memalign(&buffer, PAGE_ALIGN, buf_size);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    while (*remaining > 0) {
+        size_t want = next_chunk(*remaining);
+        ssize_t n = read_all(in_fd, in_off, buffer, want);
+        if (n < 0) {
+            free(buffer);
+            return -1;
+        }
+        if ((size_t) n < want) {
+            free(buffer);
+            errno = ENODATA;
+            return -1;
+        }
+        if (write_all(out_fd, out_off, buffer, n) != 0) {
+            free(buffer);
+            return -1;
+        }
+        *remaining -= n;
+    }
+    free(buffer);
+    return 0;
+}
+
+int copy_file_data(int out_fd, off_t *out_off, int in_fd, off_t *in_off, off_t nbytes) {
+    struct stat in_stat;
+    struct stat out_stat;
+    if (fstat(in_fd, &in_stat) != 0 || fstat(out_fd, &out_stat) != 0) {
+        return -1;
+    }
+
+    off_t remaining = nbytes;
+    if (have_copy_file_range && S_ISREG(in_stat.st_mode) && S_ISREG(out_stat.st_mode)) {
+        if (try_copy_file_range(out_fd, out_off, in_fd, in_off, &remaining) != 0) {
+            return -1;
+        }
+    }
+    // sendfile() can only write at the output's file position
+    if (remaining > 0 && out_off == NULL && S_ISREG(in_stat.st_mode)) {
+        if (try_sendfile(out_fd, in_fd, in_off, &remaining) != 0) {
+            return -1;
+        }
+    }
+    if (remaining > 0 && in_off == NULL && S_ISFIFO(in_stat.st_mode)) {
+        if (try_splice(out_fd, out_off, in_fd, &remaining) != 0) {
+            return -1;
+        }
+    }
+    if (remaining > 0) {
+        return copy_through_buffer(out_fd, out_off, in_fd, in_off, &remaining);
+    }
+    return 0;
+}
+
+int write_all(int fd, off_t *off, const void *buf, size_t len) {
+    const char *bytes = buf;
+    while (len > 0) {
+        STATS_START(timer);
+        ssize_t n = off ? pwrite(fd, bytes, len, *off) : write(fd, bytes, len);
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_WRITE_CALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        STATS_COUNT(STATS_BYTES_WRITTEN, n);
+        bytes += n;
+        len -= n;
+        if (off) {
+            *off += n;
+        }
+    }
+    return 0;
+}
+
+ssize_t read_all(int fd, off_t *off, void *buf, size_t len) {
+    char *bytes = buf;
+    size_t total = 0;
+    while (total < len) {
+        STATS_START(timer);
+        ssize_t n = off ? pread(fd, bytes + total, len - total, *off)
+                        : read(fd, bytes + total, len - total);
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_READ_CALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        STATS_COUNT(STATS_BYTES_READ, n);
+        if (n == 0) {
+            break;
+        }
+        total += n;
+        if (off) {
+            *off += n;
+        }
+    }
+    return total;
+}
+
+int write_zeros(int fd, off_t *off, size_t nbytes) {
+    static const char zeros[ZERO_BUF_SIZE];
+    while (nbytes > 0) {
+        size_t n = nbytes < ZERO_BUF_SIZE ? nbytes : ZERO_BUF_SIZE;
+        if (write_all(fd, off, zeros, n) != 0) {
+            return -1;
+        }
+        nbytes -= n;
+    }
+    return 0;
+}
+
+int writer_init(buffered_writer_t *writer, int fd, off_t position) {
+    writer->fd = fd;
+    writer->used = 0;
+    writer->capacity = chunk_size;
+    writer->position = position;
+    int err = posix_memalign((void **) &writer->buffer, PAGE_ALIGN, writer->capacity);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int writer_flush(buffered_writer_t *writer) {
+    if (writer->used > 0 && write_all(writer->fd, NULL, writer->buffer, writer->used) != 0) {
+        return -1;
+    }
+    writer->used = 0;
+    return 0;
+}
+
+int writer_write(buffered_writer_t *writer, const void *buf, size_t len) {
+    const char *bytes = buf;
+    writer->position += len;
+    while (len > 0) {
+        if (writer->used == writer->capacity && writer_flush(writer) != 0) {
+            return -1;
+        }
+        size_t n = writer->capacity - writer->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(writer->buffer + writer->used, bytes, n);
+        writer->used += n;
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int writer_zeros(buffered_writer_t *writer, size_t nbytes) {
+    static const char zeros[ZERO_BUF_SIZE];
+    while (nbytes > 0) {
+        size_t n = nbytes < ZERO_BUF_SIZE ? nbytes : ZERO_BUF_SIZE;
+        if (writer_write(writer, zeros, n) != 0) {
+            return -1;
+        }
+        nbytes -= n;
+    }
+    return 0;
+}
+
+int writer_copy(buffered_writer_t *writer, int in_fd, off_t nbytes) {
+    // Data that fits in what is left of the buffer joins the surrounding
+    // headers in one write; anything larger goes through the kernel directly
+    if (nbytes <= (off_t) (writer->capacity - writer->used)) {
+        ssize_t n = read_all(in_fd, NULL, writer->buffer + writer->used, nbytes);
+        if (n < 0) {
+            return -1;
+        }
+        if (n < nbytes) {
+            errno = ENODATA;
+            return -1;
+        }
+        writer->used += n;
+        writer->position += n;
+        return 0;
+    }
+    if (writer_flush(writer) != 0 || copy_file_data(writer->fd, NULL, in_fd, NULL, nbytes) != 0) {
+        return -1;
+    }
+    writer->position += nbytes;
+    return 0;
+}
+
+void writer_free(buffered_writer_t *writer) {
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+int reader_init(buffered_reader_t *reader, int fd) {
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    reader->capacity = chunk_size;
+    reader->position = 0;
+    int err = posix_memalign((void **) &reader->buffer, PAGE_ALIGN, reader->capacity);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Refill the reader's buffer, returning the number of bytes now buffered, 0
+// at end of stream, or -1 if an error occurs
+static ssize_t reader_fill(buffered_reader_t *reader) {
+    if (reader->start < reader->end) {
+        return reader->end - reader->start;
+    }
+    while (1) {
+        STATS_START(timer);
+        ssize_t n = read(reader->fd, reader->buffer, reader->capacity);
+        STATS_PHASE(STATS_PHASE_COPY, timer);
+        STATS_COUNT(STATS_READ_CALLS, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        STATS_COUNT(STATS_BYTES_READ, n);
+        reader->start = 0;
+        reader->end = n;
+        return n;
+    }
+}
+
+ssize_t reader_read(buffered_reader_t *reader, void *buf, size_t len) {
+    char *bytes = buf;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t available = reader_fill(reader);
+        if (available < 0) {
+            return -1;
+        }
+        if (available == 0) {
+            break;
+        }
+        size_t n = len - total < (size_t) available ? len - total : (size_t) available;
+        memcpy(bytes + total, reader->buffer + reader->start, n);
+        reader->start += n;
+        total += n;
+    }
+    reader->position += total;
+    return total;
+}
+
+int reader_skip(buffered_reader_t *reader, off_t nbytes) {
+    while (nbytes > 0) {
+        ssize_t available = reader_fill(reader);
+        if (available <= 0) {
+            if (available == 0) {
+                errno = ENODATA;
+            }
+            return -1;
+        }
+        size_t n = nbytes < available ? (size_t) nbytes : (size_t) available;
+        reader->start += n;
+        reader->position += n;
+        nbytes -= n;
+    }
+    return 0;
+}
+
+int reader_copy(buffered_reader_t *reader, int out_fd, off_t nbytes) {
+    // Drain what is already buffered, then let the kernel move the rest
+    size_t buffered = reader->end - reader->start;
+    size_t n = nbytes < (off_t) buffered ? (size_t) nbytes : buffered;
+    if (n > 0 && write_all(out_fd, NULL, reader->buffer + reader->start, n) != 0) {
+        return -1;
+    }
+    reader->start += n;
+    reader->position += n;
+    nbytes -= n;
+    if (nbytes > 0) {
+        if (copy_file_data(out_fd, NULL, reader->fd, NULL, nbytes) != 0) {
+            return -1;
+        }
+        reader->position += nbytes;
+    }
+    return 0;
+}
+
+void reader_free(buffered_reader_t *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _COPY_ENGINE_H
+#define _COPY_ENGINE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Default number of bytes moved by a single copy call
+#define DEFAULT_COPY_CHUNK_SIZE (1 << 20)
+// Largest number of bytes a single copy call may be set to move
+#define MAX_COPY_CHUNK_SIZE ((size_t) 1 << 30)
+
+/*
+ * All functions below take optional offset pointers following the same
+ * convention as copy_file_range(2): if an offset pointer is NULL, the data is
+ * read/written at the descriptor's current file position, which is advanced.
+ * Otherwise data is read/written at '*offset', '*offset' is advanced by the
+ * number of bytes transferred, and the descriptor's file position is left
+ * untouched (so one descriptor can safely be shared between threads).
+ */
+
+// Set the number of bytes moved per copy call. The value is rounded up to a
+// multiple of the page size so that the userspace fallback buffer stays aligned,
+// and values above MAX_COPY_CHUNK_SIZE are clamped to it.
+void copy_set_chunk_size(size_t chunk_size);
+
+// Returns the currently configured copy chunk size in bytes
+size_t copy_get_chunk_size(void);
+
+// Copy exactly 'nbytes' bytes from 'in_fd' to 'out_fd'
+// Kernel-side copies (copy_file_range, sendfile, splice) are used when the
+// descriptors allow it, otherwise data moves through an aligned buffer.
+// Returns 0 on success or -1 if an error occurs, including when the source
+// holds fewer than 'nbytes' bytes
+int copy_file_data(int out_fd, off_t *out_off, int in_fd, off_t *in_off, off_t nbytes);
+
+// Write all 'len' bytes of 'buf' to 'fd', retrying on short writes
+// Returns 0 on success or -1 if an error occurs
+int write_all(int fd, off_t *off, const void *buf, size_t len);
+
+// Read exactly 'len' bytes from 'fd' into 'buf', retrying on short reads
+// Returns the number of bytes read, which is less than 'len' only at end of
+// file, or -1 if an error occurs
+ssize_t read_all(int fd, off_t *off, void *buf, size_t len);
+
+// Write 'nbytes' zero bytes to 'fd'
+// Returns 0 on success or -1 if an error occurs
+int write_zeros(int fd, off_t *off, size_t nbytes);
+
+/*
+ * A buffered writer gathers small writes (headers, padding, small files) into
+ * one large buffer so that each system call moves a full chunk, which also
+ * keeps a pipe on the other end full. Large files bypass the buffer and are
+ * copied by copy_file_data() after it is flushed.
+ */
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    // Total number of bytes written through the writer so far
+    off_t position;
+} buffered_writer_t;
+
+// Set up 'writer' to append to 'fd', whose current offset is 'position'
+// Returns 0 on success or -1 if an error occurs
+int writer_init(buffered_writer_t *writer, int fd, off_t position);
+
+// Buffer 'len' bytes of 'buf' for writing
+// Returns 0 on success or -1 if an error occurs
+int writer_write(buffered_writer_t *writer, const void *buf, size_t len);
+
+// Buffer 'nbytes' zero bytes for writing
+// Returns 0 on success or -1 if an error occurs
+int writer_zeros(buffered_writer_t *writer, size_t nbytes);
+
+// Write exactly 'nbytes' bytes read from 'in_fd' at its current position
+// Returns 0 on success or -1 if an error occurs
+int writer_copy(buffered_writer_t *writer, int in_fd, off_t nbytes);
+
+// Write out everything buffered so far
+// Returns 0 on success or -1 if an error occurs
+int writer_flush(buffered_writer_t *writer);
+
+// Free the writer's buffer; anything not yet flushed is discarded
+void writer_free(buffered_writer_t *writer);
+
+/*
+ * A buffered reader consumes a stream strictly front to back, reading ahead a
+ * full chunk at a time, so it works on pipes where seeking is impossible.
+ */
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    // Total number of bytes consumed through the reader so far
+    off_t position;
+} buffered_reader_t;
+
+// Set up 'reader' to consume 'fd' from its current position
+// Returns 0 on success or -1 if an error occurs
+int reader_init(buffered_reader_t *reader, int fd);
+
+// Read up to 'len' bytes into 'buf'
+// Returns the number of bytes read, which is less than 'len' only at end of
+// stream, or -1 if an error occurs
+ssize_t reader_read(buffered_reader_t *reader, void *buf, size_t len);
+
+// Read and discard exactly 'nbytes' bytes
+// Returns 0 on success or -1 if an error occurs (including end of stream)
+int reader_skip(buffered_reader_t *reader, off_t nbytes);
+
+// Move exactly 'nbytes' bytes from the stream to 'out_fd'
+// Returns 0 on success or -1 if an error occurs (including end of stream)
+int reader_copy(buffered_reader_t *reader, int out_fd, off_t nbytes);
+
+// Free the reader's buffer
+void reader_free(buffered_reader_t *reader);
+
+#endif    // _COPY_ENGINE_H
@@ -0,0 +1,361 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "dedup.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "content_hash.h"
+#include "copy_engine.h"
+
+#define INITIAL_CAPACITY 64
+// Past the minimum length, a chunk ends wherever the top CUT_BITS bits of the
+// rolling hash are all zero, which happens once every 2^CUT_BITS bytes on
+// average
+#define CUT_BITS 13
+// Each byte shifts the rolling hash left by one, so only the last 64 bytes
+// read affect its top bits
+#define HASH_WINDOW 64
+
+// Random value added to the rolling hash for each byte value
+static uint64_t gear[256];
+static int have_gear = 0;
+
+// Fills in 'gear' from a fixed seed (splitmix64), so chunk boundaries are
+// the same on every run. Only the thread creating an archive uses it.
+static void init_gear(void) {
+    uint64_t state = 0x6d696e69746172ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    have_gear = 1;
+}
+
+// Returns the length of the chunk at the start of the 'len' bytes of 'data',
+// which hold at least DEDUP_MAX_CHUNK bytes unless they end the input
+static size_t chunk_length(const unsigned char *data, size_t len) {
+    if (len <= DEDUP_MIN_CHUNK) {
+        return len;
+    }
+    size_t limit = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+    uint64_t hash = 0;
+    for (size_t i = DEDUP_MIN_CHUNK - HASH_WINDOW; i < limit; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (i >= DEDUP_MIN_CHUNK && (hash >> (64 - CUT_BITS)) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+// Receives each chunk found by chunk_fd: its 'len' bytes at 'data', which
+// start 'position' bytes into the range being cut
+// Returns 0 to continue or -1 to stop with an error
+typedef int (*chunk_fn_t)(const unsigned char *data, size_t len, off_t position, void *arg);
+
+/*
+ * Cuts the 'nbytes' bytes of 'fd' starting at 'offset' into chunks, passing
+ * each to 'callback'. The file is read with positional reads.
+ * Returns 0 on success or -1 if an error occurs, including when the file
+ * holds fewer than 'nbytes' bytes
+ */
+static int chunk_fd(int fd, off_t offset, off_t nbytes, chunk_fn_t callback, void *arg) {
+    if (!have_gear) {
+        init_gear();
+    }
+    size_t capacity = copy_get_chunk_size();
+    if (capacity < 4 * DEDUP_MAX_CHUNK) {
+        capacity = 4 * DEDUP_MAX_CHUNK;
+    }
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    size_t start = 0;
+    size_t end = 0;
+    off_t position = 0;
+    off_t unread = nbytes;
+    int result = 0;
+    while (result == 0) {
+        // Keep at least a whole chunk buffered until the input runs out
+        if (end - start < DEDUP_MAX_CHUNK && unread > 0) {
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            size_t want = capacity - end < (size_t) unread ? capacity - end : (size_t) unread;
+            off_t read_offset = offset + nbytes - unread;
+            ssize_t bytes_read = read_all(fd, &read_offset, buffer + end, want);
+            if (bytes_read != (ssize_t) want) {
+                if (bytes_read >= 0) {
+                    errno = ENODATA;
+                }
+                result = -1;
+                break;
+            }
+            end += want;
+            unread -= want;
+        }
+        if (start == end) {
+            break;
+        }
+        size_t len = chunk_length(buffer + start, end - start);
+        result = callback(buffer + start, len, position, arg);
+        start += len;
+        position += len;
+    }
+    free(buffer);
+    return result;
+}
+
+static uint64_t fingerprint(const unsigned char *data, size_t len) {
+    content_hash_t hash;
+    content_hash_init(&hash);
+    content_hash_update(&hash, data, len);
+    return content_hash_final(&hash);
+}
+
+void dedup_table_init(dedup_table_t *table) {
+    table->chunks = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->slots = NULL;
+    table->num_slots = 0;
+}
+
+void dedup_table_free(dedup_table_t *table) {
+    free(table->chunks);
+    free(table->slots);
+    dedup_table_init(table);
+}
+
+// Returns the position in 'table' of the first chunk added with
+// 'fingerprint' and 'length', or -1 if there is none
+static int table_find(const dedup_table_t *table, uint64_t fingerprint, size_t length) {
+    if (table->num_slots == 0) {
+        return -1;
+    }
+    int mask = table->num_slots - 1;
+    for (int slot = fingerprint & mask; table->slots[slot] >= 0; slot = (slot + 1) & mask) {
+        const dedup_chunk_t *chunk = &table->chunks[table->slots[slot]];
+        if (chunk->fingerprint == fingerprint && chunk->length == length) {
+            return table->slots[slot];
+        }
+    }
+    return -1;
+}
+
+/*
+ * Adds a chunk to 'table', keeping its hash table at most half full
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int table_add(dedup_table_t *table, const dedup_chunk_t *chunk) {
+    if (table->count == table->capacity) {
+        int capacity = table->capacity > 0 ? table->capacity * 2 : INITIAL_CAPACITY;
+        dedup_chunk_t *chunks = realloc(table->chunks, sizeof(dedup_chunk_t) * capacity);
+        if (chunks == NULL) {
+            return -1;
+        }
+        table->chunks = chunks;
+        table->capacity = capacity;
+    }
+    if (2 * (table->count + 1) > table->num_slots) {
+        int num_slots = table->num_slots > 0 ? table->num_slots * 2 : 2 * INITIAL_CAPACITY;
+        int *slots = malloc(sizeof(int) * num_slots);
+        if (slots == NULL) {
+            return -1;
+        }
+        memset(slots, -1, sizeof(int) * num_slots);
+        for (int i = 0; i < table->count; i++) {
+            int slot = table->chunks[i].fingerprint & (num_slots - 1);
+            while (slots[slot] >= 0) {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+            slots[slot] = i;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->num_slots = num_slots;
+    }
+
+    int slot = chunk->fingerprint & (table->num_slots - 1);
+    while (table->slots[slot] >= 0) {
+        slot = (slot + 1) & (table->num_slots - 1);
+    }
+    table->slots[slot] = table->count;
+    table->chunks[table->count++] = *chunk;
+    return 0;
+}
+
+// Where dedup_table_scan adds the chunks it finds
+typedef struct {
+    dedup_table_t *table;
+    off_t offset;
+} scan_job_t;
+
+static int scan_chunk(const unsigned char *data, size_t len, off_t position, void *arg) {
+    scan_job_t *job = arg;
+    uint64_t print = fingerprint(data, len);
+    if (table_find(job->table, print, len) >= 0) {
+        return 0;
+    }
+    dedup_chunk_t chunk = {.fingerprint = print, .length = len,
+                           .location = job->offset + position, .new_offset = 0};
+    return table_add(job->table, &chunk);
+}
+
+int dedup_table_scan(dedup_table_t *table, int fd, off_t offset, off_t nbytes) {
+    scan_job_t job = {.table = table, .offset = offset};
+    return chunk_fd(fd, offset, nbytes, scan_chunk, &job);
+}
+
+void dedup_plan_init(dedup_plan_t *plan) {
+    plan->pieces = NULL;
+    plan->num_pieces = 0;
+    plan->capacity = 0;
+    sparse_map_init(&plan->new_data);
+    plan->new_size = 0;
+    plan->first_new = 0;
+}
+
+void dedup_plan_free(dedup_plan_t *plan) {
+    free(plan->pieces);
+    sparse_map_free(&plan->new_data);
+    dedup_plan_init(plan);
+}
+
+/*
+ * Appends a piece to 'plan', extending the last one if it continues it
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int add_piece(dedup_plan_t *plan, int is_new, off_t position, off_t length) {
+    if (plan->num_pieces > 0) {
+        dedup_piece_t *last = &plan->pieces[plan->num_pieces - 1];
+        if (last->is_new == is_new && last->position + last->length == position) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (plan->num_pieces == plan->capacity) {
+        int capacity = plan->capacity > 0 ? plan->capacity * 2 : INITIAL_CAPACITY;
+        dedup_piece_t *pieces = realloc(plan->pieces, sizeof(dedup_piece_t) * capacity);
+        if (pieces == NULL) {
+            return -1;
+        }
+        plan->pieces = pieces;
+        plan->capacity = capacity;
+    }
+    plan->pieces[plan->num_pieces++] =
+        (dedup_piece_t){.is_new = is_new, .position = position, .length = length};
+    return 0;
+}
+
+// Everything plan_chunk needs
+typedef struct {
+    dedup_table_t *table;
+    int fd;
+    dedup_read_fn_t read_stored;
+    void *arg;
+    dedup_plan_t *plan;
+    // Holds the stored copy of a matching chunk while it is compared
+    unsigned char stored[DEDUP_MAX_CHUNK];
+} plan_job_t;
+
+/*
+ * Adds the chunk of 'len' bytes at 'data', found at 'position' in the file,
+ * to the plan of 'arg' (a plan_job_t): as a reference to an identical chunk
+ * already in the table, or else as new data
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int plan_chunk(const unsigned char *data, size_t len, off_t position, void *arg) {
+    plan_job_t *job = arg;
+    dedup_plan_t *plan = job->plan;
+    uint64_t print = fingerprint(data, len);
+    int found = table_find(job->table, print, len);
+    if (found >= 0) {
+        // A chunk pending for this same file is still only in the file
+        const dedup_chunk_t *chunk = &job->table->chunks[found];
+        int pending = found >= plan->first_new;
+        off_t location = chunk->location;
+        if (pending ? read_all(job->fd, &location, job->stored, len) != (ssize_t) len
+                    : job->read_stored(job->stored, len, location, job->arg) != 0) {
+            return -1;
+        }
+        if (memcmp(job->stored, data, len) == 0) {
+            return add_piece(plan, pending, pending ? chunk->new_offset : chunk->location, len);
+        }
+    }
+
+    dedup_chunk_t chunk = {.fingerprint = print, .length = len, .location = position,
+                           .new_offset = plan->new_size};
+    if (table_add(job->table, &chunk) != 0 || add_piece(plan, 1, plan->new_size, len) != 0) {
+        return -1;
+    }
+    sparse_map_t *new_data = &plan->new_data;
+    sparse_region_t *last = new_data->count > 0 ? &new_data->regions[new_data->count - 1] : NULL;
+    if (last != NULL && last->offset + last->size == position) {
+        last->size += len;
+    } else if (sparse_map_add(new_data, position, len) != 0) {
+        return -1;
+    }
+    plan->new_size += len;
+    return 0;
+}
+
+int dedup_plan_file(dedup_table_t *table, int fd, off_t size, dedup_read_fn_t read_stored,
+                    void *arg, dedup_plan_t *plan) {
+    plan_job_t *job = malloc(sizeof(plan_job_t));
+    if (job == NULL) {
+        return -1;
+    }
+    *job = (plan_job_t){.table = table, .fd = fd, .read_stored = read_stored, .arg = arg,
+                        .plan = plan};
+    plan->first_new = table->count;
+    plan->new_data.real_size = size;
+    int result = chunk_fd(fd, 0, size, plan_chunk, job);
+    free(job);
+    return result;
+}
+
+void dedup_plan_commit(dedup_table_t *table, const dedup_plan_t *plan, off_t data_offset,
+                       int whole) {
+    for (int i = plan->first_new; i < table->count; i++) {
+        dedup_chunk_t *chunk = &table->chunks[i];
+        chunk->location = data_offset + (whole ? chunk->location : chunk->new_offset);
+        chunk->new_offset = 0;
+    }
+}
+
+int dedup_plan_extents(const dedup_plan_t *plan, off_t data_offset, sparse_map_t *extents) {
+    for (int i = 0; i < plan->num_pieces; i++) {
+        const dedup_piece_t *piece = &plan->pieces[i];
+        off_t offset = piece->is_new ? data_offset + piece->position : piece->position;
+        sparse_region_t *last =
+            extents->count > 0 ? &extents->regions[extents->count - 1] : NULL;
+        if (last != NULL && last->offset + last->size == offset) {
+            last->size += piece->length;
+        } else if (sparse_map_add(extents, offset, piece->length) != 0) {
+            sparse_map_free(extents);
+            return -1;
+        }
+        extents->real_size += piece->length;
+    }
+    return 0;
+}
+
+int dedup_map_decode(const char *data, size_t len, sparse_map_t *extents, size_t *map_len) {
+    int result = sparse_map_parse(data, len, 0, extents, map_len);
+    // The file is the extents back to back
+    for (int i = 0; result == 0 && i < extents->count; i++) {
+        if (extents->regions[i].size > INT64_MAX - extents->real_size) {
+            sparse_map_free(extents);
+            result = -1;
+        } else {
+            extents->real_size += extents->regions[i].size;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sparse.h"
+
+/*
+ * Deduplication of member data within one archive. A file is cut into
+ * chunks wherever a rolling hash of the bytes just read matches a pattern
+ * (content-defined chunking), so the cuts follow the content: an insertion
+ * near the start of a file only changes the chunks around it. Each chunk is
+ * looked up by fingerprint in a table of chunks already in the archive, and
+ * a match is confirmed byte for byte before it is used.
+ *
+ * A deduplicated member is stored much like a sparse one (see sparse.h): its
+ * data starts with a map, padded to whole blocks, and continues with only
+ * the chunks that were new. The map has the same text form as a sparse map,
+ * but its regions are the extents the file is rebuilt from, in file order:
+ * each is an offset within the (uncompressed) archive and a length, pointing
+ * into the data of an earlier member or of the member itself. The member's
+ * extended header gives the size of the file in a "MINITAR.dedup.realsize"
+ * record. Other tar programs extract such a member as its stored data.
+ */
+
+// Key of the extended header record marking a deduplicated member
+#define DEDUP_SIZE_KEY "MINITAR.dedup.realsize"
+
+// Bounds on chunk length; past the minimum, a cut comes every 8 KiB or so
+#define DEDUP_MIN_CHUNK (2 << 10)
+#define DEDUP_MAX_CHUNK (64 << 10)
+
+// One chunk known to be stored in the archive
+typedef struct {
+    uint64_t fingerprint;
+    uint32_t length;
+    // Offset of the chunk in the archive or, while it is pending (see
+    // dedup_plan_file), its offset in the file being planned
+    off_t location;
+    // For a pending chunk, its offset within the new data of its file
+    off_t new_offset;
+} dedup_chunk_t;
+
+// Fingerprints of all chunks stored in an archive during one operation
+typedef struct {
+    // Chunks in the order they were added
+    dedup_chunk_t *chunks;
+    int count;
+    int capacity;
+    // Hash table of positions in 'chunks' (-1 marks an empty slot);
+    // 'num_slots' is a power of two
+    int *slots;
+    int num_slots;
+} dedup_table_t;
+
+// Initialize an empty table
+void dedup_table_init(dedup_table_t *table);
+
+// Free the memory held by 'table', leaving it empty
+void dedup_table_free(dedup_table_t *table);
+
+// Cut the 'nbytes' bytes of 'fd' starting at 'offset', which are stored at
+// the same offset in the archive, into chunks and add each one to 'table'
+// Returns 0 on success or -1 if an error occurs
+int dedup_table_scan(dedup_table_t *table, int fd, off_t offset, off_t nbytes);
+
+// Reads the 'len' bytes stored at 'location' in the archive into 'buf'
+// Returns 0 on success or -1 if an error occurs
+typedef int (*dedup_read_fn_t)(void *buf, size_t len, off_t location, void *arg);
+
+// One piece of a planned file: 'length' bytes found at 'position', which is
+// an offset in the archive, or an offset within the file's new data if
+// 'is_new' is set
+typedef struct {
+    int is_new;
+    off_t position;
+    off_t length;
+} dedup_piece_t;
+
+// How a file is to be stored with deduplication
+typedef struct {
+    // Pieces the file is rebuilt from, in order
+    dedup_piece_t *pieces;
+    int num_pieces;
+    int capacity;
+    // The ranges of the file holding new chunks, which are stored back to
+    // back as the member's data
+    sparse_map_t new_data;
+    off_t new_size;
+    // Chunks from this position of the table on were added for this file
+    int first_new;
+} dedup_plan_t;
+
+// Initialize an empty plan
+void dedup_plan_init(dedup_plan_t *plan);
+
+// Free the memory held by 'plan', leaving it empty
+void dedup_plan_free(dedup_plan_t *plan);
+
+/*
+ * Cut the first 'size' bytes of 'fd' into chunks and fill in the empty
+ * 'plan': chunks matching one in 'table' (whose stored bytes are read with
+ * 'read_stored') become references to it, and the rest are new data. New
+ * chunks are added to 'table' as pending, to be placed by dedup_plan_commit.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int dedup_plan_file(dedup_table_t *table, int fd, off_t size, dedup_read_fn_t read_stored,
+                    void *arg, dedup_plan_t *plan);
+
+// Record where the new chunks of 'plan' were stored: the file's new data at
+// 'data_offset' in the archive or, if 'whole' is set, the entire file there
+void dedup_plan_commit(dedup_table_t *table, const dedup_plan_t *plan, off_t data_offset,
+                       int whole);
+
+// Fill in the empty 'extents' with the archive extents the file of 'plan' is
+// rebuilt from, given that its new data is stored at 'data_offset'
+// Returns 0 on success or -1 if memory could not be allocated
+int dedup_plan_extents(const dedup_plan_t *plan, off_t data_offset, sparse_map_t *extents);
+
+// Decode the map at the start of the 'len' bytes of 'data' into the empty
+// 'extents' with sparse_map_parse, storing the number of bytes it takes up
+// (padding included) in '*map_len' and the size of the file in
+// 'extents->real_size'. Unlike sparse_map_decode, extents may come in any order.
+// Returns 0 on success, 1 if 'data' ends before the map does, or -1 if the
+// map is malformed or memory could not be allocated
+int dedup_map_decode(const char *data, size_t len, sparse_map_t *extents, size_t *map_len);
+
+#endif    // _DEDUP_H
@@ -5,50 +5,102 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define MIN_SLOTS 64
+
 void file_list_init(file_list_t *list) {
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
+    list->slots = NULL;
+    list->num_slots = 0;
+    list->num_distinct = 0;
+    arena_init(&list->arena);
 }
 
-int file_list_add(file_list_t *list, const char *file_name) {
-    if (list->head == NULL) {
-        list->head = malloc(sizeof(node_t));
-        if (list->head == NULL) {
-            return 1;
+// FNV-1a hash of a file name
+static unsigned hash_name(const char *name) {
+    unsigned hash = 2166136261u;
+    for (int i = 0; name[i] != '\0'; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the slot holding 'name' or the empty slot where it belongs
+static node_t **find_slot(node_t **slots, int num_slots, const char *name, unsigned hash) {
+    unsigned mask = num_slots - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i] == NULL ||
+            (slots[i]->hash == hash && strcmp(slots[i]->name, name) == 0)) {
+            return &slots[i];
         }
-        strncpy(list->head->name, file_name, MAX_NAME_LEN);
-        list->head->next = NULL;
-        list->size = 1;
-        return 0;
     }
+}
 
-    node_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
+// Double the hash set's capacity, rehashing every distinct name
+// Returns 0 on success or 1 if an error occurs
+static int grow_slots(file_list_t *list) {
+    int num_slots = list->num_slots == 0 ? MIN_SLOTS : list->num_slots * 2;
+    node_t **slots = calloc(num_slots, sizeof(node_t *));
+    if (slots == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < list->num_slots; i++) {
+        if (list->slots[i] != NULL) {
+            *find_slot(slots, num_slots, list->slots[i]->name, list->slots[i]->hash) =
+                list->slots[i];
+        }
+    }
+    free(list->slots);
+    list->slots = slots;
+    list->num_slots = num_slots;
+    return 0;
+}
+
+int file_list_add(file_list_t *list, const char *file_name) {
+    // Keep the hash set at most half full so probe sequences stay short
+    if ((list->num_distinct + 1) * 2 > list->num_slots && grow_slots(list) != 0) {
+        return 1;
     }
-    current->next = malloc(sizeof(node_t));
-    if (current->next == NULL) {
+
+    node_t *node = arena_alloc(&list->arena, sizeof(node_t));
+    if (node == NULL) {
+        return 1;
+    }
+    node->name = arena_strndup(&list->arena, file_name, strlen(file_name));
+    if (node->name == NULL) {
         return 1;
     }
-    strncpy(current->next->name, file_name, MAX_NAME_LEN);
-    current->next->next = NULL;
+    node->hash = hash_name(node->name);
+    node->next = NULL;
+
+    // Only the first node with a given name goes in the hash set
+    node_t **slot = find_slot(list->slots, list->num_slots, node->name, node->hash);
+    if (*slot == NULL) {
+        *slot = node;
+        list->num_distinct++;
+    }
+
+    if (list->tail == NULL) {
+        list->head = node;
+    } else {
+        list->tail->next = node;
+    }
+    list->tail = node;
     list->size++;
     return 0;
 }
 
 int file_list_contains(const file_list_t *list, const char *file_name) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->name, file_name) == 0) {
-            return 1;
-        }
-        current = current->next;
+    if (list->num_slots == 0) {
+        return 0;
     }
-    return 0;
+    return *find_slot(list->slots, list->num_slots, file_name, hash_name(file_name)) != NULL;
 }
 
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
-    // This approach is not particularly efficient
+    // Each lookup is a hash probe, so this is linear in the size of l1
     node_t *current = l1->head;
     while (current != NULL) {
         if (!file_list_contains(l2, current->name)) {
@@ -60,12 +112,7 @@ int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
 }
 
 void file_list_clear(file_list_t *list) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        node_t *to_free = current;
-        current = current->next;
-        free(to_free);
-    }
-    list->head = NULL;
-    list->size = 0;
+    arena_clear(&list->arena);
+    free(list->slots);
+    file_list_init(list);
 }
@@ -3,18 +3,30 @@
 #ifndef _FILE_LIST_H
 #define _FILE_LIST_H
 
-#define MAX_NAME_LEN 32
+#include "arena.h"
 
 //  Definition of each node in the linked list
 typedef struct node {
-    char name[MAX_NAME_LEN];
+    // Full file name, stored in the list's arena
+    char *name;
     struct node *next;
+    // Hash of 'name', kept so lookups only compare names whose hashes match
+    unsigned hash;
 } node_t;
 
 // Linked list definition
+// Alongside the list itself, an open-addressing hash set holds one node for
+// each distinct name, so membership tests do not need to walk the list
 typedef struct {
     node_t *head;
+    node_t *tail;
     int size;
+    // Hash set of nodes with distinct names; 'num_slots' is a power of two
+    node_t **slots;
+    int num_slots;
+    int num_distinct;
+    // Holds every node and name; freed all at once by file_list_clear
+    arena_t arena;
 } file_list_t;
 
 // Initialize a new, empty list
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "file_walk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define INITIAL_PATH_CAPACITY 256
+#define INITIAL_ENTRY_CAPACITY 64
+
+// Opening with O_NONBLOCK keeps a FIFO that slipped in between readdir and
+// open from blocking the walk; it is skipped once fstat shows what it is
+#define OPEN_FLAGS (O_RDONLY | O_CLOEXEC | O_NONBLOCK)
+
+// Name of the member being visited, built up one path component at a time
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} path_buf_t;
+
+// One directory entry waiting to be visited
+typedef struct {
+    char *name;
+    unsigned char type;
+} dir_entry_t;
+
+/*
+ * Appends the first 'len' bytes of 'str' to 'path'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int path_append(path_buf_t *path, const char *str, size_t len) {
+    if (path->len + len + 1 > path->capacity) {
+        size_t new_capacity = path->capacity == 0 ? INITIAL_PATH_CAPACITY : path->capacity;
+        while (path->len + len + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *data = realloc(path->data, new_capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        path->data = data;
+        path->capacity = new_capacity;
+    }
+    memcpy(path->data + path->len, str, len);
+    path->len += len;
+    path->data[path->len] = '\0';
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const dir_entry_t *) a)->name, ((const dir_entry_t *) b)->name);
+}
+
+static int visit(int fd, path_buf_t *path, record_fn_t callback, void *arg);
+
+/*
+ * Visits everything inside the directory open as 'dir_fd', whose member name
+ * (ending in '/') is held in 'path'. Takes ownership of 'dir_fd'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int walk_dir(int dir_fd, path_buf_t *path, record_fn_t callback, void *arg) {
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        fprintf(stderr, "Error: Failed to read directory %s: %s\n", path->data, strerror(errno));
+        close(dir_fd);
+        return -1;
+    }
+
+    // Entries are visited in name order so that archiving the same tree
+    // always produces the same archive
+    arena_t arena;
+    arena_init(&arena);
+    dir_entry_t *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int result = 0;
+    struct dirent *dirent;
+    errno = 0;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t new_capacity = capacity == 0 ? INITIAL_ENTRY_CAPACITY : capacity * 2;
+            dir_entry_t *new_entries = realloc(entries, sizeof(dir_entry_t) * new_capacity);
+            if (new_entries == NULL) {
+                result = -1;
+                break;
+            }
+            entries = new_entries;
+            capacity = new_capacity;
+        }
+        entries[count].name = arena_strndup(&arena, dirent->d_name, strlen(dirent->d_name));
+        entries[count].type = dirent->d_type;
+        if (entries[count].name == NULL) {
+            result = -1;
+            break;
+        }
+        count++;
+        errno = 0;
+    }
+    if (result != 0 || errno != 0) {
+        fprintf(stderr, "Error: Failed to read directory %s: %s\n", path->data, strerror(errno));
+        result = -1;
+    }
+
+    if (result == 0) {
+        qsort(entries, count, sizeof(dir_entry_t), compare_entries);
+    }
+    size_t dir_len = path->len;
+    for (size_t i = 0; result == 0 && i < count; i++) {
+        path->len = dir_len;
+        if (path_append(path, entries[i].name, strlen(entries[i].name)) != 0) {
+            perror("Error: Failed to allocate member name");
+            result = -1;
+            break;
+        }
+        // readdir usually reports the type already, which saves opening
+        // entries that would only be skipped
+        if (entries[i].type != DT_UNKNOWN && entries[i].type != DT_REG &&
+            entries[i].type != DT_DIR) {
+            fprintf(stderr, "Warning: Skipping %s: not a regular file or directory\n",
+                    path->data);
+            continue;
+        }
+        // Symbolic links inside a directory are never followed
+        STATS_START(timer);
+        int fd = openat(dirfd(dir), entries[i].name, OPEN_FLAGS | O_NOFOLLOW);
+        STATS_PHASE(STATS_PHASE_STAT, timer);
+        result = visit(fd, path, callback, arg);
+    }
+    path->len = dir_len;
+    path->data[dir_len] = '\0';
+
+    free(entries);
+    arena_clear(&arena);
+    closedir(dir);
+    return result;
+}
+
+/*
+ * Passes the file open as 'fd' (or, for a negative 'fd', the reason opening
+ * it failed in errno) whose member name is held in 'path' to 'callback', and
+ * walks it if it is a directory. Takes ownership of 'fd'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int visit(int fd, path_buf_t *path, record_fn_t callback, void *arg) {
+    if (fd < 0) {
+        if (errno == ELOOP) {
+            fprintf(stderr, "Warning: Skipping %s: not a regular file or directory\n",
+                    path->data);
+            return 0;
+        }
+        fprintf(stderr, "Error: Failed to open %s: %s\n", path->data, strerror(errno));
+        return -1;
+    }
+
+    file_record_t record = {.name = path->data, .fd = fd};
+    STATS_START(timer);
+    int stat_result = fstat(fd, &record.stat);
+    STATS_PHASE(STATS_PHASE_STAT, timer);
+    if (stat_result != 0) {
+        fprintf(stderr, "Error: Failed to stat %s: %s\n", path->data, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (S_ISREG(record.stat.st_mode)) {
+        int result = callback(&record, arg);
+        if (record.fd >= 0) {
+            close(record.fd);
+        }
+        return result;
+    }
+
+    if (S_ISDIR(record.stat.st_mode)) {
+        if ((path->len == 0 || path->data[path->len - 1] != '/') &&
+            path_append(path, "/", 1) != 0) {
+            perror("Error: Failed to allocate member name");
+            close(fd);
+            return -1;
+        }
+        record.name = path->data;
+        record.fd = -1;
+        if (callback(&record, arg) != 0) {
+            close(fd);
+            return -1;
+        }
+        return walk_dir(fd, path, callback, arg);
+    }
+
+    fprintf(stderr, "Warning: Skipping %s: not a regular file or directory\n", path->data);
+    close(fd);
+    return 0;
+}
+
+int walk_files(const file_list_t *paths, record_fn_t callback, void *arg) {
+    path_buf_t path = {.data = NULL, .len = 0, .capacity = 0};
+    int result = 0;
+    for (node_t *current = paths->head; current != NULL && result == 0;
+         current = current->next) {
+        path.len = 0;
+        if (path_append(&path, current->name, strlen(current->name)) != 0) {
+            perror("Error: Failed to allocate member name");
+            result = -1;
+            break;
+        }
+        // Paths named on the command line are followed if they are links
+        STATS_START(timer);
+        int fd = open(current->name, OPEN_FLAGS);
+        STATS_PHASE(STATS_PHASE_STAT, timer);
+        result = visit(fd, &path, callback, arg);
+    }
+    free(path.data);
+    return result;
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _FILE_WALK_H
+#define _FILE_WALK_H
+
+#include <sys/stat.h>
+
+#include "file_list.h"
+
+// One file or directory to be archived, opened exactly once
+typedef struct {
+    // Member name; directories end in '/'. Only valid during the callback.
+    const char *name;
+    // Descriptor the file was opened with, or -1 for a directory
+    int fd;
+    // Metadata taken from 'fd' (or the directory's descriptor) with fstat
+    struct stat stat;
+} file_record_t;
+
+// Receives each record found by walk_files. The walker closes 'record->fd'
+// once the callback returns, unless the callback sets it to -1 to keep it.
+// Returns 0 to continue or -1 to stop the walk
+typedef int (*record_fn_t)(file_record_t *record, void *arg);
+
+// Open and fstat each path in 'paths' in order, passing a record for each to
+// 'callback'. A directory is passed on first, followed by everything beneath
+// it in name order. Inside directories, files are opened relative to their
+// parent's descriptor, and anything other than regular files and directories
+// (symbolic links, devices, sockets...) is skipped with a warning.
+// Returns 0 on success or -1 if an error occurs or the callback fails
+int walk_files(const file_list_t *paths, record_fn_t callback, void *arg);
+
+#endif    // _FILE_WALK_H
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "header_codec.h"
+
+#include <string.h>
+
+// Octal digits of 0 through 63, two characters each, so that encoding
+// produces two digits per step
+static const char octal_pairs[] =
+    "00010203040506071011121314151617202122232425262730313233343536374041424344454647"
+    "505152535455565760616263646566677071727374757677";
+
+// Selects the low byte of each 16-bit lane of a 64-bit word
+#define EVEN_BYTES 0x00FF00FF00FF00FFULL
+// Selects the low bit of each byte of a 64-bit word
+#define LOW_BITS 0x0101010101010101ULL
+
+int header_encode_octal(char *field, size_t width, uint64_t value) {
+    size_t pos = width - 1;
+    field[pos] = '\0';
+    while (pos >= 2) {
+        pos -= 2;
+        memcpy(field + pos, &octal_pairs[(value & 077) * 2], 2);
+        value >>= 6;
+    }
+    if (pos == 1) {
+        field[0] = '0' + (value & 07);
+        value >>= 3;
+    }
+    return value == 0 ? 0 : -1;
+}
+
+int header_encode_number(char *field, size_t width, uint64_t value) {
+    if (header_encode_octal(field, width, value) == 0) {
+        return 0;
+    }
+
+    unsigned char *bytes = (unsigned char *) field;
+    for (size_t i = width - 1; i > 0; i--) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+    bytes[0] = 0x80;
+    return value == 0 ? 0 : -1;
+}
+
+int header_decode_number(const char *field, size_t width, uint64_t *value) {
+    const unsigned char *bytes = (const unsigned char *) field;
+    uint64_t result = 0;
+
+    if (bytes[0] & 0x80) {
+        // Base-256; a first byte of 0xFF would mark a negative number
+        if (bytes[0] != 0x80) {
+            return -1;
+        }
+        for (size_t i = 1; i < width; i++) {
+            if (result >> 56) {
+                return -1;
+            }
+            result = (result << 8) | bytes[i];
+        }
+        *value = result;
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < width && bytes[i] == ' ') {
+        i++;
+    }
+    size_t first_digit = i;
+    for (; i < width; i++) {
+        unsigned digit = bytes[i] - '0';
+        if (digit > 7) {
+            break;
+        }
+        result = (result << 3) | digit;
+    }
+    if (i == first_digit || (i < width && bytes[i] != ' ' && bytes[i] != '\0')) {
+        return -1;
+    }
+    *value = result;
+    return 0;
+}
+
+/*
+ * Sums the bytes of 'header' eight at a time, spreading each word's bytes
+ * over 16-bit lanes that cannot overflow within a single 512-byte block.
+ * '*unsigned_sum' receives the sum of the bytes as unsigned values and
+ * '*num_high' the number of bytes with their top bit set, from which the sum
+ * of the bytes as signed values follows.
+ */
+static void sum_block(const tar_header *header, unsigned *unsigned_sum, unsigned *num_high) {
+    const unsigned char *bytes = (const unsigned char *) header;
+    uint64_t lanes = 0;
+    uint64_t high = 0;
+    for (size_t i = 0; i < sizeof(tar_header); i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        lanes += (word & EVEN_BYTES) + ((word >> 8) & EVEN_BYTES);
+        high += (word >> 7) & LOW_BITS;
+    }
+
+    unsigned sum = 0;
+    for (int shift = 0; shift < 64; shift += 16) {
+        sum += (lanes >> shift) & 0xFFFF;
+    }
+    unsigned count = 0;
+    for (int shift = 0; shift < 64; shift += 8) {
+        count += (high >> shift) & 0xFF;
+    }
+
+    // The checksum field itself counts as eight spaces
+    for (size_t i = 0; i < sizeof(header->chksum); i++) {
+        unsigned char byte = header->chksum[i];
+        sum += ' ' - byte;
+        count -= byte >> 7;
+    }
+    *unsigned_sum = sum;
+    *num_high = count;
+}
+
+unsigned header_checksum(const tar_header *header) {
+    unsigned sum;
+    unsigned num_high;
+    sum_block(header, &sum, &num_high);
+    return sum;
+}
+
+void header_set_checksum(tar_header *header) {
+    // A sum over 512 bytes always fits in the field's seven digits
+    header_encode_octal(header->chksum, sizeof(header->chksum), header_checksum(header));
+}
+
+int header_verify_checksum(const tar_header *header) {
+    uint64_t stored;
+    if (header_decode_number(header->chksum, sizeof(header->chksum), &stored) != 0) {
+        return -1;
+    }
+    unsigned sum;
+    unsigned num_high;
+    sum_block(header, &sum, &num_high);
+    // Each byte with its top bit set is 256 less when taken as signed
+    int64_t signed_sum = (int64_t) sum - 256 * (int64_t) num_high;
+    if (stored == sum || (int64_t) stored == signed_sum) {
+        return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _HEADER_CODEC_H
+#define _HEADER_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minitar.h"
+
+/*
+ * Encoding and decoding of the numeric fields of a tar header, and of its
+ * checksum. Every header written or read by minitar passes through these
+ * functions, so they avoid the stdio formatting and parsing routines.
+ */
+
+// Store 'value' in the 'width'-byte field as 'width' - 1 zero-padded octal
+// digits followed by a null byte
+// Returns 0 on success or -1 if 'value' needs more digits than the field holds
+int header_encode_octal(char *field, size_t width, uint64_t value);
+
+// Store 'value' in the 'width'-byte field as octal if it fits, otherwise in
+// the GNU base-256 encoding (the high bit of the first byte is set and the
+// value follows as a big-endian binary number)
+// Returns 0 on success or -1 if 'value' cannot be represented at all
+int header_encode_number(char *field, size_t width, uint64_t value);
+
+// Read the number held in the 'width'-byte field, accepting octal digits
+// (optionally surrounded by spaces and ending in a space or null byte) or the
+// base-256 encoding of a non-negative number
+// Returns 0 on success or -1 if the field is malformed
+int header_decode_number(const char *field, size_t width, uint64_t *value);
+
+// Returns the sum of all bytes of 'header', taken as unsigned values, with
+// the checksum field counted as if it held eight spaces
+unsigned header_checksum(const tar_header *header);
+
+// Compute the checksum of 'header' and store it in its checksum field
+void header_set_checksum(tar_header *header);
+
+// Returns 0 if the checksum field of 'header' matches its contents or -1 if
+// not. Sums taken over signed bytes, as written by some older tar
+// implementations, are accepted too.
+int header_verify_checksum(const tar_header *header);
+
+#endif    // _HEADER_CODEC_H
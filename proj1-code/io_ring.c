@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "io_ring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "stats.h"
+
+// Most operations in flight at once, which is also the number of submission
+// queue entries
+#define QUEUE_DEPTH 64
+// Number of buffers chunks are read into, each of the copy chunk size
+#define NUM_BUFFERS 16
+// Most copies in progress at once; each needs at least one operation in flight
+#define MAX_ACTIVE QUEUE_DEPTH
+#define PAGE_ALIGN 4096
+
+// The mapped submission and completion queues of one io_uring instance
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // Entries queued but not yet passed to the kernel
+    unsigned to_submit;
+} ring_t;
+
+// A copy in progress
+typedef struct {
+    io_copy_t copy;
+    int in_use;
+    // Bytes handed to operations so far, and bytes fully written
+    off_t issued;
+    off_t completed;
+    // Number of this copy's operations in flight
+    int outstanding;
+    // errno of the first operation that failed, or 0
+    int error;
+} active_copy_t;
+
+// One chunk being moved: read into a buffer, then written out of it
+typedef struct {
+    int copy;
+    // Buffer holding the chunk, or -1 for a write straight from the source
+    int buffer;
+    int writing;
+    // Offset of the chunk within its copy and its length
+    off_t position;
+    size_t length;
+    // Bytes of the current read or write already done, after short transfers
+    size_t done;
+} ring_op_t;
+
+// Everything io_ring_run works with
+typedef struct {
+    ring_t ring;
+    // Whether the buffers are registered with the kernel for fixed reads and writes
+    int fixed;
+    char *buffers;
+    size_t buffer_size;
+    int free_buffers[NUM_BUFFERS];
+    int num_free_buffers;
+    ring_op_t ops[QUEUE_DEPTH];
+    int free_ops[QUEUE_DEPTH];
+    int num_free_ops;
+    active_copy_t active[MAX_ACTIVE];
+    // Copy currently being split into chunks, or -1
+    int feeding;
+    // Set once 'next' has no more copies, or copies must no longer start
+    int exhausted;
+    int failed;
+    io_next_fn_t next;
+    io_done_fn_t done;
+    void *arg;
+} engine_t;
+
+static int ring_setup(ring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if (!single_mmap && ring->cq_ring != MAP_FAILED) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+static void ring_free(ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Queue a read or write of 'len' bytes at 'addr' for operation 'op'; there
+// is always a free entry, since no more than QUEUE_DEPTH operations exist
+static void ring_queue(engine_t *engine, int op, int write, int fd, off_t offset, void *addr,
+                       size_t len, int buffer) {
+    ring_t *ring = &engine->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    if (engine->fixed && buffer >= 0) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buffer;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long) addr;
+    sqe->len = len;
+    sqe->user_data = op;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/*
+ * Queues the rest of the current read or write of operation 'op'
+ */
+static void queue_op(engine_t *engine, int op) {
+    ring_op_t *ring_op = &engine->ops[op];
+    const io_copy_t *copy = &engine->active[ring_op->copy].copy;
+    char *data = ring_op->buffer >= 0
+                     ? engine->buffers + (size_t) ring_op->buffer * engine->buffer_size
+                     : (char *) copy->source + ring_op->position;
+    off_t offset = ring_op->position + ring_op->done;
+    if (ring_op->writing) {
+        ring_queue(engine, op, 1, copy->out_fd, copy->out_offset + offset, data + ring_op->done,
+                   ring_op->length - ring_op->done, ring_op->buffer);
+    } else {
+        ring_queue(engine, op, 0, copy->in_fd, copy->in_offset + offset, data + ring_op->done,
+                   ring_op->length - ring_op->done, ring_op->buffer);
+    }
+}
+
+/*
+ * Reports active copy 'index' to the caller if none of its operations are
+ * still in flight and it either failed or was completely written
+ */
+static void finish_copy(engine_t *engine, int index) {
+    active_copy_t *active = &engine->active[index];
+    int complete = active->error == 0 && active->completed == active->copy.nbytes;
+    if (active->outstanding > 0 || (!complete && active->error == 0)) {
+        return;
+    }
+    errno = active->error;
+    if (engine->done(&active->copy, complete ? 0 : -1, engine->arg) != 0) {
+        engine->failed = 1;
+        engine->exhausted = 1;
+    }
+    active->in_use = 0;
+    if (engine->feeding == index) {
+        engine->feeding = -1;
+    }
+}
+
+/*
+ * Makes sure 'engine->feeding' is a copy with chunks left to start, taking
+ * the next copy from the caller once the current one is fully under way
+ * Returns 1 if there is a copy to feed, 0 otherwise
+ */
+static int pick_copy(engine_t *engine) {
+    if (engine->feeding >= 0) {
+        active_copy_t *active = &engine->active[engine->feeding];
+        if (active->error == 0 && active->issued < active->copy.nbytes) {
+            return 1;
+        }
+        engine->feeding = -1;
+    }
+    while (!engine->exhausted) {
+        int index = 0;
+        while (index < MAX_ACTIVE && engine->active[index].in_use) {
+            index++;
+        }
+        if (index == MAX_ACTIVE) {
+            return 0;
+        }
+        active_copy_t *active = &engine->active[index];
+        int result = engine->next(&active->copy, engine->arg);
+        if (result <= 0) {
+            engine->exhausted = 1;
+            engine->failed |= result < 0;
+            return 0;
+        }
+        active->in_use = 1;
+        active->issued = 0;
+        active->completed = 0;
+        active->outstanding = 0;
+        active->error = 0;
+        if (active->copy.nbytes == 0) {
+            finish_copy(engine, index);
+            continue;
+        }
+        engine->feeding = index;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Starts as many chunks as there are free operations and buffers for
+ */
+static void feed(engine_t *engine) {
+    while (engine->num_free_ops > 0 && pick_copy(engine)) {
+        active_copy_t *active = &engine->active[engine->feeding];
+        int from_source = active->copy.in_fd < 0;
+        if (!from_source && engine->num_free_buffers == 0) {
+            return;
+        }
+
+        int op = engine->free_ops[--engine->num_free_ops];
+        ring_op_t *ring_op = &engine->ops[op];
+        off_t remaining = active->copy.nbytes - active->issued;
+        ring_op->copy = engine->feeding;
+        ring_op->buffer = from_source ? -1 : engine->free_buffers[--engine->num_free_buffers];
+        ring_op->writing = from_source;
+        ring_op->position = active->issued;
+        ring_op->length =
+            remaining < (off_t) engine->buffer_size ? (size_t) remaining : engine->buffer_size;
+        ring_op->done = 0;
+        active->issued += ring_op->length;
+        active->outstanding++;
+        queue_op(engine, op);
+    }
+}
+
+// Returns operation 'op' and its buffer to the free lists
+static void release_op(engine_t *engine, int op) {
+    ring_op_t *ring_op = &engine->ops[op];
+    if (ring_op->buffer >= 0) {
+        engine->free_buffers[engine->num_free_buffers++] = ring_op->buffer;
+    }
+    engine->free_ops[engine->num_free_ops++] = op;
+    engine->active[ring_op->copy].outstanding--;
+    finish_copy(engine, ring_op->copy);
+}
+
+/*
+ * Handles the completion of operation 'op' with result 'res': moves a chunk
+ * that was read on to being written, continues a short transfer, or
+ * finishes the chunk
+ */
+static void complete_op(engine_t *engine, int op, int res) {
+    ring_op_t *ring_op = &engine->ops[op];
+    active_copy_t *active = &engine->active[ring_op->copy];
+    if (res <= 0) {
+        // A read of nothing means the source is shorter than promised
+        int error = res < 0 ? -res : ring_op->writing ? EIO : ENODATA;
+        if (active->error == 0) {
+            active->error = error;
+        }
+        release_op(engine, op);
+        return;
+    }
+
+    STATS_COUNT(ring_op->writing ? STATS_BYTES_WRITTEN : STATS_BYTES_READ, res);
+    ring_op->done += res;
+    if (ring_op->done < ring_op->length) {
+        queue_op(engine, op);
+    } else if (!ring_op->writing) {
+        ring_op->writing = 1;
+        ring_op->done = 0;
+        queue_op(engine, op);
+    } else {
+        active->completed += ring_op->length;
+        release_op(engine, op);
+    }
+}
+
+/*
+ * Passes queued entries to the kernel and waits for at least one completion,
+ * then handles every completion available
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int submit_and_reap(engine_t *engine) {
+    ring_t *ring = &engine->ring;
+    STATS_START(timer);
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+    STATS_PHASE(STATS_PHASE_COPY, timer);
+    STATS_COUNT(STATS_RING_ENTERS, 1);
+    if (submitted < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    ring->to_submit -= submitted;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        int op = cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        complete_op(engine, op, res);
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+int io_ring_run(io_next_fn_t next, io_done_fn_t done, void *arg) {
+    engine_t *engine = calloc(1, sizeof(engine_t));
+    if (engine == NULL) {
+        return -1;
+    }
+    if (ring_setup(&engine->ring, QUEUE_DEPTH) != 0) {
+        free(engine);
+        return 1;
+    }
+    engine->buffer_size = copy_get_chunk_size();
+    if (posix_memalign((void **) &engine->buffers, PAGE_ALIGN,
+                       engine->buffer_size * NUM_BUFFERS) != 0) {
+        ring_free(&engine->ring);
+        free(engine);
+        return -1;
+    }
+
+    // Registered buffers save the kernel mapping them on every operation;
+    // without them (e.g. over the locked memory limit) plain reads and
+    // writes do the same job
+    struct iovec iovecs[NUM_BUFFERS];
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        iovecs[i].iov_base = engine->buffers + (size_t) i * engine->buffer_size;
+        iovecs[i].iov_len = engine->buffer_size;
+        engine->free_buffers[i] = i;
+    }
+    engine->fixed = syscall(__NR_io_uring_register, engine->ring.fd, IORING_REGISTER_BUFFERS,
+                            iovecs, NUM_BUFFERS) == 0;
+    engine->num_free_buffers = NUM_BUFFERS;
+    for (int i = 0; i < QUEUE_DEPTH; i++) {
+        engine->free_ops[i] = i;
+    }
+    engine->num_free_ops = QUEUE_DEPTH;
+    engine->feeding = -1;
+    engine->next = next;
+    engine->done = done;
+    engine->arg = arg;
+
+    int result = 0;
+    while (1) {
+        feed(engine);
+        if (engine->num_free_ops == QUEUE_DEPTH) {
+            break;
+        }
+        if (submit_and_reap(engine) != 0) {
+            // The ring itself failed, so every copy still in progress fails
+            int error = errno;
+            for (int i = 0; i < MAX_ACTIVE; i++) {
+                if (engine->active[i].in_use) {
+                    errno = error;
+                    done(&engine->active[i].copy, -1, arg);
+                }
+            }
+            result = -1;
+            break;
+        }
+    }
+
+    ring_free(&engine->ring);
+    free(engine->buffers);
+    int failed = engine->failed;
+    free(engine);
+    return result != 0 || failed ? -1 : 0;
+}
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _IO_RING_H
+#define _IO_RING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * An asynchronous copy engine built on io_uring. Copies are pulled from the
+ * caller one at a time and split into chunks; each chunk is read into one of
+ * a pool of registered buffers and then written out, with many chunks (from
+ * one copy or several) in flight at once. Reads of the next file therefore
+ * overlap with writes of the current one, and the device sees a deep queue
+ * even for a single large file.
+ */
+
+// One positional copy for the engine to carry out
+typedef struct {
+    // Source: 'nbytes' bytes of 'in_fd' from 'in_offset', or, if 'in_fd' is
+    // -1, the bytes at 'source', which must stay valid until the copy is done
+    int in_fd;
+    off_t in_offset;
+    const void *source;
+    // Destination, always written at an explicit offset
+    int out_fd;
+    off_t out_offset;
+    off_t nbytes;
+} io_copy_t;
+
+// Fills in '*copy' with the next copy to perform
+// Returns 1 if it did, 0 if there are no more copies, or -1 upon error
+typedef int (*io_next_fn_t)(io_copy_t *copy, void *arg);
+
+// Told that 'copy' finished, with 'result' 0 if all of it was written or -1
+// (and errno set) if it failed
+// Returns 0 to carry on or -1 to stop starting further copies
+typedef int (*io_done_fn_t)(const io_copy_t *copy, int result, void *arg);
+
+// Perform every copy produced by 'next', reporting each one to 'done'
+// Returns 0 once all copies are done, 1 if io_uring is not available (in
+// which case 'next' was never called), or -1 if 'next' or 'done' failed
+int io_ring_run(io_next_fn_t next, io_done_fn_t done, void *arg);
+
+#endif    // _IO_RING_H
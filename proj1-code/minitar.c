@@ -1,524 +1,3710 @@
+#define _GNU_SOURCE
 #include "minitar.h"
 
+#include "archive_index.h"
+#include "compress.h"
+#include "content_hash.h"
+#include "copy_engine.h"
+#include "dedup.h"
+#include "file_walk.h"
+#include "header_codec.h"
+#include "io_ring.h"
+#include "pax.h"
+#include "seekable_gzip.h"
+#include "sparse.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
+#include <limits.h>
 #include <math.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define NUM_TRAILING_BLOCKS 2
-#define MAX_MSG_LEN 128
 #define BLOCK_SIZE 512
+// Longest member name a header can hold: 155 bytes of prefix, a '/' and 100
+// bytes of name
+#define MAX_MEMBER_NAME_LEN 256
+// Suffix of the temporary file a compacted archive is written to
+#define COMPACT_SUFFIX ".compact.tmp"
+// Most files a parallel create keeps open between the walk and the copy
+#define MAX_KEPT_FDS 4096
+// Largest extended header accepted when reading an archive
+#define MAX_PAX_LEN (1 << 20)
+// Directories, next to the real file, named in the headers of a sparse
+// member: its tar header's, so that tars without sparse support extract the
+// stored data there, and its extended header's. These are the names GNU tar uses.
+#define SPARSE_DIR "GNUSparseFile.0"
+#define PAX_DIR "PaxHeaders"
+// Key of the extended header record holding the content hash of a member's
+// file, as 16 hex digits
+#define HASH_KEY "MINITAR.xxh64"
+// Largest size the size field of a header holds in octal, just under 8 GiB;
+// other tars may only read octal there, so larger sizes are also given in
+// the member's extended header
+#define MAX_OCTAL_SIZE 077777777777LL
+// Least space an append reserves ahead of its writes at a time
+#define RESERVE_STEP (64 << 20)
 
 // Constants for tar compatibility information
 #define MAGIC "ustar"
 
 // Constants to represent different file types
-// We'll only use regular files in this project
+// We only archive regular files and directories
 #define REGTYPE '0'
 #define DIRTYPE '5'
 
+// Number of distinct owner (or group) ids whose names are remembered
+#define ID_CACHE_SIZE 16
+
+minitar_options_t minitar_options = {
+    .num_threads = 1, .build_index = 0, .numeric_owner = 0, .check_content = 0,
+    .compression = COMPRESS_NONE, .seekable = 0, .io_engine = IO_ENGINE_SYNC,
+    .dedup = 0, .hash = 0, .mtime_ns = 0};
+
+/*
+ * Names of recently seen user or group ids, so that archiving many files with
+ * the same few owners queries the passwd/group databases (which may mean
+ * parsing /etc/passwd again or a round trip to a directory service) only once
+ * per id. Names are kept exactly as they go into a header's 32-byte field.
+ * Headers are only filled in by the main thread, so no locking is needed.
+ */
+typedef struct {
+  unsigned ids[ID_CACHE_SIZE];
+  char names[ID_CACHE_SIZE][32];
+  int count;
+  // Slot to replace next once every slot is in use
+  int next;
+} id_cache_t;
+
+static id_cache_t user_cache;
+static id_cache_t group_cache;
+
+/*
+ * Copies the name of user (or, if 'is_group' is set, group) 'id' into the
+ * header field 'field'. Ids without a name leave the field empty, so readers
+ * fall back to the numeric id stored alongside it.
+ */
+static void lookup_id_name(char *field, unsigned id, int is_group) {
+  id_cache_t *cache = is_group ? &group_cache : &user_cache;
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->ids[i] == id) {
+      memcpy(field, cache->names[i], sizeof(cache->names[i]));
+      return;
+    }
+  }
+
+  int slot;
+  if (cache->count < ID_CACHE_SIZE) {
+    slot = cache->count++;
+  } else {
+    slot = cache->next;
+    cache->next = (cache->next + 1) % ID_CACHE_SIZE;
+  }
+  const char *name = NULL;
+  STATS_START(timer);
+  if (is_group) {
+    struct group *grp = getgrgid(id);
+    name = grp != NULL ? grp->gr_name : NULL;
+  } else {
+    struct passwd *pwd = getpwuid(id);
+    name = pwd != NULL ? pwd->pw_name : NULL;
+  }
+  STATS_PHASE(STATS_PHASE_NAME_LOOKUP, timer);
+  cache->ids[slot] = id;
+  strncpy(cache->names[slot], name != NULL ? name : "", sizeof(cache->names[slot]));
+  memcpy(field, cache->names[slot], sizeof(cache->names[slot]));
+}
+
+/*
+ * Stores 'file_name' in the header's name field. Names too long for it are
+ * split at a '/' into the POSIX 'prefix' field and the name field.
+ * Returns 0 on success or -1 if the name cannot be represented
+ */
+static int set_header_name(tar_header *header, const char *file_name) {
+  size_t len = strlen(file_name);
+  if (len <= sizeof(header->name)) {
+    memcpy(header->name, file_name, len); // Null-terminated unless exactly 100 bytes
+    return 0;
+  }
+
+  // Use the first slash that leaves a short enough final part, which keeps
+  // the prefix as short as possible
+  for (size_t i = 1; i < len && i <= sizeof(header->prefix); i++) {
+    if (file_name[i] == '/' && len - i - 1 <= sizeof(header->name)) {
+      if (len - i - 1 == 0) {
+        return -1;
+      }
+      memcpy(header->prefix, file_name, i);
+      memcpy(header->name, file_name + i + 1, len - i - 1);
+      return 0;
+    }
+  }
+  return -1;
+}
+
 /*
- * Helper function to compute the checksum of a tar header block
- * Performs a simple sum over all bytes in the header in accordance with POSIX
- * standard for tar file structure.
+ * Copies the full name of the member described by 'header' into 'name',
+ * which must hold at least MAX_MEMBER_NAME_LEN + 1 bytes, joining the
+ * prefix and name fields when a prefix is present
  */
-void compute_checksum(tar_header *header) {
-  // Have to initially set header's checksum to "all blanks"
-  memset(header->chksum, ' ', 8);
-  unsigned sum = 0;
-  char *bytes = (char *)header;
-  for (int i = 0; i < sizeof(tar_header); i++) {
-    sum += bytes[i];
+static void get_header_name(const tar_header *header, char *name) {
+  size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+  size_t pos = 0;
+  if (prefix_len > 0) {
+    memcpy(name, header->prefix, prefix_len);
+    name[prefix_len] = '/';
+    pos = prefix_len + 1;
   }
-  snprintf(header->chksum, 8, "%07o", sum);
+  size_t name_len = strnlen(header->name, sizeof(header->name));
+  memcpy(name + pos, header->name, name_len);
+  name[pos + name_len] = '\0';
 }
 
 /*
  * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
+ * the file or directory 'file_name', as given by 'stat_buf' (which the caller
+ * took from the open file, so the name is not resolved a second time).
  * Returns 0 on success or -1 if an error occurs
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
+int fill_tar_header(tar_header *header, const char *file_name, const struct stat *stat_buf) {
   memset(header, 0, sizeof(tar_header));
-  char err_msg[MAX_MSG_LEN];
-  struct stat stat_buf;
-  // stat is a system call to inspect file metadata
-  if (stat(file_name, &stat_buf) != 0) {
-    snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-    perror(err_msg);
-    return -1;
-  }
 
-  strncpy(header->name, file_name,
-          100); // Name of the file, null-terminated string
-  snprintf(header->mode, 8, "%07o",
-           stat_buf.st_mode & 07777); // Permissions for file, 0-padded octal
-
-  snprintf(header->uid, 8, "%07o",
-           stat_buf.st_uid); // Owner ID of the file, 0-padded octal
-  struct passwd *pwd =
-      getpwuid(stat_buf.st_uid); // Look up name corresponding to owner ID
-  if (pwd == NULL) {
-    snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s",
-             file_name);
-    perror(err_msg);
+  if (set_header_name(header, file_name) != 0) {
+    fprintf(stderr, "Error: File name too long to archive: %s\n", file_name);
     return -1;
   }
-  strncpy(header->uname, pwd->pw_name,
-          32); // Owner name of the file, null-terminated string
+  header_encode_octal(header->mode, sizeof(header->mode),
+                      stat_buf->st_mode & 07777); // Permissions for file, 0-padded octal
 
-  snprintf(header->gid, 8, "%07o",
-           stat_buf.st_gid); // Group ID of the file, 0-padded octal
-  struct group *grp =
-      getgrgid(stat_buf.st_gid); // Look up name corresponding to group ID
-  if (grp == NULL) {
-    snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s",
-             file_name);
-    perror(err_msg);
-    return -1;
+  header_encode_number(header->uid, sizeof(header->uid),
+                       stat_buf->st_uid); // Owner ID of the file, 0-padded octal
+  header_encode_number(header->gid, sizeof(header->gid),
+                       stat_buf->st_gid); // Group ID of the file, 0-padded octal
+
+  // Owner and group names of the file, null-terminated strings, left empty
+  // when only numeric ids are wanted
+  if (!minitar_options.numeric_owner) {
+    lookup_id_name(header->uname, stat_buf->st_uid, 0);
+    lookup_id_name(header->gname, stat_buf->st_gid, 1);
   }
-  strncpy(header->gname, grp->gr_name,
-          32); // Group name of the file, null-terminated string
 
-  snprintf(header->size, 12, "%011o",
-           (unsigned)stat_buf.st_size); // File size, 0-padded octal
-  snprintf(header->mtime, 12, "%011o",
-           (unsigned)stat_buf.st_mtime); // Modification time, 0-padded octal
-  header->typeflag = REGTYPE; // File type, always regular file in this project
+  // File size, 0-padded octal, or base-256 from 8 GiB on; directories have
+  // no data
+  int is_dir = S_ISDIR(stat_buf->st_mode);
+  header_encode_number(header->size, sizeof(header->size), is_dir ? 0 : stat_buf->st_size);
+  // Modification time, 0-padded octal; times before the epoch are clamped
+  header_encode_number(header->mtime, sizeof(header->mtime),
+                       stat_buf->st_mtime > 0 ? stat_buf->st_mtime : 0);
+  header->typeflag = is_dir ? DIRTYPE : REGTYPE; // File type
   strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
   memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
-  snprintf(header->devmajor, 8, "%07o",
-           major(stat_buf.st_dev)); // Major device number, 0-padded octal
-  snprintf(header->devminor, 8, "%07o",
-           minor(stat_buf.st_dev)); // Minor device number, 0-padded octal
+  header_encode_octal(header->devmajor, sizeof(header->devmajor),
+                      major(stat_buf->st_dev)); // Major device number, 0-padded octal
+  header_encode_octal(header->devminor, sizeof(header->devminor),
+                      minor(stat_buf->st_dev)); // Minor device number, 0-padded octal
 
-  compute_checksum(header);
+  header_set_checksum(header);
   return 0;
 }
 
 /*
- * Removes 'nbytes' bytes from the file identified by 'file_name'
- * Returns 0 upon success, -1 upon error
- * Note: This function uses lower-level I/O syscalls (not stdio), which we'll
- * learn about later
+ * Decodes the size and modification time of a header filled in by
+ * fill_tar_header, whose fields are known to be well formed
  */
-int remove_trailing_bytes(const char *file_name, size_t nbytes) {
-  char err_msg[MAX_MSG_LEN];
+static void header_fields(const tar_header *header, off_t *size, time_t *mtime) {
+  uint64_t value = 0;
+  header_decode_number(header->size, sizeof(header->size), &value);
+  *size = value;
+  header_decode_number(header->mtime, sizeof(header->mtime), &value);
+  *mtime = value;
+}
 
-  struct stat stat_buf;
-  if (stat(file_name, &stat_buf) != 0) {
-    snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-    perror(err_msg);
+/*
+ * Checks the checksum of 'header', read from 'offset' within an archive, and
+ * decodes the member's size and modification time
+ * Returns 0 upon success, -1 upon error
+ */
+static int parse_header(const tar_header *header, off_t offset, off_t *size, time_t *mtime) {
+  if (header_verify_checksum(header) != 0) {
+    fprintf(stderr, "Error: Invalid header checksum at offset %lld\n", (long long)offset);
     return -1;
   }
-
-  off_t file_size = stat_buf.st_size;
-  if (nbytes > file_size) {
-    file_size = 0;
-  } else {
-    file_size -= nbytes;
+  uint64_t value;
+  if (header_decode_number(header->size, sizeof(header->size), &value) != 0 ||
+      (off_t)value < 0) {
+    fprintf(stderr, "Error: Failed to parse file size from header\n");
+    return -1;
   }
-
-  if (truncate(file_name, file_size) != 0) {
-    snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
-    perror(err_msg);
+  *size = value;
+  if (header_decode_number(header->mtime, sizeof(header->mtime), &value) != 0) {
+    fprintf(stderr, "Error: Failed to parse modification time from header\n");
     return -1;
   }
+  *mtime = value;
   return 0;
 }
 
-/**
- * Creates an archive file using archive_name and stores the provided list of files
- * within it using files
- *
- * Returns 0 upon success, -1 upon error
- *
- * Loops through the linked list of files and using fill_tar_header to make the header
- * Then it opens the file using open() and reads and writes the contents to the archive file
- * using a buffer
- *
- * Then loops again to make the footer blocks by adding empty blocks at the end of the entire archive file
+/*
+ * Returns 1 if 'archive_name' refers to standard input/output rather than a
+ * file, 0 otherwise
  */
-int create_archive(const char *archive_name, const file_list_t *files) {
-  // Creating and Opening the Archive file
-  FILE *archive_file = fopen(archive_name, "wb");
-  if (!archive_file) {
-    perror("Error: Unable to open archive file");
+static int is_stdio_archive(const char *archive_name) {
+  return strcmp(archive_name, STDIO_ARCHIVE) == 0;
+}
+
+/*
+ * Checks that the archive open as 'archive_fd' can be modified in place,
+ * which compressed archives cannot. 'action' names the operation for the
+ * error message.
+ * Returns 0 if the archive is uncompressed, -1 otherwise
+ */
+static int check_uncompressed(int archive_fd, const char *action) {
+  if (minitar_options.compression != COMPRESS_NONE ||
+      compress_detect(archive_fd) != COMPRESS_NONE) {
+    fprintf(stderr, "Error: Cannot %s a compressed archive\n", action);
     return -1;
   }
+  return 0;
+}
 
-  // Looping through each file, and creating a header block and content blocks
-  node_t *current = files->head;
-  while (current != NULL) {
-    // Through each file, fill the header by calling fill_tarr_header with the file name
-    tar_header header;
-    if (fill_tar_header(&header, current->name) != 0) {
-      perror("Error: Failed to fill tar header");
-      fclose(archive_file);
-      return -1;
-    }
-
-    // Write the header to the archive file
-    if (fwrite(&header, 1, sizeof(tar_header), archive_file) !=
-        sizeof(tar_header)) {
-      perror("Error: Failed to write header to archive");
-      fclose(archive_file);
-      return -1;
-    }
+/*
+ * Returns 'size' rounded up to a whole number of blocks
+ */
+static off_t padded_size(off_t size) {
+  return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
 
-    // Open the contents of the file after header creation
-    FILE *file_fd = fopen(current->name, "rb");
-    if (!file_fd) {
-      perror("Error: Failed to open file");
-      fclose(archive_file);
-      return -1;
-    }
+// Attributes given by a member's extended header, which override those in
+// its tar header
+typedef struct {
+  // Set if an extended header was seen, which is then where the member starts
+  int present;
+  off_t offset;
+  // Name from a "path" record, or empty
+  char path[PATH_MAX];
+  // Real name of a sparse file, from "GNU.sparse.name", or empty
+  char sparse_name[PATH_MAX];
+  // Size from a "size" record, or -1
+  off_t size;
+  // Version of the sparse format, or -1 if the member is not sparse
+  int sparse_major;
+  int sparse_minor;
+  // Size of the sparse file, holes included, or -1
+  off_t real_size;
+  // Size of a deduplicated file, or -1
+  off_t dedup_size;
+  // Modification time from an "mtime" record, if 'has_mtime' is set
+  int has_mtime;
+  time_t mtime;
+  long mtime_nsec;
+} pax_attrs_t;
 
-    // Read the contents of the file and write to the archive file
-    char buffer[BLOCK_SIZE] = {0};
-    ssize_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, BLOCK_SIZE, file_fd)) > 0) {
-      if (fwrite(buffer, 1, BLOCK_SIZE, archive_file) != BLOCK_SIZE) {
-        perror("Error: Failed to write file contents to archive");
-        fclose(file_fd);
-        fclose(archive_file);
-        return -1;
-      }
-      memset(buffer, 0, BLOCK_SIZE);
-    }
+static void pax_attrs_reset(pax_attrs_t *attrs) {
+  attrs->present = 0;
+  attrs->offset = 0;
+  attrs->path[0] = '\0';
+  attrs->sparse_name[0] = '\0';
+  attrs->size = -1;
+  attrs->sparse_major = -1;
+  attrs->sparse_minor = -1;
+  attrs->real_size = -1;
+  attrs->dedup_size = -1;
+  attrs->has_mtime = 0;
+}
 
-    // Produce an error if it could not read the file
-    if (ferror(file_fd)) {
-      perror("Error: Failed to read file");
-      fclose(file_fd);
-      fclose(archive_file);
-      return -1;
-    }
+/*
+ * Parses the non-negative decimal 'value' of a record into '*number'
+ * Returns 0 upon success, -1 if it is not such a number
+ */
+static int parse_pax_number(const char *value, long long *number) {
+  char *end;
+  errno = 0;
+  *number = strtoll(value, &end, 10);
+  return errno != 0 || end == value || *end != '\0' || *number < 0 ? -1 : 0;
+}
 
-    fclose(file_fd);
-    current = current->next;
+/*
+ * Parses the 'value' of an "mtime" record, decimal seconds since the epoch
+ * that may be negative and have a fraction, into '*sec' and '*nsec' (digits
+ * past nanoseconds are dropped)
+ * Returns 0 upon success, -1 if it is not such a time
+ */
+static int parse_pax_time(const char *value, time_t *sec, long *nsec) {
+  char *end;
+  errno = 0;
+  long long whole = strtoll(value, &end, 10);
+  if (errno != 0 || end == value) {
+    return -1;
   }
-
-  // Write trailing blocks to mark end of archive
-    char empty_block[BLOCK_SIZE] = {0};
-    for (int i = 0; i < NUM_TRAILING_BLOCKS; i++) {
-      if (fwrite(empty_block, 1, BLOCK_SIZE, archive_file) != BLOCK_SIZE) {
-        perror("Error: Failed to write trailing blocks");
-        fclose(archive_file);
-        return -1;
+  long fraction = 0;
+  int digits = 0;
+  if (*end == '.') {
+    for (end++; *end >= '0' && *end <= '9'; end++) {
+      if (digits < 9) {
+        fraction = fraction * 10 + (*end - '0');
+        digits++;
       }
     }
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  for (; digits < 9; digits++) {
+    fraction *= 10;
+  }
+  // "-1.25" is 1.25 seconds before the epoch: -2 seconds plus 0.75
+  if (value[0] == '-' && fraction > 0) {
+    whole--;
+    fraction = 1000000000 - fraction;
+  }
+  *sec = whole;
+  *nsec = fraction;
+  return 0;
+}
 
-    fclose(archive_file);
-    return 0;
+// Stores 'sec' seconds and 'nsec' nanoseconds since the epoch in 'out' as
+// the value of an "mtime" record
+static void format_pax_time(char *out, size_t size, time_t sec, long nsec) {
+  if (nsec == 0) {
+    snprintf(out, size, "%lld", (long long)sec);
+  } else if (sec < 0) {
+    snprintf(out, size, "-%lld.%09ld", -(long long)sec - 1, 1000000000 - nsec);
+  } else {
+    snprintf(out, size, "%lld.%09ld", (long long)sec, nsec);
   }
+}
 
-  /*
-  * Appends files to an existing tar archive.
-  *
-  * Returns 0 on success, -1 on error.
-  *
-  * Opens the archive in read/write mode. Then locates the end of the archive
-  * and appends new files. Each file is appedned by creating a tar header,
-  * writing file data in blocks, and calculating proper padding.
-  *
-  */
-  int append_files_to_archive(const char *archive_name,
-                              const file_list_t *files) {
-    // Open arcieve in read/write mode
-    FILE *archiveFile = fopen(archive_name, "rb+");
-    if (!archiveFile) {
-        perror("Error: Unable to open archive file");
-        return -1;
+/*
+ * pax_parse callback recording the records minitar understands in the
+ * pax_attrs_t 'arg'; other records are ignored
+ * Returns 0 upon success, -1 if a record's value is malformed
+ */
+static int apply_pax_record(const char *key, const char *value, size_t value_len, void *arg) {
+  pax_attrs_t *attrs = arg;
+  char *name = NULL;
+  off_t *size = NULL;
+  int *version = NULL;
+  if (strcmp(key, "path") == 0) {
+    name = attrs->path;
+  } else if (strcmp(key, "GNU.sparse.name") == 0) {
+    name = attrs->sparse_name;
+  } else if (strcmp(key, "size") == 0) {
+    size = &attrs->size;
+  } else if (strcmp(key, "GNU.sparse.realsize") == 0) {
+    size = &attrs->real_size;
+  } else if (strcmp(key, DEDUP_SIZE_KEY) == 0) {
+    size = &attrs->dedup_size;
+  } else if (strcmp(key, "mtime") == 0) {
+    if (parse_pax_time(value, &attrs->mtime, &attrs->mtime_nsec) != 0) {
+      return -1;
     }
+    attrs->has_mtime = 1;
+  } else if (strcmp(key, "GNU.sparse.major") == 0) {
+    version = &attrs->sparse_major;
+  } else if (strcmp(key, "GNU.sparse.minor") == 0) {
+    version = &attrs->sparse_minor;
+  } else if (strncmp(key, "GNU.sparse.", 11) == 0 && attrs->sparse_major < 0) {
+    // Records of the older sparse formats, which give no version
+    attrs->sparse_major = 0;
+  }
 
-    // Find where to append new files
-    off_t appendPointer = 0;
-    while (1) {
-        tar_header header;
-        ssize_t bytesRead = fread(&header, 1, sizeof(tar_header), archiveFile);
-
-        if (bytesRead != sizeof(tar_header)) {
-            perror("Error: Failed to read header block");
-            fclose(archiveFile);
-            return -1;
-        }
-        if (bytesRead == 0 || header.name[0] == '\0') {
-            break; // Found empty block (end of archive)
-        }
-
-        // Calculate padded file size
-        unsigned int file_size = 0;
-        if (sscanf(header.size, "%o", &file_size) != 1) {
-          perror("Error: Failed to parse file size from header");
-          fclose(archiveFile);
-          return -1;
-        }
-
-        unsigned int paddedSize = ((file_size + BLOCK_SIZE -1) / BLOCK_SIZE) * BLOCK_SIZE;
-
-        // Skip past file data
-        if (fseek(archiveFile, paddedSize, SEEK_CUR) < 0) {
-            perror("Error: Failed to seek past file contents");
-            fclose(archiveFile);
-            return -1;
-        }
-
-        appendPointer = ftell(archiveFile);
+  long long number;
+  if (name != NULL) {
+    if (value_len == 0 || value_len >= PATH_MAX || strlen(value) != value_len) {
+      return -1;
     }
-
-    // Seek to the position where new files will be appended
-    if (fseek(archiveFile, appendPointer, SEEK_SET) < 0) {
-        perror("Error: Failed to seek to append position");
-        fclose(archiveFile);
-        return -1;
+    memcpy(name, value, value_len + 1);
+  } else if (size != NULL) {
+    if (parse_pax_number(value, &number) != 0) {
+      return -1;
     }
-
-    // Trim excess trailing bytes before appending new files
-    if (remove_trailing_bytes(archive_name, NUM_TRAILING_BLOCKS * BLOCK_SIZE) != 0) {
-        perror("Error: Failed to remove trailing bytes");
-        fclose(archiveFile);
-        return -1;
+    *size = number;
+  } else if (version != NULL) {
+    if (parse_pax_number(value, &number) != 0 || number > INT_MAX) {
+      return -1;
     }
+    *version = number;
+  }
+  return 0;
+}
 
-    // Append new files
-    node_t *current = files->head;
-    while (current != NULL) {
-        tar_header header;
-        if (fill_tar_header(&header, current->name) != 0) {
-            perror("Error: Failed to fill tar header");
-            fclose(archiveFile);
-            return -1;
-        }
-
-        // Write the header
-        if (fwrite(&header, 1, sizeof(tar_header), archiveFile) != sizeof(tar_header)) {
-            perror("Error: Failed to write header to archive");
-            fclose(archiveFile);
-            return -1;
-        }
+/*
+ * Fills in 'member' from 'header', read from 'offset' within an archive,
+ * and the attributes of the extended header before it, if any. 'name' must
+ * hold PATH_MAX bytes and receives the member's name, which 'member' points to.
+ * Returns 0 upon success, -1 upon error
+ */
+static int describe_member(const tar_header *header, off_t offset, const pax_attrs_t *attrs,
+                           archive_member_t *member, char *name) {
+  off_t size;
+  time_t mtime;
+  if (parse_header(header, offset, &size, &mtime) != 0) {
+    return -1;
+  }
+  if (attrs->size >= 0) {
+    size = attrs->size;
+  }
+  *member = (archive_member_t){.name = name, .offset = attrs->present ? attrs->offset : offset,
+                               .data_offset = offset + BLOCK_SIZE, .size = size,
+                               .real_size = size, .mtime = mtime, .flags = 0};
 
-        // Open the file to copy its content
-        FILE *file_fd = fopen(current->name, "rb");
-        if (!file_fd) {
-            perror("Error: Failed to open file");
-            fclose(archiveFile);
-            return -1;
-        }
+  // Only the 1.0 sparse format, where the map leads the data, is understood
+  if (attrs->sparse_major >= 0) {
+    if (attrs->sparse_major != 1 || attrs->sparse_minor != 0 || attrs->real_size < 0 ||
+        attrs->sparse_name[0] == '\0') {
+      fprintf(stderr, "Error: Unsupported sparse format at offset %lld\n", (long long)offset);
+      return -1;
+    }
+    strcpy(name, attrs->sparse_name);
+    member->real_size = attrs->real_size;
+    member->flags = MEMBER_SPARSE;
+  } else if (attrs->path[0] != '\0') {
+    strcpy(name, attrs->path);
+  } else {
+    get_header_name(header, name);
+  }
+  if (attrs->dedup_size >= 0) {
+    if (member->flags & MEMBER_SPARSE) {
+      fprintf(stderr, "Error: Unsupported deduplicated member at offset %lld\n",
+              (long long)offset);
+      return -1;
+    }
+    member->real_size = attrs->dedup_size;
+    member->flags = MEMBER_DEDUP;
+  }
+  if (attrs->has_mtime) {
+    member->mtime = attrs->mtime;
+    member->mtime_nsec = attrs->mtime_nsec;
+  }
+  return 0;
+}
 
-        // Write the file content in blocks
-        char buffer[BLOCK_SIZE] = {0};
-        ssize_t bytesRead;
-        while ((bytesRead = fread(buffer, 1, BLOCK_SIZE, file_fd)) > 0) {
-            if (fwrite(buffer, 1, BLOCK_SIZE, archiveFile) != BLOCK_SIZE) {
-                perror("Error: Failed to write file contents to archive");
-                fclose(file_fd);
-                fclose(archiveFile);
-                return -1;
-            }
-            memset(buffer, 0, BLOCK_SIZE);
-        }
+/*
+ * Applies the 'len' bytes of records in 'data', an extended header found at
+ * 'offset', to 'attrs'
+ * Returns 0 upon success, -1 upon error
+ */
+static int load_pax_attrs(char *data, size_t len, off_t offset, pax_attrs_t *attrs) {
+  if (!attrs->present) {
+    attrs->present = 1;
+    attrs->offset = offset;
+  }
+  if (pax_parse(data, len, apply_pax_record, attrs) != 0) {
+    fprintf(stderr, "Error: Malformed extended header at offset %lld\n", (long long)offset);
+    return -1;
+  }
+  return 0;
+}
 
-        if (bytesRead < 0) {
-            perror("Error: Failed to read file");
-            fclose(file_fd);
-            fclose(archiveFile);
-            return -1;
-        }
+// An archive mapped into memory for reading
+typedef struct {
+  const char *data;
+  size_t size;
+} archive_map_t;
 
-        fclose(file_fd);
-        current = current->next;
-    }
+/*
+ * Maps the whole archive open as 'archive_fd' read-only into memory
+ * Returns 0 if the archive was mapped, or 1 if it cannot be (it is not a
+ * regular file, is empty, or mmap failed), in which case callers fall back
+ * to reading it with read calls
+ */
+static int map_archive(int archive_fd, archive_map_t *map) {
+  struct stat archive_stat;
+  if (fstat(archive_fd, &archive_stat) != 0 || !S_ISREG(archive_stat.st_mode) ||
+      archive_stat.st_size == 0) {
+    return 1;
+  }
+  void *data = mmap(NULL, archive_stat.st_size, PROT_READ, MAP_SHARED, archive_fd, 0);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  map->data = data;
+  map->size = archive_stat.st_size;
+  return 0;
+}
 
-    // Write trailing blocks at end of archieve
-    char empty_block[BLOCK_SIZE] = {0};
-    for (int i = 0; i < NUM_TRAILING_BLOCKS; i++) {
-        if (fwrite(empty_block, 1, BLOCK_SIZE, archiveFile) != BLOCK_SIZE) {
-            perror("Error: Failed to write trailing blocks");
-            fclose(archiveFile);
-            return -1;
-        }
-    }
+static void unmap_archive(archive_map_t *map) {
+  munmap((void *)map->data, map->size);
+}
 
-    fclose(archiveFile);
-    return 0;
+/*
+ * Reads the extended header 'header' found at 'offset' in the archive open as
+ * 'archive_fd', or mapped as 'map' if that is not NULL, and applies its
+ * records to 'attrs'. Global extended headers are skipped.
+ * Returns the offset of the block following the header's records, or -1
+ * upon error
+ */
+static off_t read_pax_header(int archive_fd, const archive_map_t *map, const tar_header *header,
+                             off_t offset, pax_attrs_t *attrs) {
+  off_t len;
+  time_t mtime;
+  if (parse_header(header, offset, &len, &mtime) != 0) {
+    return -1;
+  }
+  off_t next_offset = offset + BLOCK_SIZE + padded_size(len);
+  if (header->typeflag == PAX_GLOBAL_TYPE) {
+    return next_offset;
+  }
+  if (len > MAX_PAX_LEN) {
+    fprintf(stderr, "Error: Extended header too large at offset %lld\n", (long long)offset);
+    return -1;
   }
 
-  /*
-   * Reads an archive file and extracts the list of contained file names
-   *
-   * Returns 0 for success, -1 for error
-   *
-   * Opens the file an extracts the tar header and reads the name of the header to the terminal
-   * Then need to find the next header by calculating block sizes and finding the right number for the next header
-   * and repeat the process
-   *
-   */
-  int get_archive_file_list(const char *archive_name, file_list_t *files) {
-    // Opens the archive file in read mode
-    FILE *archive_file = fopen(archive_name, "rb");
-    if (!archive_file) {
-      perror("Error: Unable to open archive file");
-      return -1;
+  // Records are parsed in place, so they need a writable copy
+  char *data = malloc(len > 0 ? len : 1);
+  if (data == NULL) {
+    perror("Error: Failed to allocate extended header");
+    return -1;
+  }
+  off_t data_offset = offset + BLOCK_SIZE;
+  ssize_t bytes_read;
+  if (map != NULL) {
+    bytes_read = data_offset + len <= (off_t)map->size ? len : -1;
+    if (bytes_read == len) {
+      memcpy(data, map->data + data_offset, len);
     }
+  } else {
+    bytes_read = read_all(archive_fd, &data_offset, data, len);
+  }
+  if (bytes_read != len) {
+    fprintf(stderr, "Error: Archive is truncated inside extended header at offset %lld\n",
+            (long long)offset);
+    free(data);
+    return -1;
+  }
+  int result = load_pax_attrs(data, len, offset, attrs);
+  free(data);
+  return result == 0 ? next_offset : -1;
+}
 
-    // Reads each header and obtains the name of each and adds it to the file list of files
-    while (1) {
-      tar_header header;
-      ssize_t bytes_read;
+/*
+ * Reads every header of the archive open as 'archive_fd', starting from the
+ * beginning, and records each member in 'index'
+ * Headers are read in place from a mapping of the archive when possible, so
+ * walking even a large archive costs no system calls per member.
+ * Returns 0 upon success, -1 upon error
+ */
+static int scan_archive(int archive_fd, archive_index_t *index) {
+  archive_map_t map;
+  int mapped = map_archive(archive_fd, &map) == 0;
 
-      if ((bytes_read = fread(&header, 1, sizeof(tar_header), archive_file)) != sizeof(tar_header)) {
-        if (feof(archive_file)) {
-          break;
-        }
-        perror("Error: Failed to read header block");
-        fclose(archive_file);
-        return -1;
+  off_t offset = 0;
+  int result = 0;
+  pax_attrs_t attrs;
+  pax_attrs_reset(&attrs);
+  while (1) {
+    tar_header buffer;
+    const tar_header *header = &buffer;
+    ssize_t bytes_read;
+    if (mapped) {
+      bytes_read = offset >= (off_t)map.size ? 0 : map.size - offset;
+      if (bytes_read >= (ssize_t)sizeof(tar_header)) {
+        header = (const tar_header *)(map.data + offset);
+        bytes_read = sizeof(tar_header);
       }
+    } else {
+      off_t read_offset = offset;
+      bytes_read = read_all(archive_fd, &read_offset, &buffer, sizeof(tar_header));
+    }
+    if (bytes_read < 0 || (bytes_read > 0 && bytes_read != sizeof(tar_header))) {
+      perror("Error: Failed to read header block");
+      result = -1;
+      break;
+    }
+    // An empty block (or the end of the file) marks the end of the archive
+    if (bytes_read == 0 || header->name[0] == '\0') {
+      break;
+    }
 
-      if (header.name[0] == '\0') {
+    if (header->typeflag == PAX_TYPE || header->typeflag == PAX_GLOBAL_TYPE) {
+      offset = read_pax_header(archive_fd, mapped ? &map : NULL, header, offset, &attrs);
+      if (offset < 0) {
+        result = -1;
         break;
       }
+      continue;
+    }
+    archive_member_t member;
+    char name[PATH_MAX];
+    if (describe_member(header, offset, &attrs, &member, name) != 0) {
+      result = -1;
+      break;
+    }
+    if (archive_index_add_member(index, &member) != 0) {
+      perror("Error: Failed to record archive member");
+      result = -1;
+      break;
+    }
+    pax_attrs_reset(&attrs);
 
-      // Adds header name to the file list as that is the name of the file
-      if (file_list_add(files, header.name) != 0) {
-        perror("Error: Failed to add file to list");
-        fclose(archive_file);
-        return -1;
-      }
-
-      // finding the next header block to get file information
-      // By using sscanf to convert the string to an int then use a formula to calculate the next header block
-      unsigned int file_size = 0;
-      if (sscanf(header.size, "%o", &file_size) != 1) {
-        perror("Error: Failed to parse file size from header");
-        fclose(archive_file);
-        return -1;
-      }
+    // Skip past the file data to the next header
+    offset = member.data_offset + padded_size(member.size);
+  }
 
-      unsigned int padded_size = ((file_size + BLOCK_SIZE -1) / BLOCK_SIZE) * BLOCK_SIZE;
+  if (mapped) {
+    unmap_archive(&map);
+  }
+  index->end_offset = attrs.present ? attrs.offset : offset;
+  return result;
+}
 
-      // Uses fseek to go directly to the next header block
-      if (fseek(archive_file, padded_size, SEEK_CUR) != 0) {
-        perror("Error: Failed to seek to next header");
-        fclose(archive_file);
-        return -1;
-      }
-    }
+/*
+ * Fills the empty 'index' with the members of the archive 'archive_name',
+ * which is open as 'archive_fd'.
+ * The index sidecar is used when it is valid for the archive; otherwise the
+ * headers are scanned, and the sidecar is rebuilt if it was stale or if
+ * minitar_options.build_index is set. The sidecar is only a cache, so one
+ * that cannot be read is scanned around, and for a 'read_only' operation one
+ * that cannot be rebuilt is only a warning.
+ * '*sidecar_valid' is set to 1 if the sidecar now describes the archive.
+ * Returns 0 upon success, -1 upon error
+ */
+static int load_archive_index(const char *archive_name, int archive_fd, int read_only,
+                              archive_index_t *index, int *sidecar_valid) {
+  struct stat archive_stat;
+  if (fstat(archive_fd, &archive_stat) != 0) {
+    perror("Error: Failed to stat archive file");
+    return -1;
+  }
 
-    fclose(archive_file);
+  *sidecar_valid = 0;
+  STATS_START(timer);
+  int result = archive_index_load(archive_name, &archive_stat, index);
+  if (result == 0) {
+    STATS_PHASE(STATS_PHASE_SCAN, timer);
+    *sidecar_valid = 1;
     return 0;
   }
+  if (result < 0) {
+    fprintf(stderr, "Warning: Failed to read archive index, scanning headers: %s\n",
+            strerror(errno));
+  }
 
-  /*
-  * Extracts files from a tar archive and writes them to the filesystem.
-  *
-  * Returns 0 on success, -1 on error.
-  *
-  * Opens the archive file in read mode. Then iterates through each tar header
-  * and extracts the corresponding file. It calculates the padded file size
-  * to locate the next header.
-  *
-  * The extracted files are then written to disk, maintaining original structure.
-  *
-  */
-  int extract_files_from_archive(const char *archive_name) {
-    // Open archive in read mode
-    FILE *archiveFile = fopen(archive_name, "rb");
-    if (!archiveFile) {
-        perror("Error: Unable to open archive file");
-        return -1;
+  int had_sidecar = archive_index_exists(archive_name);
+  if (scan_archive(archive_fd, index) != 0) {
+    return -1;
+  }
+  STATS_PHASE(STATS_PHASE_SCAN, timer);
+  if (had_sidecar || minitar_options.build_index) {
+    if (archive_index_save(archive_name, &archive_stat, index) == 0) {
+      *sidecar_valid = 1;
+    } else if (read_only) {
+      fprintf(stderr, "Warning: Failed to write archive index: %s\n", strerror(errno));
+    } else {
+      perror("Error: Failed to write archive index");
+      return -1;
     }
+  }
+  return 0;
+}
 
-    // Read through and extract the archive
-    while (1) {
-        tar_header header;
-        ssize_t bytesRead = fread(&header, 1, sizeof(tar_header), archiveFile);
+/*
+ * Brings the sidecar of 'archive_name' up to date after the members of
+ * 'index' from 'first_new' onward were written to it.
+ * 'sidecar_valid' tells whether the sidecar matched the archive before the
+ * write, in which case only the new members are added to it.
+ * Returns 0 upon success, -1 upon error
+ */
+static int update_archive_index(const char *archive_name, const archive_index_t *index,
+                                int first_new, int sidecar_valid) {
+  if (!sidecar_valid && !minitar_options.build_index) {
+    return 0;
+  }
 
-        if (bytesRead < sizeof(tar_header)) {
-            perror("Error: Failed to read header block");
-            fclose(archiveFile);
-            return -1;
-        }
-        if (bytesRead == 0 || header.name[0] == '\0') {
-            break;
-        }
+  struct stat archive_stat;
+  if (stat(archive_name, &archive_stat) != 0) {
+    perror("Error: Failed to stat archive file");
+    return -1;
+  }
+  if (sidecar_valid && first_new > 0 &&
+      archive_index_append(archive_name, &archive_stat, index, first_new) == 0) {
+    return 0;
+  }
+  if (archive_index_save(archive_name, &archive_stat, index) != 0) {
+    perror("Error: Failed to write archive index");
+    return -1;
+  }
+  return 0;
+}
 
-        // Calculate padded file size
-        unsigned int fileSize = 0;
-        if (sscanf(header.size, "%o", &fileSize) != 1) {
-          perror("Error: Failed to parse file size from header");
-          fclose(archiveFile);
-          return -1;
-        }
+/*
+ * How one member is laid out in an archive: the blocks written ahead of its
+ * data, and which parts of the file make up that data
+ */
+typedef struct {
+  tar_header header;
+  // For a member with an extended header, that header, 'header' and any map
+  // (of a sparse or deduplicated file), each padded to whole blocks; NULL
+  // for other members, which only have 'header' ahead of their data
+  char *extended_prefix;
+  // Number of bytes ahead of the data
+  size_t prefix_len;
+  // Parts of the file stored as the member's data: the data regions of a
+  // sparse file or the new chunks of a deduplicated one, or else 'whole'
+  sparse_map_t map;
+  sparse_region_t whole;
+  // Number of data bytes taken from the file (before padding)
+  off_t data_size;
+  // Records of the member's extended header, which it has only if there
+  // are any. The first 'shared_records_len' bytes describe the file however
+  // its data is stored; records about the stored data follow.
+  pax_records_t records;
+  size_t shared_records_len;
+} member_layout_t;
 
-        unsigned int paddedSize = ((fileSize + BLOCK_SIZE -1) / BLOCK_SIZE) * BLOCK_SIZE;
-
-        // Ensure valid file name
-        if (strchr(header.name, '/') != NULL) {
-            fprintf(stderr, "Error: Extraction of file with path not allowed: %s\n", header.name);
-            if (fseek(archiveFile, paddedSize, SEEK_CUR) != 0) {
-                fprintf(stderr, "Error: Failed to seek past skipped file '%s'\n", header.name);
-                fclose(archiveFile);
-                return -1;
-            }
-            continue;
-        }
+// Returns the blocks to write ahead of the data of 'layout'
+static const void *layout_prefix(const member_layout_t *layout) {
+  return layout->extended_prefix != NULL ? layout->extended_prefix : (const void *)&layout->header;
+}
 
-        // Create and open the extracted file
-        FILE *file_fd = fopen(header.name, "wb");
-        if (!file_fd) {
-            perror("Error: Failed to create extracted file");
-            if (fseek(archiveFile, paddedSize, SEEK_CUR) != 0) {
-                fprintf(stderr, "Error: Failed to seek past file '%s'\n", header.name);
-                fclose(archiveFile);
-                return -1;
-            }
-            continue;
-        }
+// Returns the regions of the file making up the data of 'layout', storing
+// their number in '*count'
+static const sparse_region_t *layout_regions(const member_layout_t *layout, int *count) {
+  if (layout->map.count > 0) {
+    *count = layout->map.count;
+    return layout->map.regions;
+  }
+  *count = 1;
+  return &layout->whole;
+}
 
-        // Read file content and write it to the extracted file
-        char buffer[BLOCK_SIZE] = {0};
-        ssize_t totalBytesRead = 0;
-        while (totalBytesRead < fileSize) {
-            ssize_t chunkSize = fread(buffer, 1, BLOCK_SIZE, archiveFile);
-            if (chunkSize == 0) {
-                perror("Error: Failed to read file data");
-                fclose(file_fd);
-                fclose(archiveFile);
-                return -1;
-            }
-            ssize_t bytesToWrite = (chunkSize > (fileSize - totalBytesRead)) ? (fileSize - totalBytesRead) : chunkSize;
-            if (fwrite(buffer, 1, bytesToWrite, file_fd) != bytesToWrite) {
-                perror("Error: Failed to write extracted file");
-                fclose(file_fd);
-                 if (fseek(archiveFile, paddedSize - totalBytesRead, SEEK_CUR) != 0) {
-                    fprintf(stderr, "Error: Failed to seek past file '%s'\n", header.name);
-                    fclose(archiveFile);
-                    return -1;
-                }
-                break;
-            }
-            totalBytesRead += chunkSize;
-        }
+// Returns the number of bytes the member of 'layout' takes up in an archive
+static off_t layout_extent(const member_layout_t *layout) {
+  return layout->prefix_len + padded_size(layout->data_size);
+}
 
-        fclose(file_fd);
+static void layout_free(member_layout_t *layout) {
+  free(layout->extended_prefix);
+  layout->extended_prefix = NULL;
+  sparse_map_free(&layout->map);
+  pax_records_free(&layout->records);
+}
 
-        // Skip any remaining padding bytes
-        if (fseek(archiveFile, paddedSize - totalBytesRead, SEEK_CUR) != 0) {
-            perror("Error: Failed to seek past file data");
-            fclose(archiveFile);
-            return -1;
-        }
-    }
+/*
+ * Stores "<dir>/<subdir>/<base>" in 'out', which must hold PATH_MAX bytes,
+ * for the member 'name' that is "<dir>/<base>" (or just "<base>", with "."
+ * as its directory)
+ * Returns 0 upon success, or 1 if the result does not fit in a tar header
+ */
+static int name_beside(const char *name, const char *subdir, char *out) {
+  const char *slash = strrchr(name, '/');
+  const char *dir = slash != NULL ? name : ".";
+  int dir_len = slash != NULL ? (int)(slash - name) : 1;
+  const char *base = slash != NULL ? slash + 1 : name;
+  tar_header scratch;
+  memset(&scratch, 0, sizeof(scratch));
+  if (snprintf(out, PATH_MAX, "%.*s/%s/%s", dir_len, dir, subdir, base) >= PATH_MAX ||
+      set_header_name(&scratch, out) != 0) {
+    return 1;
+  }
+  return 0;
+}
 
-    fclose(archiveFile);
+/*
+ * Adds a "size" record giving the 'stored_size' bytes of data of a member
+ * holding a file of 'file_size' bytes to 'records', if the file is too large
+ * for its member's size to be sure to fit in octal. Deciding by the file's
+ * size rather than the stored size means the record is there or not before
+ * the stored size is known exactly.
+ * Returns 0 upon success, -1 upon error
+ */
+static int add_size_record(pax_records_t *records, off_t file_size, off_t stored_size) {
+  if (file_size <= MAX_OCTAL_SIZE) {
     return 0;
+  }
+  char value[32];
+  snprintf(value, sizeof(value), "%lld", (long long)stored_size);
+  if (pax_records_add(records, "size", value) != 0) {
+    perror("Error: Failed to record member size");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Sets up 'layout' to start with an extended header named 'pax_name' that
+ * holds 'layout->records', followed by 'layout->header' and the 'map_len'
+ * bytes of 'map_text', which begin the member's data; 'layout->data_size'
+ * more bytes of data follow. 'member' is updated to match.
+ * Returns 0 upon success, -1 upon error
+ */
+static int layout_extended(member_layout_t *layout, const char *pax_name,
+                           const struct stat *stat_buf, const char *map_text, size_t map_len,
+                           archive_member_t *member) {
+  tar_header pax_header;
+  if (fill_tar_header(&pax_header, pax_name, stat_buf) != 0) {
+    perror("Error: Failed to fill tar header");
+    return -1;
+  }
+  const pax_records_t *records = &layout->records;
+  pax_header.typeflag = PAX_TYPE;
+  header_encode_number(pax_header.size, sizeof(pax_header.size), records->len);
+  header_set_checksum(&pax_header);
+  header_encode_number(layout->header.size, sizeof(layout->header.size),
+                       map_len + layout->data_size);
+  header_set_checksum(&layout->header);
+
+  size_t records_len = padded_size(records->len);
+  free(layout->extended_prefix);
+  layout->prefix_len = BLOCK_SIZE + records_len + BLOCK_SIZE + map_len;
+  layout->extended_prefix = calloc(layout->prefix_len, 1);
+  if (layout->extended_prefix == NULL) {
+    perror("Error: Failed to allocate member headers");
+    return -1;
+  }
+  char *p = layout->extended_prefix;
+  memcpy(p, &pax_header, BLOCK_SIZE);
+  memcpy(p + BLOCK_SIZE, records->data, records->len);
+  memcpy(p + BLOCK_SIZE + records_len, &layout->header, BLOCK_SIZE);
+  if (map_len > 0) {
+    memcpy(p + 2 * BLOCK_SIZE + records_len, map_text, map_len);
+  }
+  member->data_offset = member->offset + 2 * BLOCK_SIZE + records_len;
+  member->size = map_len + layout->data_size;
+  return 0;
+}
+
+/*
+ * Turns 'layout', whose map lists the data regions of the file of 'record',
+ * into the layout of a sparse member: an extended header naming the real
+ * file and giving its size, then a tar header for the stored data, which
+ * begins with the map. 'member' is updated to match.
+ * Returns 0 upon success, 1 if the file must be stored whole instead because
+ * the headers cannot hold its name, or -1 upon error
+ */
+static int layout_sparse(member_layout_t *layout, const file_record_t *record,
+                         archive_member_t *member) {
+  // The extra names go in a directory beside the file
+  char sparse_name[PATH_MAX];
+  char pax_name[PATH_MAX];
+  if (name_beside(record->name, SPARSE_DIR, sparse_name) != 0 ||
+      name_beside(record->name, PAX_DIR, pax_name) != 0) {
+    return 1;
+  }
+
+  char real_size[32];
+  snprintf(real_size, sizeof(real_size), "%lld", (long long)record->stat.st_size);
+  pax_records_t *records = &layout->records;
+  size_t map_len;
+  char *map_text = NULL;
+  int result = -1;
+  if (pax_records_add(records, "GNU.sparse.major", "1") != 0 ||
+      pax_records_add(records, "GNU.sparse.minor", "0") != 0 ||
+      pax_records_add(records, "GNU.sparse.name", record->name) != 0 ||
+      pax_records_add(records, "GNU.sparse.realsize", real_size) != 0 ||
+      (map_text = sparse_map_encode(&layout->map, &map_len)) == NULL) {
+    perror("Error: Failed to describe sparse file");
+  } else if (fill_tar_header(&layout->header, sparse_name, &record->stat) != 0) {
+    perror("Error: Failed to fill tar header");
+  } else {
+    layout->data_size = sparse_map_data_size(&layout->map);
+    if (add_size_record(records, record->stat.st_size, map_len + layout->data_size) == 0 &&
+        layout_extended(layout, pax_name, &record->stat, map_text, map_len, member) == 0) {
+      member->flags = MEMBER_SPARSE;
+      result = 0;
+    }
+  }
+  free(map_text);
+  return result;
+}
+
+/*
+ * Stores the name for the extended header of the member 'name' in 'out',
+ * which must hold PATH_MAX bytes: the file's name in a directory beside it,
+ * or just that directory if the result would be too long, since the name is
+ * only there for tar programs that do not understand extended headers
+ */
+static void pax_header_name(const char *name, char *out) {
+  if (name_beside(name, PAX_DIR, out) != 0) {
+    strcpy(out, PAX_DIR);
+  }
+}
+
+/*
+ * dedup_read_fn_t reading stored chunks back through the buffered writer
+ * 'arg': bytes still in its buffer are copied from there, and older ones are
+ * read from the archive file
+ */
+static int read_written(void *buf, size_t len, off_t location, void *arg) {
+  buffered_writer_t *writer = arg;
+  off_t flushed = writer->position - writer->used;
+  if (location >= flushed) {
+    memcpy(buf, writer->buffer + (location - flushed), len);
+    return 0;
+  }
+  if (location + (off_t)len > flushed && writer_flush(writer) != 0) {
+    return -1;
+  }
+  return read_all(writer->fd, &location, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Decides how to store the file of 'record', laid out whole in 'layout' and
+ * 'member', given the chunks already written through 'writer' and listed in
+ * 'table'. If that saves space, 'layout' and 'member' become those of a
+ * deduplicated member (see dedup.h) storing only the file's new chunks.
+ * Either way, the table then records where the new chunks are stored.
+ * Returns 0 upon success, -1 upon error
+ */
+static int layout_dedup(member_layout_t *layout, const file_record_t *record,
+                        archive_member_t *member, dedup_table_t *table,
+                        buffered_writer_t *writer) {
+  dedup_plan_t plan;
+  dedup_plan_init(&plan);
+  if (dedup_plan_file(table, record->fd, layout->data_size, read_written, writer, &plan) != 0) {
+    perror("Error: Failed to deduplicate file");
+    dedup_plan_free(&plan);
+    return -1;
+  }
+
+  char pax_name[PATH_MAX];
+  off_t file_size = layout->data_size;
+  char real_size[32];
+  snprintf(real_size, sizeof(real_size), "%lld", (long long)file_size);
+  pax_records_t *records = &layout->records;
+  char *map_text = NULL;
+  size_t map_len = 0;
+  off_t new_data_offset = member->data_offset;
+  int result = 0;
+  if (plan.new_size < file_size) {
+    pax_header_name(record->name, pax_name);
+    // The map points into the new data that follows it, and the records
+    // ahead of it depend on its length, so both are built again until the
+    // map's length and offset stop changing
+    off_t map_offset = 0;
+    size_t len = BLOCK_SIZE;
+    while (result == 0) {
+      records->len = layout->shared_records_len;
+      if (pax_records_add(records, DEDUP_SIZE_KEY, real_size) != 0) {
+        perror("Error: Failed to describe deduplicated file");
+        result = -1;
+        break;
+      }
+      if (add_size_record(records, file_size, len + plan.new_size) != 0) {
+        result = -1;
+        break;
+      }
+      off_t offset = member->offset + 2 * BLOCK_SIZE + padded_size(records->len);
+      if (len == map_len && offset == map_offset) {
+        break;
+      }
+      map_len = len;
+      map_offset = offset;
+      free(map_text);
+      map_text = NULL;
+      sparse_map_t extents;
+      sparse_map_init(&extents);
+      if (dedup_plan_extents(&plan, map_offset + map_len, &extents) != 0 ||
+          (map_text = sparse_map_encode(&extents, &len)) == NULL) {
+        perror("Error: Failed to describe deduplicated file");
+        result = -1;
+      }
+      sparse_map_free(&extents);
+    }
+
+    off_t whole_extent = layout_extent(layout);
+    layout->data_size = plan.new_size;
+    if (result == 0 && map_offset - member->offset + map_len + padded_size(plan.new_size) <
+                           whole_extent) {
+      result = layout_extended(layout, pax_name, &record->stat, map_text, map_len, member);
+      if (result == 0) {
+        // Only the new chunks' ranges of the file are stored
+        layout->map = plan.new_data;
+        sparse_map_init(&plan.new_data);
+        layout->whole.size = 0;
+        member->real_size = file_size;
+        member->flags = MEMBER_DEDUP;
+        new_data_offset = map_offset + map_len;
+      }
+    } else if (result == 0) {
+      // The file is stored whole after all, with the records it had
+      layout->data_size = file_size;
+      records->len = layout->shared_records_len;
+      result = add_size_record(records, file_size, file_size);
+    }
+  }
+  if (result == 0) {
+    dedup_plan_commit(table, &plan, new_data_offset, !(member->flags & MEMBER_DEDUP));
+  }
+  free(map_text);
+  dedup_plan_free(&plan);
+  return result;
+}
+
+/*
+ * Adds a record with the content hash of the 'size' bytes of the file open
+ * as 'fd' to 'records'
+ * Returns 0 upon success, -1 upon error
+ */
+static int add_hash_record(pax_records_t *records, int fd, off_t size) {
+  uint64_t hash;
+  if (content_hash_fd(fd, 0, size, &hash) != 0) {
+    perror("Error: Failed to hash file contents");
+    return -1;
+  }
+  char value[17];
+  snprintf(value, sizeof(value), "%016llx", (unsigned long long)hash);
+  if (pax_records_add(records, HASH_KEY, value) != 0) {
+    perror("Error: Failed to record file hash");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Adds an "mtime" record with the modification time in 'stat_buf' to
+ * 'records' if the header cannot hold it (it is before the epoch) or
+ * minitar_options.mtime_ns asks for its nanoseconds, and updates 'member' to
+ * match
+ * Returns 0 upon success, -1 upon error
+ */
+static int add_mtime_record(pax_records_t *records, const struct stat *stat_buf,
+                            archive_member_t *member) {
+  long nsec = stat_buf->st_mtim.tv_nsec;
+  if (stat_buf->st_mtime >= 0 && (!minitar_options.mtime_ns || nsec == 0)) {
+    return 0;
+  }
+  char value[48];
+  format_pax_time(value, sizeof(value), stat_buf->st_mtime, nsec);
+  if (pax_records_add(records, "mtime", value) != 0) {
+    perror("Error: Failed to record modification time");
+    return -1;
+  }
+  member->mtime = stat_buf->st_mtime;
+  member->mtime_nsec = nsec;
+  return 0;
+}
+
+/*
+ * Lays out the member for 'record', to be written at 'offset', in 'layout'
+ * and describes it in 'member' for the archive index. A regular file with
+ * holes becomes a sparse member, whose data leaves the holes out. A member
+ * gets an extended header when it needs records the tar header has no room
+ * for: a hash of the file's contents (with minitar_options.hash set), a
+ * modification time to the nanosecond or before the epoch, or a size from
+ * 8 GiB on, which other tars may not read from the header.
+ * Returns 0 upon success, -1 upon error (after which 'layout' needs no freeing)
+ */
+static int layout_member(member_layout_t *layout, const file_record_t *record, off_t offset,
+                         archive_member_t *member) {
+  STATS_START(timer);
+  layout->extended_prefix = NULL;
+  layout->prefix_len = BLOCK_SIZE;
+  sparse_map_init(&layout->map);
+  pax_records_init(&layout->records);
+  if (fill_tar_header(&layout->header, record->name, &record->stat) != 0) {
+    perror("Error: Failed to fill tar header");
+    return -1;
+  }
+
+  // Copy exactly the number of bytes the header promises, so a file that
+  // changes size while being archived cannot misalign the following members
+  off_t file_size;
+  time_t mtime;
+  header_fields(&layout->header, &file_size, &mtime);
+  layout->whole = (sparse_region_t){.offset = 0, .size = file_size};
+  layout->data_size = file_size;
+  *member = (archive_member_t){.name = (char *)record->name, .offset = offset,
+                               .data_offset = offset + BLOCK_SIZE, .size = file_size,
+                               .real_size = file_size, .mtime = mtime, .flags = 0};
+
+  if ((minitar_options.hash && record->fd >= 0 &&
+       add_hash_record(&layout->records, record->fd, file_size) != 0) ||
+      add_mtime_record(&layout->records, &record->stat, member) != 0) {
+    layout_free(layout);
+    return -1;
+  }
+  layout->shared_records_len = layout->records.len;
+  int sparse = record->fd >= 0 ? sparse_map_detect(record->fd, &record->stat, &layout->map) : 0;
+  if (sparse < 0) {
+    perror("Error: Failed to find holes in file");
+    layout_free(layout);
+    return -1;
+  }
+  if (sparse > 0) {
+    sparse = layout_sparse(layout, record, member);
+    if (sparse < 0) {
+      layout_free(layout);
+      return -1;
+    }
+    // A name too long for the sparse headers leaves the file stored whole
+    if (sparse > 0) {
+      sparse_map_free(&layout->map);
+    }
+  }
+  if (layout->extended_prefix == NULL &&
+      add_size_record(&layout->records, file_size, file_size) != 0) {
+    layout_free(layout);
+    return -1;
+  }
+  if (layout->extended_prefix == NULL && layout->records.len > 0) {
+    char pax_name[PATH_MAX];
+    pax_header_name(record->name, pax_name);
+    if (layout_extended(layout, pax_name, &record->stat, NULL, 0, member) != 0) {
+      layout_free(layout);
+      return -1;
+    }
+  }
+  STATS_PHASE(STATS_PHASE_HEADER, timer);
+  return 0;
+}
+
+// Where write_record sends each member
+typedef struct {
+  buffered_writer_t *writer;
+  archive_index_t *index;
+  // If not NULL, the next member's header is stored here instead of being
+  // written, and a zero block takes its place in the archive
+  tar_header *deferred_header;
+  // If not NULL, files are deduplicated against the chunks listed here
+  dedup_table_t *dedup;
+  // Archive to reserve space in ahead of the writes, or -1, and the end of
+  // the space reserved so far
+  int reserve_fd;
+  off_t reserved_end;
+} write_job_t;
+
+/*
+ * Reserves space in the archive of 'job' up to at least 'end', plus the
+ * end-of-archive blocks, so the file system can allocate it in large extents.
+ * Space is reserved RESERVE_STEP bytes or more at a time, and only as the
+ * members' sizes become known from the walk. Reserving is only an
+ * optimization, so failure is not an error.
+ */
+static void reserve_space(write_job_t *job, off_t end) {
+  end += NUM_TRAILING_BLOCKS * BLOCK_SIZE;
+  if (job->reserve_fd < 0 || end <= job->reserved_end) {
+    return;
+  }
+  if (end < job->reserved_end + RESERVE_STEP) {
+    end = job->reserved_end + RESERVE_STEP;
+  }
+  fallocate(job->reserve_fd, FALLOC_FL_KEEP_SIZE, job->reserved_end, end - job->reserved_end);
+  job->reserved_end = end;
+}
+
+/*
+ * Writes one member through the writer of 'arg' (a write_job_t): a tar
+ * header describing 'record' followed by the file's contents, zero-padded
+ * out to a whole number of blocks. The member is also recorded in the index.
+ * A sparse file gets the headers and map of the sparse format instead, and
+ * only its data regions are read and written. A deduplicated file is laid
+ * out the same way, with only its new chunks as data.
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_record(file_record_t *record, void *arg) {
+  STATS_START(timer);
+  write_job_t *job = arg;
+  buffered_writer_t *writer = job->writer;
+  member_layout_t layout;
+  archive_member_t member;
+  if (layout_member(&layout, record, writer->position, &member) != 0) {
+    return -1;
+  }
+  if (job->dedup != NULL && record->fd >= 0 && !(member.flags & MEMBER_SPARSE) &&
+      layout.data_size > 0 &&
+      layout_dedup(&layout, record, &member, job->dedup, writer) != 0) {
+    layout_free(&layout);
+    return -1;
+  }
+  if (archive_index_add_member(job->index, &member) != 0) {
+    perror("Error: Failed to record archive member");
+    layout_free(&layout);
+    return -1;
+  }
+  reserve_space(job, writer->position + layout_extent(&layout));
+
+  // A deferred header is the member's first block, whichever header that is
+  static const char zero_block[BLOCK_SIZE];
+  const char *prefix = layout_prefix(&layout);
+  const void *first_block = prefix;
+  if (job->deferred_header != NULL) {
+    memcpy(job->deferred_header, prefix, sizeof(tar_header));
+    job->deferred_header = NULL;
+    first_block = zero_block;
+  }
+  int result = -1;
+  if (writer_write(writer, first_block, BLOCK_SIZE) != 0 ||
+      writer_write(writer, prefix + BLOCK_SIZE, layout.prefix_len - BLOCK_SIZE) != 0) {
+    perror("Error: Failed to write header to archive");
+  } else if (record->fd < 0) {
+    result = 0;
+  } else {
+    int num_regions;
+    const sparse_region_t *regions = layout_regions(&layout, &num_regions);
+    result = 0;
+    for (int i = 0; i < num_regions && result == 0; i++) {
+      // A whole file is already positioned at its start
+      if (layout.map.count > 0) {
+        STATS_COUNT(STATS_SEEKS, 1);
+      }
+      if ((layout.map.count > 0 && lseek(record->fd, regions[i].offset, SEEK_SET) < 0) ||
+          writer_copy(writer, record->fd, regions[i].size) != 0) {
+        perror("Error: Failed to write file contents to archive");
+        result = -1;
+      }
+    }
+
+    // Only the final partial block of the member needs padding
+    if (result == 0 &&
+        writer_zeros(writer, padded_size(layout.data_size) - layout.data_size) != 0) {
+      perror("Error: Failed to write file padding to archive");
+      result = -1;
+    }
+  }
+  layout_free(&layout);
+  STATS_MEMBER(timer);
+  return result;
+}
+
+/*
+ * Writes every file in 'files', and everything inside any directories among
+ * them, as members through 'writer', followed by the end-of-archive blocks,
+ * and records each member in 'index'
+ * If 'first_header' is not NULL, the first member's header is stored there
+ * and a zero block is written in its place, for the caller to fill in later.
+ * If 'dedup' is not NULL, files are deduplicated against the chunks it lists.
+ * If 'reserve_fd' is not -1, space is reserved in it ahead of the writes.
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_members(buffered_writer_t *writer, const file_list_t *files,
+                         archive_index_t *index, tar_header *first_header,
+                         dedup_table_t *dedup, int reserve_fd) {
+  // Each file is opened once by the walk and its header and contents are
+  // written straight from that descriptor
+  write_job_t job = {.writer = writer, .index = index, .deferred_header = first_header,
+                     .dedup = dedup, .reserve_fd = reserve_fd,
+                     .reserved_end = writer->position};
+  if (walk_files(files, write_record, &job) != 0) {
+    return -1;
+  }
+  index->end_offset = writer->position;
+
+  // Write trailing blocks to mark end of archive
+  if (writer_zeros(writer, NUM_TRAILING_BLOCKS * BLOCK_SIZE) != 0 ||
+      writer_flush(writer) != 0) {
+    perror("Error: Failed to write trailing blocks");
+    return -1;
+  }
+  return 0;
+}
+
+// Layout of one member in an archive being created in parallel
+typedef struct {
+  // Member name, stored in the archive index's arena
+  const char *name;
+  member_layout_t layout;
+  // Offset of the member's first block within the archive
+  off_t offset;
+  // Descriptor kept open from the walk, or -1 if the file must be reopened
+  // (or is a directory, which has no data)
+  int fd;
+  // Metadata the header was built from, to check a reopened file against
+  struct stat stat;
+} member_plan_t;
+
+// Everything the worker threads of a parallel create need to share
+typedef struct {
+  int archive_fd;
+  member_plan_t *members;
+  int num_members;
+  int capacity;
+  archive_index_t *index;
+  // Number of descriptors the walk may still keep open for the workers
+  int fds_left;
+} create_job_t;
+
+/*
+ * Returns how many files a parallel create may hold open at once: half of the
+ * descriptor limit, leaving the rest for the archive, directories being
+ * walked and the standard streams
+ */
+static int open_file_budget(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+    return MAX_KEPT_FDS;
+  }
+  rlim_t budget = limit.rlim_cur / 2;
+  return budget > MAX_KEPT_FDS ? MAX_KEPT_FDS : (int)budget;
+}
+
+/*
+ * Walk callback for a parallel create: fills in the header of 'record' and
+ * assigns it the next position in the archive. The descriptor is kept for
+ * the worker that will copy the file while the budget allows.
+ * Returns 0 upon success, -1 upon error
+ */
+static int plan_record(file_record_t *record, void *arg) {
+  create_job_t *job = arg;
+  if (job->num_members == job->capacity) {
+    int new_capacity = job->capacity == 0 ? 64 : job->capacity * 2;
+    member_plan_t *members = realloc(job->members, sizeof(member_plan_t) * new_capacity);
+    if (members == NULL) {
+      perror("Error: Failed to allocate archive layout");
+      return -1;
+    }
+    job->members = members;
+    job->capacity = new_capacity;
+  }
+
+  member_plan_t *member = &job->members[job->num_members];
+  archive_member_t indexed;
+  member->offset = job->index->end_offset;
+  if (layout_member(&member->layout, record, member->offset, &indexed) != 0) {
+    return -1;
+  }
+  if (archive_index_add_member(job->index, &indexed) != 0) {
+    perror("Error: Failed to record archive member");
+    layout_free(&member->layout);
+    return -1;
+  }
+  member->name = job->index->members[job->index->count - 1].name;
+  member->stat = record->stat;
+  member->fd = -1;
+  if (record->fd >= 0 && job->fds_left > 0) {
+    member->fd = record->fd;
+    record->fd = -1;
+    job->fds_left--;
+  }
+  job->num_members++;
+  job->index->end_offset += layout_extent(&member->layout);
+  return 0;
+}
+
+/*
+ * Opens the file of 'member' again by name, for members whose descriptor was
+ * not kept, and checks that it is still the file the header describes
+ * Returns the open descriptor, or -1 upon error
+ */
+static int reopen_member(const member_plan_t *member) {
+  int file_fd = open(member->name, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) {
+    perror("Error: Failed to open file");
+    return -1;
+  }
+  struct stat stat_buf;
+  if (fstat(file_fd, &stat_buf) != 0) {
+    perror("Error: Failed to stat file");
+    close(file_fd);
+    return -1;
+  }
+  if (stat_buf.st_dev != member->stat.st_dev || stat_buf.st_ino != member->stat.st_ino ||
+      stat_buf.st_size != member->stat.st_size ||
+      stat_buf.st_mtim.tv_sec != member->stat.st_mtim.tv_sec ||
+      stat_buf.st_mtim.tv_nsec != member->stat.st_mtim.tv_nsec) {
+    fprintf(stderr, "Error: File changed while being archived: %s\n", member->name);
+    close(file_fd);
+    return -1;
+  }
+  return file_fd;
+}
+
+/*
+ * Copies the data of 'member', a file rather than a directory, to its place
+ * in the archive being created by 'job'
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_planned_data(create_job_t *job, member_plan_t *member) {
+  int file_fd = member->fd >= 0 ? member->fd : reopen_member(member);
+  member->fd = -1;
+  if (file_fd < 0) {
+    return -1;
+  }
+  off_t offset = member->offset + member->layout.prefix_len;
+  int num_regions;
+  const sparse_region_t *regions = layout_regions(&member->layout, &num_regions);
+  for (int i = 0; i < num_regions; i++) {
+    off_t in_offset = regions[i].offset;
+    if (copy_file_data(job->archive_fd, &offset, file_fd, &in_offset, regions[i].size) != 0) {
+      perror("Error: Failed to write file contents to archive");
+      close(file_fd);
+      return -1;
+    }
+  }
+  close(file_fd);
+  return 0;
+}
+
+/*
+ * Worker task for a parallel create: writes the headers and data of member
+ * 'index' at its precomputed offset. Padding needs no writes since the
+ * archive was preallocated and reads back as zeros.
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_planned_member(size_t index, void *arg) {
+  STATS_START(timer);
+  create_job_t *job = arg;
+  member_plan_t *member = &job->members[index];
+
+  off_t offset = member->offset;
+  if (write_all(job->archive_fd, &offset, layout_prefix(&member->layout),
+                member->layout.prefix_len) != 0) {
+    perror("Error: Failed to write header to archive");
+    return -1;
+  }
+  if (!S_ISDIR(member->stat.st_mode) && write_planned_data(job, member) != 0) {
+    return -1;
+  }
+  STATS_MEMBER(timer);
+  return 0;
+}
+
+// Progress of a parallel create driven by the io_uring engine
+typedef struct {
+  create_job_t *job;
+  // Next member to start, and whether its header was handed out already
+  int next_member;
+  int header_started;
+} ring_create_t;
+
+/*
+ * io_uring engine callback: hands out the headers of the next member, then
+ * its data, as copies to the member's precomputed offset. The data regions
+ * of a sparse file are copied right away instead, since each copy the
+ * engine makes is of one contiguous range.
+ * Returns 1 if '*copy' was filled in, 0 once every member is under way, or
+ * -1 upon error
+ */
+static int next_member_copy(io_copy_t *copy, void *arg) {
+  ring_create_t *state = arg;
+  create_job_t *job = state->job;
+  while (state->next_member < job->num_members) {
+    member_plan_t *member = &job->members[state->next_member];
+    if (!state->header_started) {
+      state->header_started = 1;
+      *copy = (io_copy_t){.in_fd = -1, .source = layout_prefix(&member->layout),
+                          .out_fd = job->archive_fd, .out_offset = member->offset,
+                          .nbytes = member->layout.prefix_len};
+      return 1;
+    }
+    state->header_started = 0;
+    state->next_member++;
+    if (S_ISDIR(member->stat.st_mode)) {
+      continue;
+    }
+    if (member->layout.map.count > 0) {
+      if (write_planned_data(job, member) != 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    int file_fd = member->fd >= 0 ? member->fd : reopen_member(member);
+    member->fd = -1;
+    if (file_fd < 0) {
+      return -1;
+    }
+    *copy = (io_copy_t){.in_fd = file_fd, .in_offset = 0, .out_fd = job->archive_fd,
+                        .out_offset = member->offset + member->layout.prefix_len,
+                        .nbytes = member->layout.data_size};
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * io_uring engine callback: closes the file a finished member was copied
+ * from. Any failure stops the create.
+ * Returns 0 upon success, -1 upon error
+ */
+static int member_copy_done(const io_copy_t *copy, int result, void *arg) {
+  int error = errno;
+  if (copy->in_fd >= 0) {
+    close(copy->in_fd);
+  }
+  if (result != 0) {
+    errno = error;
+    perror(copy->in_fd >= 0 ? "Error: Failed to write file contents to archive"
+                            : "Error: Failed to write header to archive");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Creates an archive with several threads writing members concurrently.
+ * Every member written is recorded in 'index'.
+ *
+ * Returns 0 upon success, -1 upon error
+ *
+ * Every file is opened and stat'ed up front, which fully determines each
+ * member's offset. The archive is then preallocated to its final size, and
+ * the pool writes headers and data with positional writes, so no thread ever
+ * waits on another. Files beyond the descriptor budget are closed after the
+ * walk and reopened by name when their turn comes.
+ *
+ * With the io_uring engine, a single thread keeps many of those reads and
+ * writes in flight instead; where io_uring is unavailable, the pool is used.
+ */
+static int create_archive_parallel(const char *archive_name, const file_list_t *files,
+                                   archive_index_t *index) {
+  create_job_t job = {.archive_fd = -1,
+                      .members = NULL,
+                      .num_members = 0,
+                      .capacity = 0,
+                      .index = index,
+                      .fds_left = open_file_budget()};
+  int result = walk_files(files, plan_record, &job);
+  off_t archive_size = index->end_offset + NUM_TRAILING_BLOCKS * BLOCK_SIZE;
+
+  if (result == 0) {
+    job.archive_fd = open(archive_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (job.archive_fd < 0) {
+      perror("Error: Unable to open archive file");
+      result = -1;
+    }
+  }
+
+  // Allocate all extents at once; fall back to just setting the size on file
+  // systems without fallocate. Either way, unwritten regions (member padding
+  // and the trailing blocks) read back as zeros.
+  if (result == 0 && fallocate(job.archive_fd, 0, 0, archive_size) != 0 &&
+      ftruncate(job.archive_fd, archive_size) != 0) {
+    perror("Error: Failed to preallocate archive file");
+    result = -1;
+  }
+
+  if (result == 0) {
+    result = 1;
+    if (minitar_options.io_engine == IO_ENGINE_URING) {
+      ring_create_t state = {.job = &job, .next_member = 0, .header_started = 0};
+      result = io_ring_run(next_member_copy, member_copy_done, &state);
+    }
+    if (result == 1) {
+      result = parallel_for(minitar_options.num_threads, job.num_members,
+                            write_planned_member, &job);
+    }
+  }
+
+  // Members never reached (after an error) still hold their descriptors
+  for (int i = 0; i < job.num_members; i++) {
+    if (job.members[i].fd >= 0) {
+      close(job.members[i].fd);
+    }
+    layout_free(&job.members[i].layout);
+  }
+  if (job.archive_fd >= 0) {
+    close(job.archive_fd);
+  }
+  free(job.members);
+  return result;
+}
+
+/*
+ * Writes a complete archive of 'files' to 'archive_fd' front to back,
+ * through a compression stage if one was requested, and records each member
+ * in 'index'
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_archive_stream(int archive_fd, const file_list_t *files,
+                                archive_index_t *index) {
+  compress_stage_t stage;
+  int out_fd = archive_fd;
+  if (minitar_options.compression != COMPRESS_NONE) {
+    if (compress_start(&stage, minitar_options.compression, archive_fd) != 0) {
+      return -1;
+    }
+    out_fd = stage.fd;
+  }
+
+  buffered_writer_t writer;
+  int result = -1;
+  if (writer_init(&writer, out_fd, 0) != 0) {
+    perror("Error: Failed to allocate write buffer");
+  } else if (!minitar_options.dedup) {
+    result = write_members(&writer, files, index, NULL, NULL, -1);
+    writer_free(&writer);
+  } else {
+    dedup_table_t dedup;
+    dedup_table_init(&dedup);
+    result = write_members(&writer, files, index, NULL, &dedup, -1);
+    dedup_table_free(&dedup);
+    writer_free(&writer);
+  }
+
+  if (minitar_options.compression != COMPRESS_NONE && compress_finish(&stage) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+// Everything write_seekable_record needs to put members in their own frames
+typedef struct {
+  seekable_writer_t *writer;
+  archive_index_t *index;
+  // Compressed offset of each member's frame, plus one slot for the
+  // end-of-archive frame
+  off_t *frames;
+  int capacity;
+  // Offset the next member would have in the uncompressed archive
+  off_t offset;
+  char *buffer;
+  size_t buffer_size;
+} seekable_job_t;
+
+/*
+ * Writes one member through the seekable writer of 'arg' (a seekable_job_t)
+ * as a frame of its own: the headers describing 'record', the file's
+ * contents (just its data regions, if it is sparse) and the padding. The
+ * member and its frame are recorded in the job's index.
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_seekable_record(file_record_t *record, void *arg) {
+  STATS_START(timer);
+  seekable_job_t *job = arg;
+  if (job->index->count + 2 > job->capacity) {
+    int capacity = job->capacity > 0 ? job->capacity * 2 : 64;
+    off_t *frames = realloc(job->frames, sizeof(off_t) * capacity);
+    if (frames == NULL) {
+      perror("Error: Failed to record archive member");
+      return -1;
+    }
+    job->frames = frames;
+    job->capacity = capacity;
+  }
+  member_layout_t layout;
+  archive_member_t member;
+  if (layout_member(&layout, record, job->offset, &member) != 0) {
+    return -1;
+  }
+  if (archive_index_add_member(job->index, &member) != 0) {
+    perror("Error: Failed to record archive member");
+    layout_free(&layout);
+    return -1;
+  }
+  job->frames[job->index->count - 1] = job->writer->position;
+  job->offset += layout_extent(&layout);
+
+  int result = 0;
+  if (seekable_begin_frame(job->writer) != 0 ||
+      seekable_write(job->writer, layout_prefix(&layout), layout.prefix_len) != 0) {
+    perror("Error: Failed to write header to archive");
+    result = -1;
+  }
+
+  // As with uncompressed members, exactly the size in the header is stored
+  int num_regions;
+  const sparse_region_t *regions = layout_regions(&layout, &num_regions);
+  for (int i = 0; record->fd >= 0 && i < num_regions && result == 0; i++) {
+    off_t in_offset = regions[i].offset;
+    off_t remaining = regions[i].size;
+    while (remaining > 0) {
+      size_t to_read = remaining < (off_t)job->buffer_size ? remaining : job->buffer_size;
+      ssize_t bytes_read = read_all(record->fd, &in_offset, job->buffer, to_read);
+      if (bytes_read != (ssize_t)to_read) {
+        if (bytes_read >= 0) {
+          errno = ENODATA;
+        }
+        perror("Error: Failed to write file contents to archive");
+        result = -1;
+        break;
+      }
+      if (seekable_write(job->writer, job->buffer, to_read) != 0) {
+        perror("Error: Failed to write file contents to archive");
+        result = -1;
+        break;
+      }
+      remaining -= to_read;
+    }
+  }
+
+  static const char zeros[BLOCK_SIZE];
+  if (result == 0 &&
+      (seekable_write(job->writer, zeros, padded_size(layout.data_size) - layout.data_size) !=
+           0 ||
+       seekable_end_frame(job->writer) != 0)) {
+    perror("Error: Failed to write file padding to archive");
+    result = -1;
+  }
+  layout_free(&layout);
+  STATS_MEMBER(timer);
+  return result;
+}
+
+/*
+ * Writes a seekable compressed archive of 'files' to 'archive_fd': one frame
+ * per member, a frame holding the end-of-archive blocks, and then the frame
+ * index. Each member is recorded in 'index'.
+ * Returns 0 upon success, -1 upon error
+ */
+static int write_seekable_archive(int archive_fd, const file_list_t *files,
+                                  archive_index_t *index) {
+  seekable_writer_t writer;
+  if (seekable_writer_init(&writer, archive_fd) != 0) {
+    perror("Error: Failed to set up compression");
+    return -1;
+  }
+  seekable_job_t job = {.writer = &writer, .index = index, .frames = NULL, .capacity = 0,
+                        .offset = 0, .buffer_size = copy_get_chunk_size()};
+  job.buffer = malloc(job.buffer_size);
+  if (job.buffer == NULL) {
+    perror("Error: Failed to allocate write buffer");
+    seekable_writer_free(&writer);
+    return -1;
+  }
+
+  int result = walk_files(files, write_seekable_record, &job);
+  if (result == 0 && job.frames == NULL) {
+    job.frames = malloc(sizeof(off_t));
+    if (job.frames == NULL) {
+      perror("Error: Failed to record archive member");
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    index->end_offset = job.offset;
+    job.frames[index->count] = writer.position;
+    static const char trailer[NUM_TRAILING_BLOCKS * BLOCK_SIZE];
+    if (seekable_begin_frame(&writer) != 0 ||
+        seekable_write(&writer, trailer, sizeof(trailer)) != 0 ||
+        seekable_end_frame(&writer) != 0) {
+      perror("Error: Failed to write trailing blocks");
+      result = -1;
+    } else if (seekable_write_index(&writer, index, job.frames) != 0) {
+      perror("Error: Failed to write frame index");
+      result = -1;
+    }
+  }
+
+  free(job.buffer);
+  free(job.frames);
+  seekable_writer_free(&writer);
+  return result;
+}
+
+/**
+ * Creates an archive file using archive_name and stores the provided list of files
+ * within it using files
+ *
+ * Returns 0 upon success, -1 upon error
+ *
+ * Walks the linked list of files, descending into directories, and writes each
+ * one as a member (header block followed by its contents) using the copy engine,
+ * which moves data in large chunks and lets the kernel do the copying where possible
+ *
+ * Then adds the footer blocks by writing empty blocks at the end of the entire archive file
+ *
+ * Files with holes are stored in the GNU/PAX sparse format (see sparse.h),
+ * so only the data they actually hold is read and written
+ * If more than one thread or the io_uring engine was requested, the work is
+ * handed to create_archive_parallel
+ * If compression was requested, the members pass through a compression stage
+ * A seekable archive instead compresses each member separately (see seekable_gzip.h)
+ * If an index was requested, its sidecar is written once the archive is complete
+ * Deduplication reads chunks back from the archive as they are matched, so
+ * it needs an uncompressed archive file and writes it front to back
+ */
+int create_archive(const char *archive_name, const file_list_t *files) {
+  int to_stdout = is_stdio_archive(archive_name);
+  int compressed = minitar_options.compression != COMPRESS_NONE;
+  if (minitar_options.dedup && (to_stdout || compressed)) {
+    fprintf(stderr, "Error: Deduplication needs an uncompressed archive file\n");
+    return -1;
+  }
+  archive_index_t index;
+  archive_index_init(&index);
+
+  if (!to_stdout && !compressed && !minitar_options.dedup &&
+      (minitar_options.num_threads > 1 || minitar_options.io_engine == IO_ENGINE_URING)) {
+    if (create_archive_parallel(archive_name, files, &index) != 0) {
+      archive_index_clear(&index);
+      return -1;
+    }
+  } else {
+    // Creating and Opening the Archive file
+    int archive_fd =
+        to_stdout ? STDOUT_FILENO
+                  : open(archive_name,
+                         (minitar_options.dedup ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0666);
+    if (archive_fd < 0) {
+      perror("Error: Unable to open archive file");
+      archive_index_clear(&index);
+      return -1;
+    }
+
+    int result = minitar_options.seekable ? write_seekable_archive(archive_fd, files, &index)
+                                          : write_archive_stream(archive_fd, files, &index);
+    if (!to_stdout) {
+      close(archive_fd);
+    }
+    if (result != 0) {
+      archive_index_clear(&index);
+      return -1;
+    }
+  }
+
+  // A sidecar left over from an earlier archive of the same name describes
+  // the old contents, so it is rewritten here even without --index. Offsets
+  // into a compressed archive are of no use, so it gets no sidecar.
+  int result = 0;
+  if (!to_stdout && !compressed) {
+    result = update_archive_index(archive_name, &index, 0, archive_index_exists(archive_name));
+  }
+  archive_index_clear(&index);
+  return result;
+}
+
+/*
+ * Appends 'files' to the archive 'archive_name', open for reading and writing
+ * as 'archive_fd', whose members are all in 'index' ('sidecar_valid' tells
+ * whether its sidecar matched). The new members are added to 'index' and the
+ * sidecar is brought up to date. See append_files_to_archive.
+ * Returns 0 upon success, -1 upon error
+ */
+static int append_members(const char *archive_name, int archive_fd, archive_index_t *index,
+                          int sidecar_valid, const file_list_t *files) {
+  int first_new = index->count;
+
+  // Seek to the position where new files will be appended
+  off_t append_offset = index->end_offset;
+  STATS_COUNT(STATS_SEEKS, 1);
+  if (lseek(archive_fd, append_offset, SEEK_SET) < 0) {
+    perror("Error: Failed to seek to append position");
+    return -1;
+  }
+
+  // Append new files, followed by new trailing blocks, without the first header
+  buffered_writer_t writer;
+  if (writer_init(&writer, archive_fd, append_offset) != 0) {
+    perror("Error: Failed to allocate write buffer");
+    return -1;
+  }
+  // New files may share chunks with any member already in the archive
+  dedup_table_t dedup;
+  dedup_table_init(&dedup);
+  int result = 0;
+  for (int i = 0; minitar_options.dedup && i < first_new && result == 0; i++) {
+    if (dedup_table_scan(&dedup, archive_fd, index->members[i].data_offset,
+                         index->members[i].size) != 0) {
+      perror("Error: Failed to scan archive for deduplication");
+      result = -1;
+    }
+  }
+  tar_header first_header;
+  if (result == 0) {
+    result = write_members(&writer, files, index, &first_header,
+                           minitar_options.dedup ? &dedup : NULL, archive_fd);
+  }
+  writer_free(&writer);
+  dedup_table_free(&dedup);
+
+  // Make the new members durable before the header that links them in
+  if (result == 0 && index->count > first_new) {
+    off_t header_offset = append_offset;
+    STATS_START(timer);
+    if (fdatasync(archive_fd) != 0 ||
+        write_all(archive_fd, &header_offset, &first_header, sizeof(tar_header)) != 0 ||
+        fdatasync(archive_fd) != 0) {
+      perror("Error: Failed to commit appended files");
+      result = -1;
+    }
+    STATS_PHASE(STATS_PHASE_SYNC, timer);
+  }
+
+  // Whatever followed the old end-of-archive blocks is no longer needed, nor
+  // is space reserved past the new end, which truncating also gives back
+  off_t archive_end = index->end_offset + NUM_TRAILING_BLOCKS * BLOCK_SIZE;
+  if (result == 0 && ftruncate(archive_fd, archive_end) != 0) {
+    perror("Error: Failed to remove trailing bytes");
+    result = -1;
+  }
+
+  if (result == 0) {
+    result = update_archive_index(archive_name, index, first_new, sidecar_valid);
+  }
+  return result;
+}
+
+/*
+ * Appends files to an existing tar archive.
+ *
+ * Returns 0 on success, -1 on error.
+ *
+ * Opens the archive in read/write mode. Then locates the end of the archive,
+ * from the index sidecar when there is a valid one or else by walking the
+ * headers, and appends new files. Each file is appended by creating a tar
+ * header, writing file data in blocks, and calculating proper padding.
+ *
+ * The archive stays valid if the append is interrupted at any point. The
+ * first new header goes where the old end-of-archive marker begins, so it is
+ * held back and a zero block written in its place: until that header is
+ * written, readers still stop at the old end. Everything else, including the
+ * new end-of-archive blocks, is written and synced first, and only then is
+ * the header put in place and synced in turn. Space for the new members is
+ * reserved in large steps as the walk reaches them, so the file system can
+ * allocate it in few extents.
+ *
+ * With deduplication, the data of every member already in the archive is
+ * cut into chunks first, so new files can refer to it.
+ */
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+  if (is_stdio_archive(archive_name)) {
+    fprintf(stderr, "Error: Cannot append to an archive on standard input/output\n");
+    return -1;
+  }
+
+  // Open archive in read/write mode
+  int archive_fd = open(archive_name, O_RDWR);
+  if (archive_fd < 0) {
+    perror("Error: Unable to open archive file");
+    return -1;
+  }
+  if (check_uncompressed(archive_fd, "append to") != 0) {
+    close(archive_fd);
+    return -1;
+  }
+
+  // Find where to append new files
+  archive_index_t index;
+  archive_index_init(&index);
+  int sidecar_valid;
+  int result = load_archive_index(archive_name, archive_fd, 0, &index, &sidecar_valid);
+  if (result == 0) {
+    result = append_members(archive_name, archive_fd, &index, sidecar_valid, files);
+  }
+  close(archive_fd);
+  archive_index_clear(&index);
+  return result;
+}
+
+/*
+ * Decides whether the file open as 'file_fd' matches 'member', the latest
+ * version of it in the archive open as 'archive_fd'
+ * Returns 1 if it does, 0 if it does not, or -1 upon error
+ */
+static int file_matches_member(int file_fd, const struct stat *file_stat, int archive_fd,
+                               const archive_member_t *member) {
+  if (!S_ISREG(file_stat->st_mode) || file_stat->st_size != member->real_size) {
+    return 0;
+  }
+  if (!minitar_options.check_content) {
+    // Headers only hold whole seconds; nanoseconds are compared too when an
+    // extended header recorded them
+    return file_stat->st_mtime == member->mtime &&
+           (member->mtime_nsec == 0 || file_stat->st_mtim.tv_nsec == member->mtime_nsec);
+  }
+
+  // The data of a sparse or deduplicated member is not the file's contents
+  // laid end to end, so it cannot be hashed in place; the file is archived
+  // again instead
+  if (member->flags & (MEMBER_SPARSE | MEMBER_DEDUP)) {
+    return 0;
+  }
+  uint64_t file_hash;
+  uint64_t member_hash;
+  if (content_hash_fd(file_fd, 0, member->size, &file_hash) != 0 ||
+      content_hash_fd(archive_fd, member->data_offset, member->size, &member_hash) != 0) {
+    perror("Error: Failed to hash file contents");
+    return -1;
+  }
+  return file_hash == member_hash;
+}
+
+/*
+ * Adds each file in 'files' that differs from its latest version in the
+ * archive open as 'archive_fd', whose members are in 'index', to 'changed'.
+ * The lookup of 'index' must be built. See update_files_in_archive.
+ * Returns 0 upon success, -1 upon error
+ */
+static int find_changed_files(int archive_fd, const archive_index_t *index,
+                              const file_list_t *files, file_list_t *changed) {
+  int result = 0;
+  for (node_t *current = files->head; current != NULL && result == 0;
+       current = current->next) {
+    int matches = 0;
+    int position = archive_index_find(index, current->name);
+    int file_fd = position >= 0 ? open(current->name, O_RDONLY) : -1;
+    struct stat file_stat;
+    // Anything that cannot be compared is passed on, so appending it reports
+    // the problem
+    if (file_fd >= 0 && fstat(file_fd, &file_stat) == 0) {
+      matches = file_matches_member(file_fd, &file_stat, archive_fd,
+                                    &index->members[position]);
+    }
+    if (file_fd >= 0) {
+      close(file_fd);
+    }
+    if (matches < 0) {
+      result = -1;
+    } else if (!matches && file_list_add(changed, current->name) != 0) {
+      perror("Error: Failed to add file to list");
+      result = -1;
+    }
+  }
+  return result;
+}
+
+/*
+ * Updates an archive file using archive_name and a new list of files to possibly be updated
+ *
+ * Returns 0 upon success, and -1 upon error
+ *
+ * Loads the archive's member index once, and uses it to check that every file
+ * is already in the archive, to find the files that changed, and then to
+ * append new versions of those
+ */
+int update_files_in_archive(const char *archive_name, const file_list_t *files) {
+  if (is_stdio_archive(archive_name)) {
+    fprintf(stderr, "Error: Cannot update an archive on standard input/output\n");
+    return -1;
+  }
+  if (access(archive_name, F_OK) == -1) {
+    perror("Error: Archive file does not exist");
+    return -1;
+  }
+
+  int archive_fd = open(archive_name, O_RDWR);
+  if (archive_fd < 0) {
+    perror("Error: Unable to open archive file");
+    return -1;
+  }
+  if (check_uncompressed(archive_fd, "update") != 0) {
+    close(archive_fd);
+    return -1;
+  }
+  archive_index_t index;
+  archive_index_init(&index);
+  int sidecar_valid;
+  if (load_archive_index(archive_name, archive_fd, 0, &index, &sidecar_valid) != 0 ||
+      archive_index_build_lookup(&index) != 0) {
+    close(archive_fd);
+    archive_index_clear(&index);
+    return -1;
+  }
+
+  // Checking to see if the files being appended are all present in the archive
+  int result = 0;
+  for (node_t *current = files->head; current != NULL; current = current->next) {
+    if (archive_index_find(&index, current->name) < 0) {
+      fprintf(stderr, "Error: One or more of the specified files is not already present in archive\n");
+      result = -1;
+      break;
+    }
+  }
+
+  // Only files that differ from their latest archived version are appended again
+  file_list_t changed_files;
+  file_list_init(&changed_files);
+  if (result == 0) {
+    result = find_changed_files(archive_fd, &index, files, &changed_files);
+  }
+
+  // Appends new versions of the files to the archive, ensuring they are written in chunks
+  if (result == 0 && changed_files.size > 0) {
+    result = append_members(archive_name, archive_fd, &index, sidecar_valid, &changed_files);
+    if (result != 0) {
+      perror("Error: Failed to update archive file");
+    }
+  }
+
+  file_list_clear(&changed_files);
+  close(archive_fd);
+  archive_index_clear(&index);
+  return result;
+}
+
+/*
+ * Finds the members of 'index' that are not superseded by a later member of
+ * the same name, and stores their count in '*num_members'
+ * Returns a newly allocated array of their positions in the index, in archive
+ * order, or NULL upon error
+ */
+static int *find_latest_members(const archive_index_t *index, int *num_members) {
+  int *members = malloc(sizeof(int) * (index->count > 0 ? index->count : 1));
+  if (members == NULL) {
+    perror("Error: Failed to allocate member list");
+    return NULL;
+  }
+
+  // Walk backwards so the first occurrence of each name seen is its latest
+  file_list_t seen;
+  file_list_init(&seen);
+  int count = 0;
+  for (int i = index->count - 1; i >= 0; i--) {
+    if (!file_list_contains(&seen, index->members[i].name)) {
+      if (file_list_add(&seen, index->members[i].name) != 0) {
+        perror("Error: Failed to record member name");
+        free(members);
+        file_list_clear(&seen);
+        return NULL;
+      }
+      members[count++] = i;
+    }
+  }
+  file_list_clear(&seen);
+
+  // Restore archive order so the archive is read front to back
+  for (int i = 0; i < count / 2; i++) {
+    int tmp = members[i];
+    members[i] = members[count - 1 - i];
+    members[count - 1 - i] = tmp;
+  }
+  *num_members = count;
+  return members;
+}
+
+/*
+ * Returns 1 if 'name' stays beneath the current working directory when
+ * extracted: it is relative and has no ".." component. Returns 0 otherwise.
+ */
+static int is_safe_member_name(const char *name) {
+  if (name[0] == '/' || strlen(name) > MAX_MEMBER_NAME_LEN) {
+    return 0;
+  }
+  for (const char *component = name; *component != '\0';) {
+    size_t len = strcspn(component, "/");
+    if (len == 2 && component[0] == '.' && component[1] == '.') {
+      return 0;
+    }
+    component += len;
+    if (*component == '/') {
+      component++;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Creates every missing directory leading up to the last component of 'name'
+ * Returns 0 upon success, -1 upon error
+ */
+static int create_parent_dirs(const char *name) {
+  char path[MAX_MEMBER_NAME_LEN + 1];
+  strcpy(path, name);
+  size_t len = strlen(path);
+  // A trailing slash belongs to the member itself, not to a parent
+  if (len > 0 && path[len - 1] == '/') {
+    path[len - 1] = '\0';
+  }
+  for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    // Another thread may be creating the same directory at the same time
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    *slash = '/';
+  }
+  return 0;
+}
+
+/*
+ * Creates (or truncates) the file 'name', or creates the directory 'name' if
+ * it ends in '/', beneath the current working directory to receive an
+ * extracted member. Missing parent directories are created as needed, though
+ * only when the first attempt shows they are missing.
+ * Returns the open file descriptor, or -1 if there is nothing to write: the
+ * member is a directory, or it must be skipped (the problem has then been
+ * reported)
+ */
+static int create_extracted_file(const char *name) {
+  // Ensure the member cannot land outside the current directory
+  if (!is_safe_member_name(name)) {
+    fprintf(stderr, "Error: Refusing to extract unsafe path: %s\n", name);
+    return -1;
+  }
+
+  size_t len = strlen(name);
+  if (name[len - 1] == '/') {
+    int result = mkdir(name, 0777);
+    if (result != 0 && errno == ENOENT && create_parent_dirs(name) == 0) {
+      result = mkdir(name, 0777);
+    }
+    if (result != 0 && errno != EEXIST) {
+      perror("Error: Failed to create extracted directory");
+    }
+    return -1;
+  }
+
+  // Create and open the extracted file
+  int file_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (file_fd < 0 && errno == ENOENT && create_parent_dirs(name) == 0) {
+    file_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+  if (file_fd < 0) {
+    perror("Error: Failed to create extracted file");
+  }
+  return file_fd;
+}
+
+// One member name or glob pattern given to select what to extract
+typedef struct {
+  // The pattern with any trailing '/' removed
+  char *pattern;
+  // Set if the pattern has glob characters, so it cannot be looked up by name
+  int is_glob;
+  // Set if members must be compared against the pattern one by one
+  int scan;
+  // Set once some member matches the pattern
+  int matched;
+} member_pattern_t;
+
+// The members to extract: those matching any pattern, or all of them if
+// there are no patterns
+typedef struct {
+  member_pattern_t *patterns;
+  int count;
+} member_filter_t;
+
+/*
+ * Fills in 'filter' with a pattern for each name in 'files'
+ * Returns 0 upon success, -1 upon error
+ */
+static int member_filter_init(member_filter_t *filter, const file_list_t *files) {
+  filter->count = 0;
+  filter->patterns = malloc(sizeof(member_pattern_t) * (files->size > 0 ? files->size : 1));
+  if (filter->patterns == NULL) {
+    perror("Error: Failed to allocate member patterns");
+    return -1;
+  }
+  for (node_t *current = files->head; current != NULL; current = current->next) {
+    member_pattern_t *pattern = &filter->patterns[filter->count];
+    pattern->pattern = strdup(current->name);
+    if (pattern->pattern == NULL) {
+      perror("Error: Failed to allocate member patterns");
+      return -1;
+    }
+    filter->count++;
+    // A directory given as "dir/" selects the same members as "dir"
+    size_t len = strlen(pattern->pattern);
+    while (len > 1 && pattern->pattern[len - 1] == '/') {
+      pattern->pattern[--len] = '\0';
+    }
+    pattern->is_glob = strpbrk(pattern->pattern, "*?[\\") != NULL;
+    pattern->scan = pattern->is_glob;
+    pattern->matched = 0;
+  }
+  return 0;
+}
+
+static void member_filter_free(member_filter_t *filter) {
+  for (int i = 0; i < filter->count; i++) {
+    free(filter->patterns[i].pattern);
+  }
+  free(filter->patterns);
+}
+
+/*
+ * Returns 1 if 'name' is selected by 'pattern': it matches the pattern, or
+ * lies inside a directory that does. Returns 0 otherwise.
+ */
+static int pattern_matches(const member_pattern_t *pattern, const char *name) {
+  return fnmatch(pattern->pattern, name, FNM_LEADING_DIR) == 0;
+}
+
+/*
+ * Returns 1 if 'filter' selects a member named 'name', marking the patterns
+ * that match it, or 0 otherwise
+ */
+static int member_filter_matches(member_filter_t *filter, const char *name) {
+  int selected = filter->count == 0;
+  for (int i = 0; i < filter->count; i++) {
+    if (pattern_matches(&filter->patterns[i], name)) {
+      filter->patterns[i].matched = 1;
+      selected = 1;
+    }
+  }
+  return selected;
+}
+
+/*
+ * Reports each pattern in 'filter' that selected no member
+ * Returns 0 if every pattern matched, -1 otherwise
+ */
+static int member_filter_report(const member_filter_t *filter) {
+  int result = 0;
+  for (int i = 0; i < filter->count; i++) {
+    if (!filter->patterns[i].matched) {
+      fprintf(stderr, "Error: Not found in archive: %s\n", filter->patterns[i].pattern);
+      result = -1;
+    }
+  }
+  return result;
+}
+
+/*
+ * Narrows 'members', the latest version of each member of 'index' in archive
+ * order, down to those selected by 'filter', keeping their order
+ * A plain name is found with the index's hash lookup, both as a file and as a
+ * directory; only glob patterns and directories (whose contents are selected
+ * too) need the member names to be scanned.
+ * Returns 0 upon success, -1 upon error
+ */
+static int select_members(archive_index_t *index, member_filter_t *filter, int *members,
+                          int *num_members) {
+  if (filter->count == 0) {
+    return 0;
+  }
+  char *selected = calloc(index->count > 0 ? index->count : 1, 1);
+  if (selected == NULL || archive_index_build_lookup(index) != 0) {
+    perror("Error: Failed to select members");
+    free(selected);
+    return -1;
+  }
+
+  int needs_scan = 0;
+  for (int i = 0; i < filter->count; i++) {
+    member_pattern_t *pattern = &filter->patterns[i];
+    if (pattern->scan) {
+      needs_scan = 1;
+      continue;
+    }
+    char dir_name[MAX_MEMBER_NAME_LEN + 2];
+    int file_pos = archive_index_find(index, pattern->pattern);
+    int dir_pos = -1;
+    if (strlen(pattern->pattern) < MAX_MEMBER_NAME_LEN) {
+      snprintf(dir_name, sizeof(dir_name), "%s/", pattern->pattern);
+      dir_pos = archive_index_find(index, dir_name);
+    }
+    if (file_pos >= 0) {
+      selected[file_pos] = 1;
+      pattern->matched = 1;
+    }
+    if (dir_pos >= 0) {
+      selected[dir_pos] = 1;
+      pattern->matched = 1;
+    }
+    // Members may sit under a name that has no directory member of its own
+    if (file_pos < 0) {
+      pattern->scan = 1;
+      needs_scan = 1;
+    }
+  }
+
+  if (needs_scan) {
+    for (int i = 0; i < *num_members; i++) {
+      const char *name = index->members[members[i]].name;
+      for (int j = 0; j < filter->count; j++) {
+        member_pattern_t *pattern = &filter->patterns[j];
+        if (pattern->scan && pattern_matches(pattern, name)) {
+          selected[members[i]] = 1;
+          pattern->matched = 1;
+        }
+      }
+    }
+  }
+
+  int count = 0;
+  for (int i = 0; i < *num_members; i++) {
+    if (selected[members[i]]) {
+      members[count++] = members[i];
+    }
+  }
+  *num_members = count;
+  free(selected);
+  return 0;
+}
+
+/*
+ * Reads the records of the extended header 'header', found at 'offset', from
+ * 'reader' and applies them to 'attrs'. Global extended headers are skipped.
+ * Returns 0 upon success, -1 upon error
+ */
+static int stream_pax_header(buffered_reader_t *reader, const tar_header *header, off_t offset,
+                             pax_attrs_t *attrs) {
+  off_t len;
+  time_t mtime;
+  if (parse_header(header, offset, &len, &mtime) != 0) {
+    return -1;
+  }
+  if (header->typeflag == PAX_GLOBAL_TYPE) {
+    if (reader_skip(reader, padded_size(len)) != 0) {
+      perror("Error: Failed to read past extended header");
+      return -1;
+    }
+    return 0;
+  }
+  if (len > MAX_PAX_LEN) {
+    fprintf(stderr, "Error: Extended header too large at offset %lld\n", (long long)offset);
+    return -1;
+  }
+
+  char *data = malloc(len > 0 ? len : 1);
+  if (data == NULL) {
+    perror("Error: Failed to allocate extended header");
+    return -1;
+  }
+  int result = -1;
+  if (reader_read(reader, data, len) != len || reader_skip(reader, padded_size(len) - len) != 0) {
+    perror("Error: Failed to read extended header");
+  } else {
+    result = load_pax_attrs(data, len, offset, attrs);
+  }
+  free(data);
+  return result;
+}
+
+/*
+ * Rebuilds the sparse file of 'member' in the empty 'file_fd' from the
+ * member's data, read from 'reader'
+ * Returns 0 upon success, -1 upon error
+ */
+static int stream_sparse_member(buffered_reader_t *reader, int file_fd,
+                                const archive_member_t *member) {
+  sparse_sink_t sink;
+  sparse_sink_init(&sink, file_fd, member->real_size);
+  char buffer[16 * BLOCK_SIZE];
+  int result = 0;
+  for (off_t remaining = member->size; remaining > 0 && result == 0;) {
+    size_t len = remaining < (off_t)sizeof(buffer) ? remaining : sizeof(buffer);
+    ssize_t bytes_read = reader_read(reader, buffer, len);
+    if (bytes_read != (ssize_t)len) {
+      if (bytes_read >= 0) {
+        errno = ENODATA;
+      }
+      result = -1;
+    } else {
+      result = sparse_sink_write(&sink, buffer, len);
+      remaining -= len;
+    }
+  }
+  if (result == 0) {
+    result = sparse_sink_finish(&sink);
+  }
+  sparse_sink_free(&sink);
+  return result;
+}
+
+/*
+ * Reads the archive on 'archive_fd' strictly front to back, as it would
+ * arrive through a pipe, recording each member in 'index'.
+ * When 'filter' is not NULL each member it selects is also written out as a
+ * file; later versions of a name simply overwrite earlier ones as they
+ * arrive. Other member data is read and discarded.
+ * Returns 0 upon success, -1 upon error
+ */
+static int stream_archive(int archive_fd, archive_index_t *index, member_filter_t *filter) {
+  buffered_reader_t reader;
+  if (reader_init(&reader, archive_fd) != 0) {
+    perror("Error: Failed to allocate read buffer");
+    return -1;
+  }
+
+  int result = 0;
+  pax_attrs_t attrs;
+  pax_attrs_reset(&attrs);
+  while (1) {
+    tar_header header;
+    off_t offset = reader.position;
+    ssize_t bytes_read = reader_read(&reader, &header, sizeof(tar_header));
+    if (bytes_read < 0 || (bytes_read > 0 && bytes_read != sizeof(tar_header))) {
+      perror("Error: Failed to read header block");
+      result = -1;
+      break;
+    }
+    // An empty block (or the end of the stream) marks the end of the archive
+    if (bytes_read == 0 || header.name[0] == '\0') {
+      break;
+    }
+
+    if (header.typeflag == PAX_TYPE || header.typeflag == PAX_GLOBAL_TYPE) {
+      if (stream_pax_header(&reader, &header, offset, &attrs) != 0) {
+        result = -1;
+        break;
+      }
+      continue;
+    }
+    archive_member_t member;
+    char name[PATH_MAX];
+    if (describe_member(&header, offset, &attrs, &member, name) != 0) {
+      result = -1;
+      break;
+    }
+    if (archive_index_add_member(index, &member) != 0) {
+      perror("Error: Failed to record archive member");
+      result = -1;
+      break;
+    }
+    pax_attrs_reset(&attrs);
+
+    off_t to_skip = padded_size(member.size);
+    STATS_START(timer);
+    int selected = filter != NULL && member_filter_matches(filter, name);
+    // A deduplicated file refers back to data the stream has already passed
+    if (selected && (member.flags & MEMBER_DEDUP)) {
+      fprintf(stderr, "Error: Cannot extract deduplicated file '%s' from a stream\n", name);
+      selected = 0;
+    }
+    int file_fd = selected ? create_extracted_file(name) : -1;
+    if (file_fd >= 0) {
+      int copy_result = member.flags & MEMBER_SPARSE
+                            ? stream_sparse_member(&reader, file_fd, &member)
+                            : reader_copy(&reader, file_fd, member.size);
+      close(file_fd);
+      if (copy_result != 0) {
+        // The stream cannot be rewound, so there is no way to resynchronize
+        perror("Error: Failed to write extracted file");
+        result = -1;
+        break;
+      }
+      STATS_MEMBER(timer);
+      to_skip -= member.size;
+    }
+    if (reader_skip(&reader, to_skip) != 0) {
+      perror("Error: Failed to read past file data");
+      result = -1;
+      break;
+    }
+  }
+
+  index->end_offset = attrs.present ? attrs.offset : reader.position;
+  reader_free(&reader);
+  return result;
+}
+
+/*
+ * Reads the archive on 'archive_fd' front to back like stream_archive,
+ * decompressing it first if 'format' calls for it
+ * Returns 0 upon success, -1 upon error
+ */
+static int read_archive_stream(int archive_fd, compress_format_t format,
+                               archive_index_t *index, member_filter_t *filter) {
+  if (format == COMPRESS_NONE) {
+    return stream_archive(archive_fd, index, filter);
+  }
+  compress_stage_t stage;
+  if (decompress_start(&stage, format, archive_fd) != 0) {
+    return -1;
+  }
+  int result = stream_archive(stage.fd, index, filter);
+  if (compress_finish(&stage) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+/*
+ * Loads the frame index of the archive open as 'archive_fd' into 'index' if it
+ * is a seekable compressed archive, keeping the frame offsets in '*frames'
+ * unless 'frames' is NULL
+ * Returns 0 if the index was loaded, 1 if the archive is not seekable, -1 upon error
+ */
+static int load_seekable_index(int archive_fd, compress_format_t format,
+                               archive_index_t *index, off_t **frames) {
+  if (format != COMPRESS_GZIP) {
+    return 1;
+  }
+  off_t *offsets;
+  STATS_START(timer);
+  int result = seekable_load_index(archive_fd, index, &offsets);
+  STATS_PHASE(STATS_PHASE_SCAN, timer);
+  if (result < 0) {
+    perror("Error: Failed to read frame index");
+  } else if (result == 0) {
+    if (frames != NULL) {
+      *frames = offsets;
+    } else {
+      free(offsets);
+    }
+  }
+  return result;
+}
+
+/*
+ * Reads an archive file and extracts the list of contained file names
+ *
+ * Returns 0 for success, -1 for error
+ *
+ * Answers from the index sidecar when it is valid for the archive; otherwise
+ * reads each tar header, adding its name to the list, and uses the member's
+ * size to jump directly to the next header
+ *
+ * An archive on standard input is read front to back, discarding member data
+ *
+ */
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+  archive_index_t index;
+  archive_index_init(&index);
+  int result;
+  if (is_stdio_archive(archive_name)) {
+    result = read_archive_stream(STDIN_FILENO, minitar_options.compression, &index, NULL);
+  } else {
+    // Opens the archive file in read mode
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd < 0) {
+      perror("Error: Unable to open archive file");
+      return -1;
+    }
+    // A compressed archive has no usable offsets, so unless it carries a
+    // frame index it is read in full
+    compress_format_t format = compress_detect(archive_fd);
+    if (format != COMPRESS_NONE) {
+      result = load_seekable_index(archive_fd, format, &index, NULL);
+      if (result == 1) {
+        result = read_archive_stream(archive_fd, format, &index, NULL);
+      }
+    } else {
+      int sidecar_valid;
+      result = load_archive_index(archive_name, archive_fd, 1, &index, &sidecar_valid);
+    }
+    close(archive_fd);
+  }
+
+  // Adds each member's name to the file list as that is the name of the file
+  for (int i = 0; result == 0 && i < index.count; i++) {
+    if (file_list_add(files, index.members[i].name) != 0) {
+      perror("Error: Failed to add file to list");
+      result = -1;
+    }
+  }
+
+  archive_index_clear(&index);
+  return result;
+}
+
+// Everything the threads extracting members need to share
+typedef struct {
+  int archive_fd;
+  // Mapping of the archive to write data from, or NULL to copy from archive_fd
+  const archive_map_t *map;
+  const archive_index_t *index;
+  // Indices into 'index' of the members to extract, in archive order
+  const int *members;
+  // Frame offsets of a seekable compressed archive, or NULL if it is uncompressed
+  const off_t *frames;
+  // Set (atomically) once any member's data could not be written out
+  int failed;
+} extract_job_t;
+
+// Reports that a member of 'job' could not be written out
+static void extract_failed(extract_job_t *job) {
+  perror("Error: Failed to write extracted file");
+  __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+}
+
+// seekable_extract_to sink feeding the sparse_sink_t 'arg'
+static int write_to_sparse_sink(const void *data, size_t len, void *arg) {
+  return sparse_sink_write(arg, data, len);
+}
+
+/*
+ * Rebuilds the sparse file of member 'position' of the job's index in the
+ * empty 'file_fd': only the data regions are written, each at its offset,
+ * and the file is then extended to its full size, leaving holes everywhere
+ * else
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_sparse_member(const extract_job_t *job, int position, int file_fd) {
+  const archive_member_t *member = &job->index->members[position];
+  sparse_sink_t sink;
+  sparse_sink_init(&sink, file_fd, member->real_size);
+  int result;
+  if (job->frames != NULL) {
+    result = seekable_extract_to(job->archive_fd, job->frames[position],
+                                 job->frames[position + 1], member->data_offset - member->offset,
+                                 member->size, write_to_sparse_sink, &sink);
+  } else if (job->map != NULL) {
+    result = sparse_sink_write(&sink, job->map->data + member->data_offset, member->size);
+  } else {
+    result = sparse_sink_copy(&sink, job->archive_fd, member->data_offset, member->size);
+  }
+  if (result == 0) {
+    result = sparse_sink_finish(&sink);
+  }
+  sparse_sink_free(&sink);
+  return result;
+}
+
+/*
+ * Hands the 'nbytes' bytes at 'offset' in the uncompressed archive of 'job'
+ * to 'sink', from its mapping or else read in chunks
+ * Returns 0 upon success, -1 upon error
+ */
+static int read_archive_range(const extract_job_t *job, off_t offset, off_t nbytes,
+                              seekable_sink_fn_t sink, void *arg) {
+  if (job->map != NULL) {
+    if (offset + nbytes > (off_t)job->map->size) {
+      errno = ENODATA;
+      return -1;
+    }
+    return sink(job->map->data + offset, nbytes, arg);
+  }
+  size_t buffer_size = copy_get_chunk_size();
+  char *buffer = malloc(buffer_size);
+  if (buffer == NULL) {
+    return -1;
+  }
+  int result = 0;
+  while (nbytes > 0 && result == 0) {
+    size_t to_read = nbytes < (off_t)buffer_size ? (size_t)nbytes : buffer_size;
+    ssize_t bytes_read = read_all(job->archive_fd, &offset, buffer, to_read);
+    if (bytes_read != (ssize_t)to_read) {
+      if (bytes_read >= 0) {
+        errno = ENODATA;
+      }
+      result = -1;
+    } else {
+      result = sink(buffer, to_read, arg);
+      nbytes -= to_read;
+    }
+  }
+  free(buffer);
+  return result;
+}
+
+/*
+ * Hands the 'nbytes' bytes found 'skip' bytes into member 'position' of the
+ * job's index (counting from its first header) to 'sink'
+ * Returns 0 upon success, -1 upon error
+ */
+static int read_member_range(const extract_job_t *job, int position, off_t skip, off_t nbytes,
+                             seekable_sink_fn_t sink, void *arg) {
+  if (job->frames != NULL) {
+    return seekable_extract_to(job->archive_fd, job->frames[position],
+                               job->frames[position + 1], skip, nbytes, sink, arg);
+  }
+  return read_archive_range(job, job->index->members[position].offset + skip, nbytes, sink,
+                            arg);
+}
+
+// Where collect_bytes gathers bytes
+typedef struct {
+  char *data;
+  size_t len;
+} byte_buffer_t;
+
+// seekable_sink_fn_t appending to the byte_buffer_t 'arg', which has room
+static int collect_bytes(const void *data, size_t len, void *arg) {
+  byte_buffer_t *buffer = arg;
+  memcpy(buffer->data + buffer->len, data, len);
+  buffer->len += len;
+  return 0;
+}
+
+/*
+ * Reads the map at the start of the data of member 'position' of the job's
+ * index, a sparse or deduplicated one, into the empty 'map' and stores the
+ * number of bytes it takes up in '*map_len'
+ * Returns 0 upon success, -1 upon error (with errno set)
+ */
+static int read_member_map(const extract_job_t *job, int position, sparse_map_t *map,
+                           size_t *map_len) {
+  const archive_member_t *member = &job->index->members[position];
+  int (*decode)(const char *, size_t, sparse_map_t *, size_t *) =
+      member->flags & MEMBER_DEDUP ? dedup_map_decode : sparse_map_decode;
+  int result = 1;
+  if (job->map != NULL) {
+    if (member->data_offset + member->size > (off_t)job->map->size) {
+      errno = ENODATA;
+      return -1;
+    }
+    result = decode(job->map->data + member->data_offset, member->size, map, map_len);
+  } else {
+    // The map is read a block at first, then twice as much each time, until
+    // all of it is in
+    byte_buffer_t text = {.data = NULL, .len = 0};
+    size_t want = BLOCK_SIZE;
+    while (result == 1 && (off_t)text.len < member->size) {
+      if ((off_t)want > member->size) {
+        want = member->size;
+      }
+      char *grown = realloc(text.data, want);
+      if (grown == NULL) {
+        result = -1;
+        break;
+      }
+      text.data = grown;
+      text.len = 0;
+      if (read_member_range(job, position, member->data_offset - member->offset, want,
+                            collect_bytes, &text) != 0) {
+        free(text.data);
+        return -1;
+      }
+      result = decode(text.data, text.len, map, map_len);
+      want *= 2;
+    }
+    free(text.data);
+  }
+  if (result != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Checks that the extents of deduplicated 'member' make up the whole file
+ * and lie within the archive up to the end of the member
+ * Returns 0 if they do, -1 (with errno set) if not
+ */
+static int check_dedup_extents(const archive_member_t *member, const sparse_map_t *extents) {
+  off_t total = 0;
+  for (int i = 0; i < extents->count; i++) {
+    total += extents->regions[i].size;
+    if (extents->regions[i].offset + extents->regions[i].size >
+        member->data_offset + member->size) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  if (total != member->real_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Rebuilds the deduplicated file of member 'position' of the job's index in
+ * the empty 'file_fd' by copying each extent of its map in turn
+ * Returns 0 upon success, -1 upon error
+ */
+static int extract_dedup_member(const extract_job_t *job, int position, int file_fd) {
+  // Extents point anywhere in the archive, which frames do not allow for
+  if (job->frames != NULL) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  const archive_member_t *member = &job->index->members[position];
+  sparse_map_t extents;
+  sparse_map_init(&extents);
+  size_t map_len;
+  if (read_member_map(job, position, &extents, &map_len) != 0) {
+    return -1;
+  }
+  int result = check_dedup_extents(member, &extents);
+  for (int i = 0; i < extents.count && result == 0; i++) {
+    off_t offset = extents.regions[i].offset;
+    if (job->map != NULL) {
+      result = write_all(file_fd, NULL, job->map->data + offset, extents.regions[i].size);
+    } else {
+      result = copy_file_data(file_fd, NULL, job->archive_fd, &offset, extents.regions[i].size);
+    }
+  }
+  sparse_map_free(&extents);
+  return result;
+}
+
+/*
+ * Extraction task: writes member 'job->members[task]' as a new file in the
+ * current working directory.
+ * Problems with a single member are reported and that member is skipped, so
+ * this always returns 0 and one bad member never stops the others; a member
+ * whose data cannot be written sets 'job->failed'.
+ */
+static int extract_member(size_t task, void *arg) {
+  STATS_START(timer);
+  extract_job_t *job = arg;
+  int position = job->members[task];
+  const archive_member_t *member = &job->index->members[position];
+
+  int file_fd = create_extracted_file(member->name);
+  if (file_fd < 0) {
+    return 0;
+  }
+
+  // Write the file content directly from its position in the archive
+  off_t data_offset = member->data_offset;
+  int result;
+  if (job->map != NULL && data_offset + member->size > (off_t)job->map->size) {
+    fprintf(stderr, "Error: Archive is truncated inside file '%s'\n", member->name);
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    close(file_fd);
+    return 0;
+  }
+  if (member->flags & MEMBER_SPARSE) {
+    result = extract_sparse_member(job, position, file_fd);
+  } else if (member->flags & MEMBER_DEDUP) {
+    result = extract_dedup_member(job, position, file_fd);
+  } else if (job->frames != NULL) {
+    // Only the member's own frame is decompressed, skipping past its header
+    result = seekable_extract(job->archive_fd, job->frames[position], job->frames[position + 1],
+                              file_fd, data_offset - member->offset, member->size);
+  } else if (job->map != NULL) {
+    // Start reading the member in ahead of the write that consumes it
+    off_t advise_start = data_offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise((void *)(job->map->data + advise_start),
+            data_offset - advise_start + member->size, MADV_WILLNEED);
+    result = write_all(file_fd, NULL, job->map->data + data_offset, member->size);
+  } else {
+    // Positional copies let every thread share the one archive descriptor
+    result = copy_file_data(file_fd, NULL, job->archive_fd, &data_offset, member->size);
+  }
+  if (result != 0) {
+    extract_failed(job);
+  }
+  close(file_fd);
+  STATS_MEMBER(timer);
+  return 0;
+}
+
+// Progress of an extraction driven by the io_uring engine
+typedef struct {
+  extract_job_t *job;
+  int num_members;
+  int next_member;
+} ring_extract_t;
+
+/*
+ * io_uring engine callback: creates the file for the next member to extract
+ * and hands out the copy of its data into it. Members whose file cannot be
+ * created are reported and skipped, and sparse and deduplicated members,
+ * whose data goes to or comes from several places, are extracted right away.
+ * Returns 1 if '*copy' was filled in, or 0 once every member is under way
+ */
+static int next_extract_copy(io_copy_t *copy, void *arg) {
+  ring_extract_t *state = arg;
+  extract_job_t *job = state->job;
+  while (state->next_member < state->num_members) {
+    int position = job->members[state->next_member++];
+    const archive_member_t *member = &job->index->members[position];
+    int file_fd = create_extracted_file(member->name);
+    if (file_fd < 0) {
+      continue;
+    }
+    if (member->flags & (MEMBER_SPARSE | MEMBER_DEDUP)) {
+      int result = member->flags & MEMBER_SPARSE ? extract_sparse_member(job, position, file_fd)
+                                                 : extract_dedup_member(job, position, file_fd);
+      if (result != 0) {
+        extract_failed(job);
+      }
+      close(file_fd);
+      continue;
+    }
+    *copy = (io_copy_t){.in_fd = job->archive_fd, .in_offset = member->data_offset,
+                        .out_fd = file_fd, .out_offset = 0, .nbytes = member->size};
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * io_uring engine callback: closes an extracted file. As with extract_member,
+ * a member that fails is reported and marks the job failed without stopping
+ * the others.
+ * Returns 0
+ */
+static int extract_copy_done(const io_copy_t *copy, int result, void *arg) {
+  ring_extract_t *state = arg;
+  if (result != 0) {
+    extract_failed(state->job);
+  }
+  close(copy->out_fd);
+  return 0;
+}
+
+/*
+ * Extracts files from a tar archive and writes them to the filesystem.
+ *
+ * Returns 0 on success, -1 on error.
+ *
+ * Builds the archive's member index from the headers alone (or its sidecar),
+ * then walks it backwards to find the last version of each name. Only those
+ * winning versions are written, in archive order, with their data written
+ * straight from a memory mapping of the archive (or copied from its offset
+ * when the archive cannot be mapped); superseded versions are never read.
+ *
+ * When 'files' names members or glob patterns, only the members they match
+ * (and anything inside matching directories) are written. Plain names are
+ * found with the index's hash lookup, and the data of every other member is
+ * never read. Names that match nothing are reported as errors.
+ *
+ * Since each name is written at most once, members are independent of each
+ * other. With more than one thread, they are spread over a pool of workers
+ * that all copy from the shared archive descriptor with positional reads.
+ * The io_uring engine instead keeps reads and writes for many members in
+ * flight from one thread, falling back to the pool where it is unavailable.
+ * A member whose data cannot be read or written is reported and the rest are
+ * still extracted, but the extraction then fails.
+ *
+ * Sparse members are written region by region into the new file, which is
+ * then extended to its full size, so the holes are recreated rather than
+ * filled with zeros.
+ *
+ * Deduplicated members are rebuilt from the extents their maps list, which
+ * may lie in the data of earlier members; a stream cannot go back to those,
+ * so they are reported and skipped when extracting from standard input.
+ *
+ * A seekable compressed archive is handled the same way from its frame index,
+ * decompressing only the frame of each winning member; other compressed
+ * archives are decompressed front to back like an archive on standard input.
+ *
+ * An archive on standard input cannot be scanned ahead of time, so it is
+ * extracted front to back with each version of a file overwriting the last.
+ *
+ */
+int extract_files_from_archive(const char *archive_name, const file_list_t *files) {
+  member_filter_t filter;
+  if (member_filter_init(&filter, files) != 0) {
+    member_filter_free(&filter);
+    return -1;
+  }
+  archive_index_t index;
+  archive_index_init(&index);
+  if (is_stdio_archive(archive_name)) {
+    int result = read_archive_stream(STDIN_FILENO, minitar_options.compression, &index, &filter);
+    if (result == 0) {
+      result = member_filter_report(&filter);
+    }
+    member_filter_free(&filter);
+    archive_index_clear(&index);
+    return result;
+  }
+
+  // Open archive in read mode
+  int archive_fd = open(archive_name, O_RDONLY);
+  if (archive_fd < 0) {
+    perror("Error: Unable to open archive file");
+    member_filter_free(&filter);
+    return -1;
+  }
+
+  off_t *frames = NULL;
+  int result;
+  compress_format_t format = compress_detect(archive_fd);
+  if (format != COMPRESS_NONE) {
+    result = load_seekable_index(archive_fd, format, &index, &frames);
+    if (result == 1) {
+      result = read_archive_stream(archive_fd, format, &index, &filter);
+      if (result == 0) {
+        result = member_filter_report(&filter);
+      }
+      close(archive_fd);
+      member_filter_free(&filter);
+      archive_index_clear(&index);
+      return result;
+    }
+  } else {
+    int sidecar_valid;
+    result = load_archive_index(archive_name, archive_fd, 1, &index, &sidecar_valid);
+  }
+
+  // A member is extracted only if no later member has the same name, and it
+  // is selected by the names given
+  int num_members = 0;
+  int *members = result == 0 ? find_latest_members(&index, &num_members) : NULL;
+  if (members == NULL || select_members(&index, &filter, members, &num_members) != 0) {
+    free(members);
+    free(frames);
+    close(archive_fd);
+    member_filter_free(&filter);
+    archive_index_clear(&index);
+    return -1;
+  }
+
+  extract_job_t job = {.archive_fd = archive_fd, .map = NULL, .index = &index,
+                       .members = members, .frames = frames, .failed = 0};
+  result = 1;
+  if (frames == NULL && minitar_options.io_engine == IO_ENGINE_URING) {
+    ring_extract_t state = {.job = &job, .num_members = num_members, .next_member = 0};
+    result = io_ring_run(next_extract_copy, extract_copy_done, &state);
+  }
+
+  // A single thread writes member data straight out of a mapping of the archive
+  archive_map_t map;
+  int mapped = result == 1 && frames == NULL && minitar_options.num_threads <= 1 &&
+               map_archive(archive_fd, &map) == 0;
+  if (mapped) {
+    // Only the selected members are faulted in, so reading ahead across the
+    // whole archive pays off only when everything is extracted
+    if (filter.count == 0) {
+      madvise((void *)map.data, map.size, MADV_SEQUENTIAL);
+    }
+    job.map = &map;
+  }
+
+  if (result == 1) {
+    result = parallel_for(minitar_options.num_threads, num_members, extract_member, &job);
+  }
+  // Every member was attempted, but the archive was not fully extracted
+  if (job.failed) {
+    result = -1;
+  }
+  if (member_filter_report(&filter) != 0) {
+    result = -1;
+  }
+
+  if (mapped) {
+    unmap_archive(&map);
+  }
+  free(members);
+  free(frames);
+  close(archive_fd);
+  member_filter_free(&filter);
+  archive_index_clear(&index);
+  return result;
+}
+
+// seekable_sink_fn_t adding the bytes to the content_hash_t 'arg'
+static int hash_bytes(const void *data, size_t len, void *arg) {
+  content_hash_update(arg, data, len);
+  return 0;
+}
+
+// Adds 'len' zero bytes, standing for a hole, to 'hash'
+static void hash_zeros(content_hash_t *hash, off_t len) {
+  static const char zeros[64 << 10];
+  while (len > 0) {
+    size_t n = len < (off_t)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+    content_hash_update(hash, zeros, n);
+    len -= n;
+  }
+}
+
+// Progress of hash_sparse_data through the regions of a sparse member
+typedef struct {
+  content_hash_t hash;
+  const sparse_map_t *map;
+  int region;
+  off_t region_done;
+  // Number of bytes of the file hashed so far, holes included
+  off_t position;
+} sparse_hasher_t;
+
+/*
+ * seekable_sink_fn_t hashing the data of a sparse member, after its map, as
+ * the file it extracts to: each region is preceded by the hole before it
+ * Returns 0 upon success, or -1 if there is more data than the map has room for
+ */
+static int hash_sparse_data(const void *data, size_t len, void *arg) {
+  sparse_hasher_t *hasher = arg;
+  const char *bytes = data;
+  while (len > 0) {
+    while (hasher->region < hasher->map->count &&
+           hasher->region_done == hasher->map->regions[hasher->region].size) {
+      hasher->region++;
+      hasher->region_done = 0;
+    }
+    if (hasher->region == hasher->map->count) {
+      errno = EINVAL;
+      return -1;
+    }
+    const sparse_region_t *region = &hasher->map->regions[hasher->region];
+    if (hasher->region_done == 0) {
+      hash_zeros(&hasher->hash, region->offset - hasher->position);
+    }
+    off_t left = region->size - hasher->region_done;
+    size_t n = (off_t)len < left ? len : (size_t)left;
+    content_hash_update(&hasher->hash, bytes, n);
+    hasher->region_done += n;
+    hasher->position = region->offset + hasher->region_done;
+    bytes += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Hashes the contents of the file member 'position' of the job's index
+ * extracts to into '*result', without writing it anywhere
+ * Returns 0 upon success, -1 upon error
+ */
+static int hash_member(const extract_job_t *job, int position, uint64_t *result) {
+  const archive_member_t *member = &job->index->members[position];
+  off_t data_skip = member->data_offset - member->offset;
+  if (!(member->flags & (MEMBER_SPARSE | MEMBER_DEDUP))) {
+    content_hash_t hash;
+    content_hash_init(&hash);
+    if (read_member_range(job, position, data_skip, member->size, hash_bytes, &hash) != 0) {
+      return -1;
+    }
+    *result = content_hash_final(&hash);
+    return 0;
+  }
+  if ((member->flags & MEMBER_DEDUP) && job->frames != NULL) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  sparse_map_t map;
+  sparse_map_init(&map);
+  size_t map_len;
+  if (read_member_map(job, position, &map, &map_len) != 0) {
+    return -1;
+  }
+  int status = 0;
+  if (member->flags & MEMBER_DEDUP) {
+    content_hash_t hash;
+    content_hash_init(&hash);
+    status = check_dedup_extents(member, &map);
+    for (int i = 0; i < map.count && status == 0; i++) {
+      status = read_archive_range(job, map.regions[i].offset, map.regions[i].size, hash_bytes,
+                                  &hash);
+    }
+    *result = content_hash_final(&hash);
+  } else {
+    sparse_hasher_t hasher = {.map = &map, .region = 0, .region_done = 0, .position = 0};
+    content_hash_init(&hasher.hash);
+    status = read_member_range(job, position, data_skip + map_len, member->size - map_len,
+                               hash_sparse_data, &hasher);
+    // Whatever follows the last region is a hole
+    if (status == 0 && hasher.position > member->real_size) {
+      errno = EINVAL;
+      status = -1;
+    }
+    if (status == 0) {
+      hash_zeros(&hasher.hash, member->real_size - hasher.position);
+      *result = content_hash_final(&hasher.hash);
+    }
+  }
+  sparse_map_free(&map);
+  return status;
+}
+
+// A content hash record, as found by find_hash_record
+typedef struct {
+  int found;
+  uint64_t hash;
+} hash_record_t;
+
+/*
+ * pax_parse callback storing the value of a HASH_KEY record in the
+ * hash_record_t 'arg'; other records are ignored
+ * Returns 0 upon success, -1 if the hash is malformed
+ */
+static int find_hash_record(const char *key, const char *value, size_t value_len, void *arg) {
+  hash_record_t *record = arg;
+  if (strcmp(key, HASH_KEY) != 0) {
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  record->hash = strtoull(value, &end, 16);
+  if (errno != 0 || value_len != 16 || end != value + value_len) {
+    return -1;
+  }
+  record->found = 1;
+  return 0;
+}
+
+/*
+ * Looks through the extended headers ahead of the tar header of member
+ * 'position' of the job's index for its content hash, filling in 'record'
+ * Returns 0 upon success, -1 upon error
+ */
+static int read_hash_record(const extract_job_t *job, int position, hash_record_t *record) {
+  const archive_member_t *member = &job->index->members[position];
+  record->found = 0;
+  off_t len = member->data_offset - BLOCK_SIZE - member->offset;
+  if (len == 0) {
+    return 0;
+  }
+  if (len > MAX_PAX_LEN + BLOCK_SIZE) {
+    errno = EFBIG;
+    return -1;
+  }
+  byte_buffer_t headers = {.data = malloc(len), .len = 0};
+  if (headers.data == NULL ||
+      read_member_range(job, position, 0, len, collect_bytes, &headers) != 0) {
+    free(headers.data);
+    return -1;
+  }
+  int result = 0;
+  for (off_t pos = 0; pos + BLOCK_SIZE <= len && result == 0;) {
+    const tar_header *header = (const tar_header *)(headers.data + pos);
+    uint64_t size;
+    if (header_decode_number(header->size, sizeof(header->size), &size) != 0 ||
+        size > (uint64_t)(len - pos - BLOCK_SIZE)) {
+      errno = EINVAL;
+      result = -1;
+    } else if (header->typeflag == PAX_TYPE &&
+               pax_parse(headers.data + pos + BLOCK_SIZE, size, find_hash_record, record) != 0) {
+      errno = EINVAL;
+      result = -1;
+    }
+    pos += BLOCK_SIZE + padded_size(size);
+  }
+  free(headers.data);
+  return result;
+}
+
+// Outcomes of verify_member for one member
+typedef enum {
+  VERIFY_OK,
+  VERIFY_BAD_HASH,
+  VERIFY_FILE_DIFFERS,
+  VERIFY_NO_REFERENCE,
+  // Reading the member failed, and that was reported
+  VERIFY_FAILED,
+} verify_outcome_t;
+
+// Everything the threads verifying members need to share
+typedef struct {
+  // Where member data is read from
+  extract_job_t source;
+  // Outcome for each member of 'source.members'
+  verify_outcome_t *outcomes;
+} verify_job_t;
+
+/*
+ * Decides whether the contents of the file open as 'file_fd', described by
+ * 'file_stat', hash to 'member_hash' for the member 'member'
+ * Returns 1 if they do, 0 if they do not, or -1 upon error
+ */
+static int file_has_hash(int file_fd, const struct stat *file_stat,
+                         const archive_member_t *member, uint64_t member_hash) {
+  if (!S_ISREG(file_stat->st_mode) || file_stat->st_size != member->real_size) {
+    return 0;
+  }
+  uint64_t file_hash;
+  if (content_hash_fd(file_fd, 0, member->real_size, &file_hash) != 0) {
+    return -1;
+  }
+  return file_hash == member_hash;
+}
+
+/*
+ * Verification task: hashes the contents of member 'job->source.members[task]'
+ * and compares them with the hash stored in its extended header or, if it
+ * has none, with the file of the same name on disk
+ * Returns 0, after recording the outcome, so one bad member never stops the
+ * others
+ */
+static int verify_member(size_t task, void *arg) {
+  STATS_START(timer);
+  verify_job_t *job = arg;
+  int position = job->source.members[task];
+  const archive_member_t *member = &job->source.index->members[position];
+  verify_outcome_t *outcome = &job->outcomes[task];
+  *outcome = VERIFY_OK;
+  // Directories have no contents to check
+  if (member->name[strlen(member->name) - 1] == '/') {
+    return 0;
+  }
+
+  hash_record_t stored;
+  uint64_t hash;
+  if (read_hash_record(&job->source, position, &stored) != 0 ||
+      hash_member(&job->source, position, &hash) != 0) {
+    fprintf(stderr, "Error: Failed to read '%s' from archive: %s\n", member->name,
+            strerror(errno));
+    *outcome = VERIFY_FAILED;
+    return 0;
+  }
+  if (stored.found) {
+    *outcome = hash == stored.hash ? VERIFY_OK : VERIFY_BAD_HASH;
+    STATS_MEMBER(timer);
+    return 0;
+  }
+
+  int file_fd = open(member->name, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) {
+    *outcome = VERIFY_NO_REFERENCE;
+    return 0;
+  }
+  struct stat file_stat;
+  int matches = fstat(file_fd, &file_stat) == 0
+                    ? file_has_hash(file_fd, &file_stat, member, hash)
+                    : -1;
+  if (matches < 0) {
+    fprintf(stderr, "Error: Failed to read file '%s': %s\n", member->name, strerror(errno));
+    *outcome = VERIFY_FAILED;
+  } else {
+    *outcome = matches ? VERIFY_OK : VERIFY_FILE_DIFFERS;
+  }
+  close(file_fd);
+  STATS_MEMBER(timer);
+  return 0;
+}
+
+/*
+ * Checks the contents of an archive without extracting it.
+ *
+ * Returns 0 if every member checked matches, -1 otherwise.
+ *
+ * The members checked are the ones extraction would write, selected the same
+ * way by 'files'. Each one's data is read and hashed as the file it extracts
+ * to (holes of a sparse member count as zeros), and the hash is compared with
+ * the one recorded when the member was archived with --hash. A member without
+ * one is compared with the file of the same name on disk instead. Members are
+ * spread over a pool of threads like extraction, and a single thread reads
+ * straight from a mapping of the archive. Nothing is written.
+ *
+ * Uncompressed archive files and seekable compressed ones are supported; an
+ * archive on standard input or a compressed one without a frame index cannot
+ * be read out of order, so it is refused.
+ */
+int verify_archive(const char *archive_name, const file_list_t *files) {
+  if (is_stdio_archive(archive_name)) {
+    fprintf(stderr, "Error: Cannot verify an archive on standard input/output\n");
+    return -1;
+  }
+  member_filter_t filter;
+  if (member_filter_init(&filter, files) != 0) {
+    member_filter_free(&filter);
+    return -1;
+  }
+  int archive_fd = open(archive_name, O_RDONLY);
+  if (archive_fd < 0) {
+    perror("Error: Unable to open archive file");
+    member_filter_free(&filter);
+    return -1;
+  }
+
+  archive_index_t index;
+  archive_index_init(&index);
+  off_t *frames = NULL;
+  int result;
+  compress_format_t format = compress_detect(archive_fd);
+  if (format != COMPRESS_NONE) {
+    result = load_seekable_index(archive_fd, format, &index, &frames);
+    if (result == 1) {
+      fprintf(stderr, "Error: Cannot verify a compressed archive without a frame index\n");
+      result = -1;
+    }
+  } else {
+    int sidecar_valid;
+    result = load_archive_index(archive_name, archive_fd, 1, &index, &sidecar_valid);
+  }
+
+  int num_members = 0;
+  int *members = result == 0 ? find_latest_members(&index, &num_members) : NULL;
+  verify_outcome_t *outcomes =
+      members != NULL ? malloc(sizeof(verify_outcome_t) * (num_members + 1)) : NULL;
+  if (outcomes == NULL || select_members(&index, &filter, members, &num_members) != 0) {
+    if (members != NULL && outcomes == NULL) {
+      perror("Error: Failed to allocate verification results");
+    }
+    free(outcomes);
+    free(members);
+    free(frames);
+    close(archive_fd);
+    member_filter_free(&filter);
+    archive_index_clear(&index);
+    return -1;
+  }
+
+  verify_job_t job = {.source = {.archive_fd = archive_fd, .map = NULL, .index = &index,
+                                 .members = members, .frames = frames},
+                      .outcomes = outcomes};
+  archive_map_t map;
+  int mapped = frames == NULL && minitar_options.num_threads <= 1 &&
+               map_archive(archive_fd, &map) == 0;
+  if (mapped) {
+    if (filter.count == 0) {
+      madvise((void *)map.data, map.size, MADV_SEQUENTIAL);
+    }
+    job.source.map = &map;
+  }
+  result = parallel_for(minitar_options.num_threads, num_members, verify_member, &job);
+  if (member_filter_report(&filter) != 0) {
+    result = -1;
+  }
+
+  // Problems are reported in archive order, whatever order the threads ran in
+  for (int i = 0; i < num_members; i++) {
+    const char *name = index.members[members[i]].name;
+    if (outcomes[i] == VERIFY_BAD_HASH) {
+      fprintf(stderr, "Error: '%s' does not match its recorded hash\n", name);
+    } else if (outcomes[i] == VERIFY_FILE_DIFFERS) {
+      fprintf(stderr, "Error: '%s' differs from the file on disk\n", name);
+    } else if (outcomes[i] == VERIFY_NO_REFERENCE) {
+      fprintf(stderr, "Error: '%s' has no recorded hash and no file to compare with\n", name);
+    }
+    if (outcomes[i] != VERIFY_OK) {
+      result = -1;
+    }
+  }
+
+  if (mapped) {
+    unmap_archive(&map);
+  }
+  free(outcomes);
+  free(members);
+  free(frames);
+  close(archive_fd);
+  member_filter_free(&filter);
+  archive_index_clear(&index);
+  return result;
+}
+
+/*
+ * Copies the live members of the archive open as 'archive_fd', listed in
+ * 'members', into 'out_fd' back to back, followed by the end-of-archive
+ * blocks, and records where each one landed in 'new_index'
+ * Returns 0 upon success, -1 upon error
+ */
+static int copy_live_members(int out_fd, int archive_fd, const archive_index_t *index,
+                             const int *members, int num_members,
+                             archive_index_t *new_index) {
+  off_t out_offset = 0;
+  int i = 0;
+  while (i < num_members) {
+    // Members that are adjacent in the old archive move together in one copy
+    off_t run_start = index->members[members[i]].offset;
+    off_t run_end = run_start;
+    for (; i < num_members && index->members[members[i]].offset == run_end; i++) {
+      archive_member_t moved = index->members[members[i]];
+      off_t new_offset = out_offset + (run_end - run_start);
+      run_end = moved.data_offset + padded_size(moved.size);
+      moved.data_offset += new_offset - moved.offset;
+      moved.offset = new_offset;
+      if (archive_index_add_member(new_index, &moved) != 0) {
+        perror("Error: Failed to record archive member");
+        return -1;
+      }
+    }
+
+    off_t in_offset = run_start;
+    if (copy_file_data(out_fd, &out_offset, archive_fd, &in_offset, run_end - run_start) != 0) {
+      perror("Error: Failed to copy archive members");
+      return -1;
+    }
+  }
+  new_index->end_offset = out_offset;
+
+  if (write_zeros(out_fd, &out_offset, NUM_TRAILING_BLOCKS * BLOCK_SIZE) != 0) {
+    perror("Error: Failed to write trailing blocks");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Syncs the directory holding 'path', so that a file just renamed into it
+ * stays renamed after a crash
+ * Returns 0 upon success, -1 upon error
+ */
+static int sync_parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+  if (dir == NULL) {
+    return -1;
+  }
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  if (dir_fd < 0) {
+    return -1;
+  }
+  int result = fsync(dir_fd);
+  if (close(dir_fd) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+/*
+ * Removes superseded versions of members from an archive.
+ *
+ * Returns 0 upon success, -1 upon error
+ *
+ * The live members are copied into a temporary file next to the archive,
+ * coalescing neighbours into large copy_file_range moves, and the file is
+ * synced and renamed over the archive, and the directory is synced so the
+ * rename itself is durable. Readers therefore only ever see the old or the
+ * new archive, and a crash leaves the old one untouched. A sidecar
+ * index is rewritten to match.
+ */
+int compact_archive(const char *archive_name) {
+  if (is_stdio_archive(archive_name)) {
+    fprintf(stderr, "Error: Cannot compact an archive on standard input/output\n");
+    return -1;
+  }
+
+  int archive_fd = open(archive_name, O_RDONLY);
+  if (archive_fd < 0) {
+    perror("Error: Unable to open archive file");
+    return -1;
+  }
+  if (check_uncompressed(archive_fd, "compact") != 0) {
+    close(archive_fd);
+    return -1;
+  }
+  archive_index_t index;
+  archive_index_init(&index);
+  int sidecar_valid;
+  struct stat archive_stat;
+  if (load_archive_index(archive_name, archive_fd, 0, &index, &sidecar_valid) != 0 ||
+      fstat(archive_fd, &archive_stat) != 0) {
+    close(archive_fd);
+    archive_index_clear(&index);
+    return -1;
+  }
+  // Moving members would break the extents deduplicated members refer to
+  for (int i = 0; i < index.count; i++) {
+    if (index.members[i].flags & MEMBER_DEDUP) {
+      fprintf(stderr, "Error: Cannot compact an archive with deduplicated files\n");
+      close(archive_fd);
+      archive_index_clear(&index);
+      return -1;
+    }
+  }
+
+  int num_members;
+  int *members = find_latest_members(&index, &num_members);
+  if (members == NULL || num_members == index.count) {
+    // Nothing is superseded, so the archive is already compact
+    free(members);
+    close(archive_fd);
+    archive_index_clear(&index);
+    return members == NULL ? -1 : 0;
+  }
+
+  size_t name_len = strlen(archive_name);
+  char *tmp_path = malloc(name_len + sizeof(COMPACT_SUFFIX));
+  if (tmp_path == NULL) {
+    perror("Error: Failed to allocate file name");
+    free(members);
+    close(archive_fd);
+    archive_index_clear(&index);
+    return -1;
+  }
+  memcpy(tmp_path, archive_name, name_len);
+  memcpy(tmp_path + name_len, COMPACT_SUFFIX, sizeof(COMPACT_SUFFIX));
+
+  archive_index_t new_index;
+  archive_index_init(&new_index);
+  int result = -1;
+  int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd < 0) {
+    perror("Error: Unable to create compacted archive");
+  } else {
+    // The compacted archive keeps the permissions of the original
+    if (fchmod(out_fd, archive_stat.st_mode & 07777) != 0) {
+      perror("Error: Failed to set permissions of compacted archive");
+    } else if (copy_live_members(out_fd, archive_fd, &index, members, num_members,
+                                 &new_index) == 0) {
+      result = 0;
+    }
+    STATS_START(timer);
+    if (result == 0 && fsync(out_fd) != 0) {
+      perror("Error: Failed to sync compacted archive");
+      result = -1;
+    }
+    STATS_PHASE(STATS_PHASE_SYNC, timer);
+    if (close(out_fd) != 0 && result == 0) {
+      perror("Error: Failed to write compacted archive");
+      result = -1;
+    }
+    if (result == 0 && rename(tmp_path, archive_name) != 0) {
+      perror("Error: Failed to replace archive");
+      result = -1;
+    }
+    if (result != 0) {
+      unlink(tmp_path);
+    }
+  }
+  if (result == 0) {
+    STATS_START(timer);
+    if (sync_parent_dir(archive_name) != 0) {
+      perror("Error: Failed to sync archive directory");
+      result = -1;
+    }
+    STATS_PHASE(STATS_PHASE_SYNC, timer);
+  }
+
+  // The rename changed the archive's inode, so the old sidecar no longer
+  // validates; replace it with one describing the new layout
+  if (result == 0) {
+    result = update_archive_index(archive_name, &new_index, 0, sidecar_valid);
+  }
+
+  archive_index_clear(&new_index);
+  free(tmp_path);
+  free(members);
+  close(archive_fd);
+  archive_index_clear(&index);
+  return result;
 }
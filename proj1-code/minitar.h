@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include "compress.h"
 #include "file_list.h"
 
 // Standard tar header layout defined by POSIX
@@ -41,6 +42,54 @@ typedef struct {
     char padding[12];
 } tar_header;
 
+// Archive name that stands for standard output (create) or standard input
+// (list and extract); such archives are read and written strictly in order
+#define STDIO_ARCHIVE "-"
+
+// How member data is moved when creating and extracting archive files
+typedef enum {
+    // Blocking copies, one at a time on each thread
+    IO_ENGINE_SYNC,
+    // Many reads and writes in flight at once through io_uring (see io_ring.h),
+    // or the thread pool where io_uring is not available
+    IO_ENGINE_URING,
+} io_engine_t;
+
+// Settings that tune how the operations below run, filled in from the command line
+typedef struct {
+    // Number of threads used by operations that can process members in parallel
+    int num_threads;
+    // Create or refresh the member index sidecar (archive name + ".idx") even
+    // if the archive does not have one yet
+    int build_index;
+    // Store only numeric owner and group ids, leaving the user and group
+    // name fields of each header empty
+    int numeric_owner;
+    // When updating, decide whether a file changed by comparing its contents
+    // with the archived version rather than its modification time
+    int check_content;
+    // Compression applied when creating an archive, or when reading one from
+    // standard input; archive files being read are recognized automatically
+    compress_format_t compression;
+    // Create a gzip archive with each member in its own frame and a trailing
+    // frame index, so it can be listed and extracted without decompressing
+    // it all (see seekable_gzip.h)
+    int seekable;
+    io_engine_t io_engine;
+    // When creating or appending, store chunks of file data already in the
+    // archive only once (see dedup.h); needs an uncompressed archive file
+    int dedup;
+    // When creating or appending, record a hash of each file's contents in
+    // its member's extended header, for verify_archive to check
+    int hash;
+    // When creating or appending, record modification times to the
+    // nanosecond in extended headers, so updates notice changes made within
+    // the second a file was archived
+    int mtime_ns;
+} minitar_options_t;
+
+extern minitar_options_t minitar_options;
+
 /*
  * Create a new archive file with the name 'archive_name'.
  * The archive should contain all files stored in the 'files' list.
@@ -48,6 +97,9 @@ typedef struct {
  * You may also assume that all the elements of 'files' exist.
  * If an archive of the specified name already exists, you should overwrite it
  * with the result of this operation.
+ * Directories in 'files' are archived along with everything beneath them.
+ * When minitar_options.num_threads is greater than 1, member data is copied by
+ * that many threads; the resulting archive is byte-identical either way.
  * This function should return 0 upon success or -1 if an error occurred
  */
 int create_archive(const char *archive_name, const file_list_t *files);
@@ -56,6 +108,8 @@ int create_archive(const char *archive_name, const file_list_t *files);
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
  * You can assume in this project that at least one new file to append is specified.
  * You may also assume that all files to be appended exist.
+ * If the archive has a valid index sidecar, the end of the archive is taken
+ * from it and the sidecar is extended with the new members.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int append_files_to_archive(const char *archive_name, const file_list_t *files);
@@ -65,18 +119,57 @@ int append_files_to_archive(const char *archive_name, const file_list_t *files);
  * to the 'files' list.
  * NOTE: This function is most obviously relevant to implementing minitar's list
  * operation, but think about how you can reuse it for the update operation.
+ * The list comes from the archive's index sidecar when that is valid; a stale
+ * sidecar is rebuilt from the headers rather than trusted.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int get_archive_file_list(const char *archive_name, file_list_t *files);
 
+/*
+ * Append a new version of each file in 'files' that differs from its latest
+ * version in the archive identified by 'archive_name'.
+ * A file is unchanged if its size and modification time (in whole seconds,
+ * or to the nanosecond if the archive recorded that) match those in the archive
+ * or, when minitar_options.check_content is set, if its size and contents match.
+ * Every file must already be present in the archive.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int update_files_in_archive(const char *archive_name, const file_list_t *files);
+
 /*
  * Write each file contained within the archive identified by 'archive_name'
- * as a new file to the current working directory.
+ * as a new file to the current working directory, creating directories as
+ * needed. Members with absolute names or ".." components are refused.
  * If there are multiple versions of the same file present in the archive,
  * then only the most recently added version should be present as a new file
  * at the end of the extraction process.
+ * If 'files' is not empty, only members whose names match one of its entries
+ * are written. Entries may be glob patterns, and an entry naming a directory
+ * also selects everything inside it. An entry matching no member is an error.
+ * When minitar_options.num_threads is greater than 1, members are extracted
+ * by that many threads.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int extract_files_from_archive(const char *archive_name, const file_list_t *files);
+
+/*
+ * Check the contents of the archive identified by 'archive_name' without
+ * writing any files. Each member extraction would write (selected by 'files'
+ * the same way) is hashed and compared with the hash recorded in its extended
+ * header when it was archived with minitar_options.hash set, or else with the
+ * file of the same name on disk. Every mismatch is reported.
+ * When minitar_options.num_threads is greater than 1, members are checked by
+ * that many threads.
+ * This function should return 0 if every member matches or -1 otherwise.
+ */
+int verify_archive(const char *archive_name, const file_list_t *files);
+
+/*
+ * Rewrite the archive identified by 'archive_name' so that it holds only the
+ * most recently added version of each file, in their original order.
+ * The archive is replaced atomically, so it is never seen half compacted.
  * This function should return 0 upon success or -1 if an error occurred.
  */
-int extract_files_from_archive(const char *archive_name);
+int compact_archive(const char *archive_name);
 
 #endif    // _MINITAR_H
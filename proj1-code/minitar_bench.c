@@ -0,0 +1,763 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Throughput benchmark for the minitar operations.
+ *
+ * Generates synthetic corpora (once; they are reused while their parameters
+ * stay the same), then times create, append, list, extract and update on
+ * each of them. Every timed run happens in a child process of its own, so
+ * the I/O counters and peak memory use reported for it belong to that run
+ * alone. Results are written as JSON so runs of different builds can be
+ * compared.
+ *
+ * All data comes from a fixed-seed generator and every file gets the same
+ * modification time, so the corpora, and the archives made from them, are
+ * identical from run to run.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "file_list.h"
+#include "minitar.h"
+
+// Modification time given to every generated file and directory
+#define CORPUS_MTIME 1700000000
+// Name of the file marking a corpus as complete, holding its parameters
+#define STAMP_NAME ".complete"
+#define BUFFER_SIZE (1 << 20)
+#define DEFAULT_REPETITIONS 3
+#define MAX_REPETITIONS 64
+
+// Sizes of the corpora
+typedef struct {
+    const char *name;
+    // Many small files spread over subdirectories
+    int tiny_files;
+    int tiny_dirs;
+    int tiny_max_size;
+    // A few large files of random, incompressible data
+    int large_files;
+    off_t large_size;
+    // Copies of one random file under different names, and files made of a
+    // single block repeated over and over
+    int dup_files;
+    off_t dup_size;
+    int dup_block;
+    // Files that are mostly holes, with a block of data every 'sparse_stride'
+    int sparse_files;
+    off_t sparse_size;
+    off_t sparse_stride;
+    int sparse_block;
+} bench_scale_t;
+
+static const bench_scale_t full_scale = {.name = "full",
+                                         .tiny_files = 100000,
+                                         .tiny_dirs = 100,
+                                         .tiny_max_size = 2048,
+                                         .large_files = 3,
+                                         .large_size = (off_t) 2 << 30,
+                                         .dup_files = 16,
+                                         .dup_size = (off_t) 64 << 20,
+                                         .dup_block = 1 << 20,
+                                         .sparse_files = 4,
+                                         .sparse_size = (off_t) 8 << 30,
+                                         .sparse_stride = (off_t) 512 << 20,
+                                         .sparse_block = 1 << 20};
+
+// Small enough to run in a few seconds, for checking that the suite works
+static const bench_scale_t quick_scale = {.name = "quick",
+                                          .tiny_files = 5000,
+                                          .tiny_dirs = 20,
+                                          .tiny_max_size = 2048,
+                                          .large_files = 3,
+                                          .large_size = (off_t) 64 << 20,
+                                          .dup_files = 16,
+                                          .dup_size = (off_t) 2 << 20,
+                                          .dup_block = 64 << 10,
+                                          .sparse_files = 4,
+                                          .sparse_size = (off_t) 256 << 20,
+                                          .sparse_stride = (off_t) 64 << 20,
+                                          .sparse_block = 1 << 20};
+
+// Generates corpus files into the existing directory 'dir'
+// Returns 0 on success or -1 if an error occurs
+typedef int (*generate_fn_t)(const char *dir, const bench_scale_t *scale);
+
+typedef struct {
+    const char *name;
+    generate_fn_t generate;
+} corpus_t;
+
+// Counters for one timed run, gathered by the child that performed it
+typedef struct {
+    int status;
+    double seconds;
+    unsigned long long read_syscalls;
+    unsigned long long write_syscalls;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    long peak_rss_kb;
+} bench_sample_t;
+
+// Everything one benchmarked operation needs
+typedef struct {
+    const char *operation;
+    const char *archive;
+    // Files given to the operation
+    file_list_t *files;
+    // Directory to run the operation in, or NULL for the current one
+    const char *work_dir;
+} bench_run_t;
+
+// xorshift64* generator, so the data is the same on every run
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fill_random(uint64_t *state, char *buffer, size_t len) {
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t value = next_random(state);
+        // The last word may be cut short by the end of the buffer
+        memcpy(buffer + i, &value, len - i < 8 ? len - i : 8);
+    }
+}
+
+// Seconds on the monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sets the modification time of 'path' to CORPUS_MTIME + 'offset'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int set_mtime(const char *path, int offset) {
+    struct timespec times[2] = {{.tv_sec = CORPUS_MTIME + offset, .tv_nsec = 0},
+                                {.tv_sec = CORPUS_MTIME + offset, .tv_nsec = 0}};
+    return utimensat(AT_FDCWD, path, times, 0);
+}
+
+/*
+ * Creates 'path' and writes 'size' bytes to it: random data from 'state'
+ * if 'block' is 0, or else the first 'block' bytes of 'buffer' over and over
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_file(const char *path, off_t size, uint64_t *state, const char *buffer,
+                      size_t block) {
+    static char data[BUFFER_SIZE];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    int result = 0;
+    for (off_t done = 0; done < size && result == 0;) {
+        size_t len = block > 0 ? block : BUFFER_SIZE;
+        if ((off_t) len > size - done) {
+            len = size - done;
+        }
+        if (block == 0) {
+            fill_random(state, data, len);
+        }
+        result = write_all(fd, NULL, block > 0 ? buffer : data, len);
+        done += len;
+    }
+    if (close(fd) != 0 || result != 0) {
+        perror(path);
+        return -1;
+    }
+    return set_mtime(path, 0);
+}
+
+static int generate_tiny(const char *dir, const bench_scale_t *scale) {
+    uint64_t state = 1;
+    static char data[BUFFER_SIZE];
+    char path[PATH_MAX];
+    int per_dir = (scale->tiny_files + scale->tiny_dirs - 1) / scale->tiny_dirs;
+    for (int i = 0; i < scale->tiny_files; i++) {
+        snprintf(path, sizeof(path), "%s/d%03d", dir, i / per_dir);
+        if (i % per_dir == 0 && mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/d%03d/f%06d", dir, i / per_dir, i);
+        size_t size = next_random(&state) % scale->tiny_max_size;
+        fill_random(&state, data, size);
+        if (write_file(path, size, &state, data, size) != 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < scale->tiny_dirs; i++) {
+        snprintf(path, sizeof(path), "%s/d%03d", dir, i);
+        set_mtime(path, 0);
+    }
+    return 0;
+}
+
+static int generate_large(const char *dir, const bench_scale_t *scale) {
+    uint64_t state = 2;
+    char path[PATH_MAX];
+    for (int i = 0; i < scale->large_files; i++) {
+        snprintf(path, sizeof(path), "%s/large%d.bin", dir, i);
+        if (write_file(path, scale->large_size, &state, NULL, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int generate_dup(const char *dir, const bench_scale_t *scale) {
+    uint64_t state = 3;
+    char path[PATH_MAX];
+    char source[PATH_MAX];
+    snprintf(source, sizeof(source), "%s/copy00.bin", dir);
+    if (write_file(source, scale->dup_size, &state, NULL, 0) != 0) {
+        return -1;
+    }
+    for (int i = 1; i < scale->dup_files; i++) {
+        // Regenerating from the same seed gives an identical copy
+        uint64_t copy_state = 3;
+        snprintf(path, sizeof(path), "%s/copy%02d.bin", dir, i);
+        if (write_file(path, scale->dup_size, &copy_state, NULL, 0) != 0) {
+            return -1;
+        }
+    }
+
+    char *block = malloc(scale->dup_block);
+    if (block == NULL) {
+        perror("Failed to allocate block");
+        return -1;
+    }
+    fill_random(&state, block, scale->dup_block);
+    int result = 0;
+    for (int i = 0; i < scale->dup_files && result == 0; i++) {
+        snprintf(path, sizeof(path), "%s/repeat%02d.bin", dir, i);
+        result = write_file(path, scale->dup_size, &state, block, scale->dup_block);
+    }
+    free(block);
+    return result;
+}
+
+static int generate_sparse(const char *dir, const bench_scale_t *scale) {
+    uint64_t state = 4;
+    char *block = malloc(scale->sparse_block);
+    if (block == NULL) {
+        perror("Failed to allocate block");
+        return -1;
+    }
+    char path[PATH_MAX];
+    int result = 0;
+    for (int i = 0; i < scale->sparse_files && result == 0; i++) {
+        snprintf(path, sizeof(path), "%s/sparse%d.img", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, scale->sparse_size) != 0) {
+            result = -1;
+        }
+        for (off_t offset = 0; result == 0 && offset < scale->sparse_size;
+             offset += scale->sparse_stride) {
+            off_t write_offset = offset;
+            fill_random(&state, block, scale->sparse_block);
+            result = write_all(fd, &write_offset, block, scale->sparse_block);
+        }
+        if (fd >= 0 && close(fd) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            perror(path);
+        } else {
+            result = set_mtime(path, 0);
+        }
+    }
+    free(block);
+    return result;
+}
+
+static const corpus_t corpora[] = {
+    {"tiny", generate_tiny},
+    {"large", generate_large},
+    {"duplicate", generate_dup},
+    {"sparse", generate_sparse},
+};
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+static int remove_entry(const char *path, const struct stat *stat_buf, int type,
+                        struct FTW *ftw) {
+    return remove(path);
+}
+
+/*
+ * Removes 'path' and everything beneath it, if it exists
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int remove_tree(const char *path) {
+    if (access(path, F_OK) != 0) {
+        return 0;
+    }
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Makes sure corpus 'corpus' exists in 'dir' at 'scale', generating it unless
+ * a complete copy with the same parameters is already there
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int prepare_corpus(const char *dir, const corpus_t *corpus, const bench_scale_t *scale) {
+    char stamp_path[PATH_MAX];
+    snprintf(stamp_path, sizeof(stamp_path), "%s/%s", dir, STAMP_NAME);
+    char stamp[256];
+    int stamp_len = snprintf(stamp, sizeof(stamp), "%s %s\n", corpus->name, scale->name);
+
+    char existing[256];
+    int fd = open(stamp_path, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t len = read_all(fd, NULL, existing, sizeof(existing));
+        close(fd);
+        if (len == stamp_len && memcmp(existing, stamp, len) == 0) {
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Generating %s corpus (%s scale)...\n", corpus->name, scale->name);
+    if (remove_tree(dir) != 0 || mkdir(dir, 0755) != 0) {
+        perror(dir);
+        return -1;
+    }
+    if (corpus->generate(dir, scale) != 0 || set_mtime(dir, 0) != 0) {
+        return -1;
+    }
+    // The stamp goes in last, so an interrupted generation starts over
+    fd = open(stamp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, NULL, stamp, stamp_len) != 0 || close(fd) != 0) {
+        perror(stamp_path);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    file_list_t *files;
+    off_t bytes;
+    int count;
+    // Every how many files one is picked, and which offset to give it
+    int every;
+} collect_job_t;
+
+static collect_job_t *collect_job;
+
+static int collect_entry(const char *path, const struct stat *stat_buf, int type,
+                         struct FTW *ftw) {
+    if (type != FTW_F || strcmp(path + ftw->base, STAMP_NAME) == 0) {
+        return 0;
+    }
+    collect_job_t *job = collect_job;
+    if (job->count++ % job->every == 0) {
+        if (file_list_add(job->files, path) != 0) {
+            return -1;
+        }
+        job->bytes += stat_buf->st_size;
+    }
+    return 0;
+}
+
+/*
+ * Adds every 'every'th regular file beneath 'dir' (in walk order) to 'files'
+ * and stores the total of their sizes in '*bytes' and the number of regular
+ * files in '*count'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int collect_files(const char *dir, int every, file_list_t *files, off_t *bytes,
+                         int *count) {
+    collect_job_t job = {.files = files, .bytes = 0, .count = 0, .every = every};
+    collect_job = &job;
+    if (nftw(dir, collect_entry, 64, FTW_PHYS) != 0) {
+        return -1;
+    }
+    *bytes = job.bytes;
+    *count = job.count;
+    return 0;
+}
+
+/*
+ * Reads the I/O counters of the calling process from /proc/self/io
+ * Returns 0 on success or -1 if they are unavailable
+ */
+static int read_io_counters(bench_sample_t *sample) {
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char key[32];
+    unsigned long long value;
+    while (fscanf(file, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) {
+            sample->bytes_read = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            sample->bytes_written = value;
+        } else if (strcmp(key, "syscr") == 0) {
+            sample->read_syscalls = value;
+        } else if (strcmp(key, "syscw") == 0) {
+            sample->write_syscalls = value;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Performs the operation of 'run'; called in the child
+static int perform(const bench_run_t *run) {
+    if (strcmp(run->operation, "create") == 0) {
+        return create_archive(run->archive, run->files);
+    } else if (strcmp(run->operation, "append") == 0) {
+        return append_files_to_archive(run->archive, run->files);
+    } else if (strcmp(run->operation, "list") == 0) {
+        file_list_t members;
+        file_list_init(&members);
+        int result = get_archive_file_list(run->archive, &members);
+        file_list_clear(&members);
+        return result;
+    } else if (strcmp(run->operation, "extract") == 0) {
+        return extract_files_from_archive(run->archive, run->files);
+    } else {
+        return update_files_in_archive(run->archive, run->files);
+    }
+}
+
+/*
+ * Times one run of 'run' in a child process and gathers its counters
+ * Returns 0 on success or -1 if the run failed
+ */
+static int time_run(const bench_run_t *run, bench_sample_t *sample) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("Failed to create pipe");
+        return -1;
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        bench_sample_t before = {0};
+        bench_sample_t after = {0};
+        after.status = run->work_dir != NULL && chdir(run->work_dir) != 0 ? -1 : 0;
+        read_io_counters(&before);
+        double start = now();
+        if (after.status == 0) {
+            after.status = perform(run);
+        }
+        after.seconds = now() - start;
+        read_io_counters(&after);
+        after.read_syscalls -= before.read_syscalls;
+        after.write_syscalls -= before.write_syscalls;
+        after.bytes_read -= before.bytes_read;
+        after.bytes_written -= before.bytes_written;
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        after.peak_rss_kb = usage.ru_maxrss;
+        write_all(pipe_fds[1], NULL, &after, sizeof(after));
+        _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    ssize_t len = read_all(pipe_fds[0], NULL, sample, sizeof(*sample));
+    close(pipe_fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (len != sizeof(*sample) || !WIFEXITED(status) || sample->status != 0) {
+        fprintf(stderr, "Error: %s failed\n", run->operation);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the size of 'path', or 0 if it cannot be found
+static off_t file_size(const char *path) {
+    struct stat stat_buf;
+    return stat(path, &stat_buf) == 0 ? stat_buf.st_size : 0;
+}
+
+/*
+ * Copies 'from' to 'to', so a run starts from the same archive every time
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_archive(const char *from, const char *to) {
+    int in_fd = open(from, O_RDONLY);
+    int out_fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = in_fd >= 0 && out_fd >= 0 ? 0 : -1;
+    if (result == 0) {
+        result = copy_file_data(out_fd, NULL, in_fd, NULL, file_size(from));
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    if (result != 0) {
+        perror("Failed to copy archive");
+    }
+    return result;
+}
+
+/*
+ * Sets the modification time of every file in 'files' to CORPUS_MTIME +
+ * 'offset', which makes an update see them as changed (or unchanged again)
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int touch_files(const file_list_t *files, int offset) {
+    for (node_t *node = files->head; node != NULL; node = node->next) {
+        if (set_mtime(node->name, offset) != 0) {
+            perror(node->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes one result object for 'corpus' and 'operation' to 'out', from the
+ * run with the median time among 'samples'
+ */
+static void print_result(FILE *out, int first, const char *corpus, const char *operation,
+                         int files, off_t bytes, off_t archive_bytes,
+                         const bench_sample_t *samples, int repetitions) {
+    double times[MAX_REPETITIONS];
+    for (int i = 0; i < repetitions; i++) {
+        times[i] = samples[i].seconds;
+    }
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    double median = times[repetitions / 2];
+    const bench_sample_t *sample = &samples[0];
+    for (int i = 0; i < repetitions; i++) {
+        if (samples[i].seconds == median) {
+            sample = &samples[i];
+        }
+    }
+
+    double seconds = median > 0 ? median : 1e-9;
+    fprintf(out,
+            "%s    {\"corpus\": \"%s\", \"operation\": \"%s\", \"files\": %d, \"bytes\": %lld, "
+            "\"archive_bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+            "\"files_per_s\": %.1f, \"read_syscalls\": %llu, \"write_syscalls\": %llu, "
+            "\"bytes_read\": %llu, \"bytes_written\": %llu, \"peak_rss_kb\": %ld, \"runs\": [",
+            first ? "" : ",\n", corpus, operation, files, (long long) bytes,
+            (long long) archive_bytes, median, bytes / seconds / 1e6, files / seconds,
+            sample->read_syscalls, sample->write_syscalls, sample->bytes_read,
+            sample->bytes_written, sample->peak_rss_kb);
+    for (int i = 0; i < repetitions; i++) {
+        fprintf(out, "%s%.6f", i > 0 ? ", " : "", samples[i].seconds);
+    }
+    fprintf(out, "]}");
+    fflush(out);
+}
+
+/*
+ * Benchmarks every operation on the corpus 'name' in the current directory,
+ * which is 'data_dir', writing a result for each to 'out'. Members are named
+ * relative to 'data_dir', as they would be by a user archiving from there.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int bench_corpus(FILE *out, int *first, const char *data_dir, const char *name,
+                        int repetitions) {
+    const char *corpus_dir = name;
+    char archive[PATH_MAX];
+    char base_archive[PATH_MAX];
+    char extract_dir[PATH_MAX];
+    snprintf(archive, sizeof(archive), "%s/%s.tar", data_dir, name);
+    snprintf(base_archive, sizeof(base_archive), "%s/%s.base.tar", data_dir, name);
+    snprintf(extract_dir, sizeof(extract_dir), "%s.out", name);
+
+    file_list_t all;
+    file_list_t changed;
+    file_list_t everything;
+    file_list_t nothing;
+    file_list_init(&all);
+    file_list_init(&changed);
+    file_list_init(&everything);
+    file_list_init(&nothing);
+    off_t bytes;
+    off_t changed_bytes;
+    int count;
+    int result = 0;
+    // Updates are given every file, and one in ten has changed
+    if (file_list_add(&all, corpus_dir) != 0 ||
+        collect_files(corpus_dir, 1, &everything, &bytes, &count) != 0 ||
+        collect_files(corpus_dir, 10, &changed, &changed_bytes, &count) != 0) {
+        perror("Failed to list corpus");
+        result = -1;
+    }
+
+    static const char *operations[] = {"create", "list", "extract", "append", "update"};
+    bench_sample_t samples[MAX_REPETITIONS];
+    for (int op = 0; result == 0 && op < (int) (sizeof(operations) / sizeof(operations[0]));
+         op++) {
+        const char *operation = operations[op];
+        bench_run_t run = {.operation = operation, .archive = archive, .files = &all,
+                           .work_dir = NULL};
+        int run_files = count;
+        off_t run_bytes = bytes;
+        fprintf(stderr, "  %s: %s\n", name, operation);
+        for (int i = 0; result == 0 && i < repetitions; i++) {
+            // Each run starts from the same state, set up outside the timing
+            if (strcmp(operation, "list") == 0 || strcmp(operation, "extract") == 0) {
+                run.archive = base_archive;
+            } else if (strcmp(operation, "append") == 0 || strcmp(operation, "update") == 0) {
+                result = copy_archive(base_archive, archive);
+            }
+            if (strcmp(operation, "extract") == 0) {
+                run.files = &nothing;
+                run.work_dir = extract_dir;
+                if (remove_tree(extract_dir) != 0 || mkdir(extract_dir, 0755) != 0) {
+                    perror(extract_dir);
+                    result = -1;
+                }
+            } else if (strcmp(operation, "update") == 0) {
+                run.files = &everything;
+                run_bytes = changed_bytes;
+                result = result == 0 ? touch_files(&changed, 1) : -1;
+            }
+
+            if (result == 0) {
+                result = time_run(&run, &samples[i]);
+            }
+            if (strcmp(operation, "update") == 0 && touch_files(&changed, 0) != 0) {
+                result = -1;
+            }
+            if (result == 0 && strcmp(operation, "create") == 0) {
+                result = rename(archive, base_archive);
+            }
+        }
+        if (result == 0) {
+            // A created archive has been moved to 'base_archive' by now
+            int on_base = run.archive == base_archive || strcmp(operation, "create") == 0;
+            off_t archive_bytes = file_size(on_base ? base_archive : archive);
+            print_result(out, *first, name, operation, run_files, run_bytes, archive_bytes,
+                         samples, repetitions);
+            *first = 0;
+        }
+    }
+
+    remove_tree(extract_dir);
+    unlink(archive);
+    file_list_clear(&all);
+    file_list_clear(&changed);
+    file_list_clear(&everything);
+    file_list_clear(&nothing);
+    return result;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-d DATA_DIR] [-o OUTPUT] [-r REPETITIONS] [--quick] [--corpus NAME] "
+            "[-j THREADS] [--io-engine sync|uring]\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    const char *data_dir = "bench_data";
+    const char *output = NULL;
+    const char *only = NULL;
+    const bench_scale_t *scale = &full_scale;
+    int repetitions = DEFAULT_REPETITIONS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+            if (repetitions < 1 || repetitions > MAX_REPETITIONS) {
+                fprintf(stderr, "Error: Invalid repetition count '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            scale = &quick_scale;
+        } else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            minitar_options.num_threads = atoi(argv[++i]);
+            if (minitar_options.num_threads < 1) {
+                fprintf(stderr, "Error: Invalid thread count '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--io-engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "sync") == 0) {
+                minitar_options.io_engine = IO_ENGINE_SYNC;
+            } else if (strcmp(argv[i], "uring") == 0) {
+                minitar_options.io_engine = IO_ENGINE_URING;
+            } else {
+                fprintf(stderr, "Error: Invalid I/O engine '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *out = output != NULL ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        perror(output);
+        return 1;
+    }
+    // Everything runs from inside the data directory; archive names are made
+    // absolute so extraction can run in a directory of its own
+    char data_path[PATH_MAX];
+    if ((mkdir(data_dir, 0755) != 0 && errno != EEXIST) || realpath(data_dir, data_path) == NULL ||
+        chdir(data_path) != 0) {
+        perror(data_dir);
+        return 1;
+    }
+
+    fprintf(out,
+            "{\n  \"benchmark\": \"minitar\",\n  \"scale\": \"%s\",\n  \"repetitions\": %d,\n"
+            "  \"threads\": %d,\n  \"io_engine\": \"%s\",\n  \"results\": [\n",
+            scale->name, repetitions, minitar_options.num_threads,
+            minitar_options.io_engine == IO_ENGINE_URING ? "uring" : "sync");
+    int result = 0;
+    int first = 1;
+    for (size_t i = 0; result == 0 && i < NUM_CORPORA; i++) {
+        if (only != NULL && strcmp(only, corpora[i].name) != 0) {
+            continue;
+        }
+        result = prepare_corpus(corpora[i].name, &corpora[i], scale);
+        if (result == 0) {
+            result = bench_corpus(out, &first, data_path, corpora[i].name, repetitions);
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return result == 0 ? 0 : 1;
+}
@@ -1,16 +1,58 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "copy_engine.h"
 #include "file_list.h"
 #include "minitar.h"
+#include "stats.h"
 #include <unistd.h>
 
-// Adding function header for the update function
-int update_files_in_archive(const char *archive_name, const file_list_t *file);
+/*
+ * Parses a byte count such as "65536", "512K" or "4M" from the command line
+ *
+ * Returns the number of bytes, or 0 if the string is not a valid size or is
+ * larger than MAX_COPY_CHUNK_SIZE
+ */
+static size_t parse_size(const char *str) {
+    // strtoull would quietly negate a leading '-'
+    if (*str < '0' || *str > '9') {
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0) {
+        return 0;
+    }
+    int shift = 0;
+    switch (*end) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            end++;
+            break;
+    }
+    if (*end != '\0' || value > MAX_COPY_CHUNK_SIZE >> shift) {
+        return 0;
+    }
+    return value << shift;
+}
 
 int main(int argc, char **argv) {
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s -c|a|t|u|x|d|--compact [-j THREADS] [--chunk-size BYTES] [--index] [--numeric-owner] [--check-content] [--dedup] [--hash] [--mtime-ns] [-z|--zstd|--seekable] [--io-engine sync|uring] [--stats[=json]] -f ARCHIVE [FILE...]\n", argv[0]);
         return 0;
     }
 
@@ -20,6 +62,10 @@ int main(int argc, char **argv) {
 
     const char *archive_name = NULL;
     int operation = 0;
+#ifdef MINITAR_STATS
+    // 0 for no statistics, 1 for a table, 2 for JSON
+    int stats_format = 0;
+#endif
 
     // Checking the agruments in the command line to check for each minitat function
     // Depending on the operation, makes the value operation have a different number
@@ -34,9 +80,68 @@ int main(int argc, char **argv) {
             operation = 4;
         } else if (strcmp(argv[i], "-x") == 0) {
             operation = 5;
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            operation = 6;
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--verify") == 0) {
+            operation = 7;
         } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
             archive_name = argv[i + 1];
             i++;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            minitar_options.num_threads = atoi(argv[i + 1]);
+            if (minitar_options.num_threads < 1) {
+                printf("Error: Invalid thread count '%s'.\n", argv[i + 1]);
+                file_list_clear(&files);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            minitar_options.build_index = 1;
+        } else if (strcmp(argv[i], "--numeric-owner") == 0) {
+            minitar_options.numeric_owner = 1;
+        } else if (strcmp(argv[i], "--check-content") == 0) {
+            minitar_options.check_content = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            minitar_options.dedup = 1;
+        } else if (strcmp(argv[i], "--hash") == 0) {
+            minitar_options.hash = 1;
+        } else if (strcmp(argv[i], "--mtime-ns") == 0) {
+            minitar_options.mtime_ns = 1;
+        } else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--gzip") == 0) {
+            minitar_options.compression = COMPRESS_GZIP;
+        } else if (strcmp(argv[i], "--zstd") == 0) {
+            minitar_options.compression = COMPRESS_ZSTD;
+        } else if (strcmp(argv[i], "--seekable") == 0) {
+            minitar_options.compression = COMPRESS_GZIP;
+            minitar_options.seekable = 1;
+        } else if (strcmp(argv[i], "--io-engine") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "sync") == 0) {
+                minitar_options.io_engine = IO_ENGINE_SYNC;
+            } else if (strcmp(argv[i + 1], "uring") == 0) {
+                minitar_options.io_engine = IO_ENGINE_URING;
+            } else {
+                printf("Error: Invalid I/O engine '%s'.\n", argv[i + 1]);
+                file_list_clear(&files);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=json") == 0) {
+#ifdef MINITAR_STATS
+            stats_format = strcmp(argv[i], "--stats") == 0 ? 1 : 2;
+#else
+            printf("Error: This minitar was built without statistics; rebuild it with 'make STATS=1'.\n");
+            file_list_clear(&files);
+            return 1;
+#endif
+        } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+            size_t chunk_size = parse_size(argv[i + 1]);
+            if (chunk_size == 0) {
+                printf("Error: Invalid chunk size '%s'.\n", argv[i + 1]);
+                file_list_clear(&files);
+                return 1;
+            }
+            copy_set_chunk_size(chunk_size);
+            i++;
         } else {
             if (file_list_add(&files, argv[i]) != 0) {
                 perror("Error: Failed to add file to list");
@@ -53,6 +158,10 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+#ifdef MINITAR_STATS
+    stats_begin();
+#endif
+
     // Used a switch case depending on the operation number and called respected function
     int result = 0;
     switch (operation) {
@@ -76,7 +185,13 @@ int main(int argc, char **argv) {
             result = update_files_in_archive(archive_name, &files);
             break;
         case 5:
-            result = extract_files_from_archive(archive_name);
+            result = extract_files_from_archive(archive_name, &files);
+            break;
+        case 6:
+            result = compact_archive(archive_name);
+            break;
+        case 7:
+            result = verify_archive(archive_name, &files);
             break;
         default:
             printf("Error: Unsupported operation.\n");
@@ -84,6 +199,13 @@ int main(int argc, char **argv) {
             return 1;
     }
 
+    // Statistics go to standard error, since standard output may be the archive
+#ifdef MINITAR_STATS
+    if (stats_format != 0) {
+        stats_print(stderr, stats_format == 2);
+    }
+#endif
+
     // If the operation failed, report an error
     if (result != 0) {
         file_list_clear(&files);
@@ -94,49 +216,3 @@ int main(int argc, char **argv) {
     return 0;
 }
 
-
-/*
- * Updates an archive file using archive_name and a new list of files to possibly be updated
- *
- * Returns 0 upon success, and -1 upon error
- *
- * Creates a new file list and obtains the current list in the archive file
- *
- * The compares the two files list using file_list_is_subset, then uses the append method to attach the files if valid
- */
-int update_files_in_archive(const char *archive_name, const file_list_t *files) {
-    if (access(archive_name, F_OK) == -1) {
-        perror("Error: Archive file does not exist");
-        return -1;
-    }
-
-    // Initialize a new linked list of files that will be extracted by the archive list function
-    file_list_t archive_files;
-    file_list_init(&archive_files);
-
-    // Getting the linked list of files from the current acrhive
-    int result = get_archive_file_list(archive_name, &archive_files);
-    if (result != 0) {
-        perror("Error: Failed to obtain archive list");
-        file_list_clear(&archive_files);
-        return -1;
-    }
-
-    // Checking to see if the files being appended is a subset of the archive files present
-    if(!file_list_is_subset(files, &archive_files)) {
-        fprintf(stderr, "Error: One or more of the specified files is not already present in archive\n");
-        file_list_clear(&archive_files);
-        return -1;
-    }
-
-    // Appends new versions of the files to the archive, ensuring they are written in chunks
-    result = append_files_to_archive(archive_name, files);
-    if (result != 0) {
-        perror("Error: Failed to update archive file");
-        file_list_clear(&archive_files);
-        return -1;
-    }
-
-    file_list_clear(&archive_files);
-    return 0;
-}
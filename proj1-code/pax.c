@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "pax.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 256
+
+void pax_records_init(pax_records_t *records) {
+    records->data = NULL;
+    records->len = 0;
+    records->capacity = 0;
+}
+
+// Returns the number of decimal digits in 'value'
+static size_t num_digits(size_t value) {
+    size_t digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+int pax_records_add(pax_records_t *records, const char *key, const char *value) {
+    // The length counts its own digits, so settle on a digit count that
+    // still holds once those digits are added
+    size_t base_len = strlen(key) + strlen(value) + 3;
+    size_t record_len = base_len + num_digits(base_len);
+    if (num_digits(record_len) != num_digits(base_len)) {
+        record_len++;
+    }
+
+    if (records->len + record_len + 1 > records->capacity) {
+        size_t capacity = records->capacity > 0 ? records->capacity : INITIAL_CAPACITY;
+        while (records->len + record_len + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *data = realloc(records->data, capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        records->data = data;
+        records->capacity = capacity;
+    }
+    snprintf(records->data + records->len, record_len + 1, "%zu %s=%s\n", record_len, key,
+             value);
+    records->len += record_len;
+    return 0;
+}
+
+void pax_records_free(pax_records_t *records) {
+    free(records->data);
+    pax_records_init(records);
+}
+
+int pax_parse(char *data, size_t len, pax_record_fn_t callback, void *arg) {
+    size_t pos = 0;
+    while (pos < len) {
+        // Decimal length, a space, then KEY=VALUE and a newline
+        size_t record_len = 0;
+        size_t i = pos;
+        while (i < len && data[i] >= '0' && data[i] <= '9') {
+            record_len = record_len * 10 + (data[i] - '0');
+            i++;
+            if (record_len > len) {
+                return -1;
+            }
+        }
+        // The record must hold its own length prefix, the space and at
+        // least "k=\n" before its last byte is looked at
+        if (i == pos || i >= len || data[i] != ' ' || record_len > len - pos ||
+            record_len < (i - pos) + 1 + 3 || data[pos + record_len - 1] != '\n') {
+            return -1;
+        }
+        char *key = data + i + 1;
+        char *end = data + pos + record_len - 1;
+        char *equals = memchr(key, '=', end - key);
+        if (equals == NULL || equals == key) {
+            return -1;
+        }
+        *equals = '\0';
+        *end = '\0';
+        if (callback(key, equals + 1, end - equals - 1, arg) != 0) {
+            return -1;
+        }
+        pos += record_len;
+    }
+    return 0;
+}
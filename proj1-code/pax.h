@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _PAX_H
+#define _PAX_H
+
+#include <stddef.h>
+
+/*
+ * POSIX extended (PAX) header records. A member whose attributes do not fit
+ * in a ustar header is preceded by an extended header block (typeflag 'x')
+ * whose data is a sequence of records of the form "LENGTH KEY=VALUE\n",
+ * where LENGTH is the decimal length of the whole record including itself.
+ */
+
+// Type flag of an extended header applying to the next member, and of a
+// global one applying to all following members
+#define PAX_TYPE 'x'
+#define PAX_GLOBAL_TYPE 'g'
+
+// Records being built for one member
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} pax_records_t;
+
+// Initialize an empty set of records
+void pax_records_init(pax_records_t *records);
+
+// Append the record 'key'='value'
+// Returns 0 on success or -1 if memory could not be allocated
+int pax_records_add(pax_records_t *records, const char *key, const char *value);
+
+// Free the memory held by 'records', leaving it empty
+void pax_records_free(pax_records_t *records);
+
+// Receives each record found by pax_parse; 'value' is null-terminated and
+// 'value_len' bytes long (values may themselves contain null bytes)
+// Returns 0 to continue or -1 to stop parsing with an error
+typedef int (*pax_record_fn_t)(const char *key, const char *value, size_t value_len, void *arg);
+
+// Call 'callback' for each record in the 'len' bytes of 'data'. The records
+// are modified in place to null-terminate keys and values.
+// Returns 0 on success or -1 if the records are malformed or the callback fails
+int pax_parse(char *data, size_t len, pax_record_fn_t callback, void *arg);
+
+#endif    // _PAX_H
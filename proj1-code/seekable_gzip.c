@@ -0,0 +1,416 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "seekable_gzip.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+
+// Window bits telling zlib to write, or to expect, a gzip wrapper
+#define GZIP_WINDOW_BITS (15 + 16)
+
+#define LOCATOR_MAGIC "MTARSGZ2"
+// Identifiers of the extra subfields holding index data and the locator
+#define INDEX_ID1 'M'
+#define INDEX_ID2 'I'
+#define LOCATOR_ID1 'M'
+#define LOCATOR_ID2 'L'
+
+// An extra field is at most 65535 bytes, including the 4-byte subfield header
+#define MAX_EXTRA_PAYLOAD (65535 - 4)
+// Serialized size of one index entry, not counting its name
+#define ENTRY_SIZE 64
+// Serialized size of the locator's payload
+#define LOCATOR_PAYLOAD_SIZE 48
+
+// Start of every data-less gzip member we write: magic, deflate method, the
+// FEXTRA flag, no modification time, no extra flags and an unknown OS
+static const unsigned char extra_member_header[] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255};
+// End of a data-less gzip member: an empty final deflate block, followed by
+// the CRC-32 and length of no data
+static const unsigned char empty_member_trailer[] = {3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Total size of a data-less member whose extra subfield holds 'payload' bytes
+#define EXTRA_MEMBER_SIZE(payload)                                              \
+    (sizeof(extra_member_header) + 2 + 4 + (payload) + sizeof(empty_member_trailer))
+#define LOCATOR_SIZE EXTRA_MEMBER_SIZE(LOCATOR_PAYLOAD_SIZE)
+
+// Integers in the index are stored little-endian, since the archive may be
+// read on any host
+static void put_u16(unsigned char *p, unsigned value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static unsigned get_u16(const unsigned char *p) {
+    return p[0] | (unsigned) p[1] << 8;
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+int seekable_writer_init(seekable_writer_t *writer, int fd) {
+    writer->fd = fd;
+    writer->position = 0;
+    writer->buffer_size = copy_get_chunk_size();
+    writer->buffer = malloc(writer->buffer_size);
+    memset(&writer->stream, 0, sizeof(writer->stream));
+    if (writer->buffer == NULL ||
+        deflateInit2(&writer->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Runs the compressor over the pending input with 'flush', writing out
+ * everything it produces
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int deflate_pending(seekable_writer_t *writer, int flush) {
+    do {
+        writer->stream.next_out = writer->buffer;
+        writer->stream.avail_out = writer->buffer_size;
+        if (deflate(&writer->stream, flush) == Z_STREAM_ERROR) {
+            errno = EINVAL;
+            return -1;
+        }
+        size_t produced = writer->buffer_size - writer->stream.avail_out;
+        if (write_all(writer->fd, NULL, writer->buffer, produced) != 0) {
+            return -1;
+        }
+        writer->position += produced;
+    } while (writer->stream.avail_out == 0);
+    return 0;
+}
+
+int seekable_begin_frame(seekable_writer_t *writer) {
+    return deflateReset(&writer->stream) == Z_OK ? 0 : -1;
+}
+
+int seekable_write(seekable_writer_t *writer, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    while (len > 0) {
+        size_t step = len > UINT_MAX ? UINT_MAX : len;
+        writer->stream.next_in = (unsigned char *) bytes;
+        writer->stream.avail_in = step;
+        if (deflate_pending(writer, Z_NO_FLUSH) != 0) {
+            return -1;
+        }
+        bytes += step;
+        len -= step;
+    }
+    return 0;
+}
+
+int seekable_end_frame(seekable_writer_t *writer) {
+    writer->stream.avail_in = 0;
+    return deflate_pending(writer, Z_FINISH);
+}
+
+/*
+ * Writes a gzip member holding no data whose extra field has one subfield,
+ * identified by 'id1' and 'id2', containing 'len' bytes of 'payload'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_extra_member(seekable_writer_t *writer, char id1, char id2,
+                              const unsigned char *payload, size_t len) {
+    unsigned char extra_header[6];
+    put_u16(extra_header, len + 4);
+    extra_header[2] = id1;
+    extra_header[3] = id2;
+    put_u16(extra_header + 4, len);
+    if (write_all(writer->fd, NULL, extra_member_header, sizeof(extra_member_header)) != 0 ||
+        write_all(writer->fd, NULL, extra_header, sizeof(extra_header)) != 0 ||
+        write_all(writer->fd, NULL, payload, len) != 0 ||
+        write_all(writer->fd, NULL, empty_member_trailer, sizeof(empty_member_trailer)) != 0) {
+        return -1;
+    }
+    writer->position += EXTRA_MEMBER_SIZE(len);
+    return 0;
+}
+
+int seekable_write_index(seekable_writer_t *writer, const archive_index_t *index,
+                         const off_t *frames) {
+    size_t index_len = 0;
+    for (int i = 0; i < index->count; i++) {
+        index_len += ENTRY_SIZE + strlen(index->members[i].name);
+    }
+    unsigned char *data = malloc(index_len > 0 ? index_len : 1);
+    if (data == NULL) {
+        return -1;
+    }
+
+    unsigned char *p = data;
+    for (int i = 0; i < index->count; i++) {
+        const archive_member_t *member = &index->members[i];
+        size_t name_len = strlen(member->name);
+        put_u64(p, frames[i]);
+        put_u64(p + 8, member->offset);
+        put_u64(p + 16, member->data_offset);
+        put_u64(p + 24, member->size);
+        put_u64(p + 32, member->real_size);
+        put_u64(p + 40, (uint64_t) member->mtime);
+        put_u64(p + 48, member->flags);
+        put_u64(p + 56, name_len);
+        memcpy(p + ENTRY_SIZE, member->name, name_len);
+        p += ENTRY_SIZE + name_len;
+    }
+
+    // The index is split over as many data-less members as it needs
+    off_t index_offset = writer->position;
+    int result = 0;
+    for (size_t pos = 0; pos < index_len && result == 0; pos += MAX_EXTRA_PAYLOAD) {
+        size_t len = index_len - pos < MAX_EXTRA_PAYLOAD ? index_len - pos : MAX_EXTRA_PAYLOAD;
+        result = write_extra_member(writer, INDEX_ID1, INDEX_ID2, data + pos, len);
+    }
+    free(data);
+    if (result != 0) {
+        return -1;
+    }
+
+    unsigned char locator[LOCATOR_PAYLOAD_SIZE];
+    memcpy(locator, LOCATOR_MAGIC, 8);
+    put_u64(locator + 8, index_offset);
+    put_u64(locator + 16, index_len);
+    put_u64(locator + 24, index->count);
+    put_u64(locator + 32, frames[index->count]);
+    put_u64(locator + 40, index->end_offset);
+    return write_extra_member(writer, LOCATOR_ID1, LOCATOR_ID2, locator, sizeof(locator));
+}
+
+void seekable_writer_free(seekable_writer_t *writer) {
+    if (writer->buffer != NULL) {
+        deflateEnd(&writer->stream);
+        free(writer->buffer);
+        writer->buffer = NULL;
+    }
+}
+
+/*
+ * Checks that 'data' (at least 'available' bytes) starts with a data-less
+ * member written by write_extra_member with subfield 'id1', 'id2', and finds
+ * its payload
+ * Returns the payload length, storing its start in '*payload', or -1 if the
+ * bytes are not such a member
+ */
+static long parse_extra_member(const unsigned char *data, size_t available, char id1, char id2,
+                               const unsigned char **payload) {
+    if (available < EXTRA_MEMBER_SIZE(0) ||
+        memcmp(data, extra_member_header, sizeof(extra_member_header)) != 0) {
+        return -1;
+    }
+    const unsigned char *extra = data + sizeof(extra_member_header);
+    size_t len = get_u16(extra + 4);
+    if (get_u16(extra) != len + 4 || extra[2] != id1 || extra[3] != id2 ||
+        available < EXTRA_MEMBER_SIZE(len) ||
+        memcmp(extra + 6 + len, empty_member_trailer, sizeof(empty_member_trailer)) != 0) {
+        return -1;
+    }
+    *payload = extra + 6;
+    return len;
+}
+
+/*
+ * Decodes the serialized entries in 'data' into 'index' and 'frames'
+ * Returns 0 on success, 1 if the entries are malformed, or -1 if an error occurs
+ */
+static int parse_entries(const unsigned char *data, size_t len, uint64_t count,
+                         archive_index_t *index, off_t *frames) {
+    char name[PATH_MAX];
+    size_t pos = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (len - pos < ENTRY_SIZE) {
+            return 1;
+        }
+        const unsigned char *entry = data + pos;
+        uint64_t name_len = get_u64(entry + 56);
+        if (name_len >= sizeof(name) || len - pos - ENTRY_SIZE < name_len) {
+            return 1;
+        }
+        memcpy(name, entry + ENTRY_SIZE, name_len);
+        name[name_len] = '\0';
+        frames[i] = get_u64(entry);
+        archive_member_t member = {.name = name,
+                                   .offset = get_u64(entry + 8),
+                                   .data_offset = get_u64(entry + 16),
+                                   .size = get_u64(entry + 24),
+                                   .real_size = get_u64(entry + 32),
+                                   .mtime = (time_t) get_u64(entry + 40),
+                                   .flags = get_u64(entry + 48)};
+        if (archive_index_add_member(index, &member) != 0) {
+            return -1;
+        }
+        pos += ENTRY_SIZE + name_len;
+    }
+    return pos == len ? 0 : 1;
+}
+
+int seekable_load_index(int fd, archive_index_t *index, off_t **frames) {
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        return -1;
+    }
+    if (!S_ISREG(stat_buf.st_mode) || stat_buf.st_size < (off_t) LOCATOR_SIZE) {
+        return 1;
+    }
+
+    unsigned char locator_member[LOCATOR_SIZE];
+    off_t locator_offset = stat_buf.st_size - LOCATOR_SIZE;
+    off_t read_offset = locator_offset;
+    if (read_all(fd, &read_offset, locator_member, LOCATOR_SIZE) != LOCATOR_SIZE) {
+        return -1;
+    }
+    const unsigned char *locator;
+    if (parse_extra_member(locator_member, LOCATOR_SIZE, LOCATOR_ID1, LOCATOR_ID2, &locator) !=
+            LOCATOR_PAYLOAD_SIZE ||
+        memcmp(locator, LOCATOR_MAGIC, 8) != 0) {
+        return 1;
+    }
+    uint64_t index_offset = get_u64(locator + 8);
+    uint64_t index_len = get_u64(locator + 16);
+    uint64_t count = get_u64(locator + 24);
+    if (index_offset > (uint64_t) locator_offset || count > index_len / ENTRY_SIZE + 1 ||
+        count > INT_MAX) {
+        return 1;
+    }
+
+    // Gather the index data from the members between the frames and locator
+    size_t region_len = locator_offset - index_offset;
+    unsigned char *region = malloc(region_len > 0 ? region_len : 1);
+    unsigned char *data = malloc(index_len > 0 ? index_len : 1);
+    *frames = malloc(sizeof(off_t) * (count + 1));
+    int result = region == NULL || data == NULL || *frames == NULL ? -1 : 0;
+    read_offset = index_offset;
+    if (result == 0 && read_all(fd, &read_offset, region, region_len) != (ssize_t) region_len) {
+        result = -1;
+    }
+    size_t data_len = 0;
+    for (size_t pos = 0; result == 0 && pos < region_len;) {
+        const unsigned char *payload;
+        long len = parse_extra_member(region + pos, region_len - pos, INDEX_ID1, INDEX_ID2,
+                                      &payload);
+        if (len < 0 || (uint64_t) len > index_len - data_len) {
+            result = 1;
+            break;
+        }
+        memcpy(data + data_len, payload, len);
+        data_len += len;
+        pos += EXTRA_MEMBER_SIZE(len);
+    }
+    if (result == 0 && data_len != index_len) {
+        result = 1;
+    }
+    if (result == 0) {
+        result = parse_entries(data, index_len, count, index, *frames);
+    }
+    if (result == 0) {
+        (*frames)[count] = get_u64(locator + 32);
+        index->end_offset = get_u64(locator + 40);
+    } else {
+        free(*frames);
+        *frames = NULL;
+        archive_index_clear(index);
+    }
+    free(region);
+    free(data);
+    return result;
+}
+
+int seekable_extract_to(int fd, off_t start, off_t end, off_t skip, off_t nbytes,
+                        seekable_sink_fn_t sink, void *arg) {
+    size_t chunk_size = copy_get_chunk_size();
+    unsigned char *in = malloc(chunk_size);
+    unsigned char *out = malloc(chunk_size);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (in == NULL || out == NULL || inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    int result = 0;
+    off_t in_offset = start;
+    while (nbytes > 0) {
+        if (stream.avail_in == 0) {
+            size_t to_read = end - in_offset < (off_t) chunk_size ? end - in_offset : chunk_size;
+            ssize_t bytes_read = to_read > 0 ? read_all(fd, &in_offset, in, to_read) : 0;
+            if (bytes_read <= 0) {
+                if (bytes_read == 0) {
+                    errno = ENODATA;
+                }
+                result = -1;
+                break;
+            }
+            stream.next_in = in;
+            stream.avail_in = bytes_read;
+        }
+
+        stream.next_out = out;
+        stream.avail_out = chunk_size;
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            errno = EIO;
+            result = -1;
+            break;
+        }
+
+        // Output before 'skip' (the member's header) is only decompressed
+        // to get past it
+        size_t produced = chunk_size - stream.avail_out;
+        if ((off_t) produced <= skip) {
+            skip -= produced;
+        } else {
+            size_t len = produced - skip;
+            if ((off_t) len > nbytes) {
+                len = nbytes;
+            }
+            if (sink(out + skip, len, arg) != 0) {
+                result = -1;
+                break;
+            }
+            skip = 0;
+            nbytes -= len;
+        }
+        if (ret == Z_STREAM_END && nbytes > 0) {
+            errno = ENODATA;
+            result = -1;
+            break;
+        }
+    }
+
+    inflateEnd(&stream);
+    free(in);
+    free(out);
+    return result;
+}
+
+// Sink for seekable_extract: writes to the descriptor pointed to by 'arg'
+static int write_to_fd(const void *data, size_t len, void *arg) {
+    return write_all(*(int *) arg, NULL, data, len);
+}
+
+int seekable_extract(int fd, off_t start, off_t end, int out_fd, off_t skip, off_t nbytes) {
+    return seekable_extract_to(fd, start, end, skip, nbytes, write_to_fd, &out_fd);
+}
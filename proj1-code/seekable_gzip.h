@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _SEEKABLE_GZIP_H
+#define _SEEKABLE_GZIP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "archive_index.h"
+
+/*
+ * A seekable gzip archive compresses each tar member (header, data and
+ * padding) as a separate gzip member, called a frame here, followed by one
+ * frame holding the end-of-archive blocks. After those come a frame index
+ * and a fixed-size locator, stored in the extra fields of gzip members that
+ * contain no data. The whole file is therefore an ordinary concatenation of
+ * gzip members that gzip and tar read as a plain compressed tar stream, while
+ * minitar can list it from the index alone and decompress single members.
+ *
+ * Frame offsets are kept in an array 'frames' parallel to an archive index:
+ * frames[i] is the offset of member i's frame within the compressed file, and
+ * frames[count] the offset of the end-of-archive frame.
+ */
+
+// Compresses frames one after another onto a file descriptor
+typedef struct {
+    int fd;
+    // Number of compressed bytes written so far
+    off_t position;
+    z_stream stream;
+    unsigned char *buffer;
+    size_t buffer_size;
+} seekable_writer_t;
+
+// Set up 'writer' to write to 'fd' from its current position
+// Returns 0 on success or -1 if an error occurs
+int seekable_writer_init(seekable_writer_t *writer, int fd);
+
+// Start a new frame; everything written until seekable_end_frame goes in it
+// Returns 0 on success or -1 if an error occurs
+int seekable_begin_frame(seekable_writer_t *writer);
+
+// Compress 'len' bytes of 'data' into the current frame
+// Returns 0 on success or -1 if an error occurs
+int seekable_write(seekable_writer_t *writer, const void *data, size_t len);
+
+// Finish the current frame
+// Returns 0 on success or -1 if an error occurs
+int seekable_end_frame(seekable_writer_t *writer);
+
+// Write the frame index describing the members of 'index' and their frames,
+// then the locator that ends the file
+// Returns 0 on success or -1 if an error occurs
+int seekable_write_index(seekable_writer_t *writer, const archive_index_t *index,
+                         const off_t *frames);
+
+// Free the resources held by 'writer'
+void seekable_writer_free(seekable_writer_t *writer);
+
+// Read the frame index of the compressed archive open as 'fd' into the empty
+// 'index' and a newly allocated '*frames' array
+// Returns 0 on success, 1 if the file is not a seekable gzip archive, or -1
+// if an error occurs
+int seekable_load_index(int fd, archive_index_t *index, off_t **frames);
+
+// Decompress the frame occupying [start, end) of 'fd', discard its first
+// 'skip' bytes and write the following 'nbytes' bytes to 'out_fd'
+// Returns 0 on success or -1 if an error occurs
+int seekable_extract(int fd, off_t start, off_t end, int out_fd, off_t skip, off_t nbytes);
+
+// Receives the decompressed bytes of seekable_extract_to in order
+// Returns 0 on success or -1 if an error occurs
+typedef int (*seekable_sink_fn_t)(const void *data, size_t len, void *arg);
+
+// Like seekable_extract, but hands the 'nbytes' bytes to 'sink' instead
+// Returns 0 on success or -1 if an error occurs
+int seekable_extract_to(int fd, off_t start, off_t end, off_t skip, off_t nbytes,
+                        seekable_sink_fn_t sink, void *arg);
+
+#endif    // _SEEKABLE_GZIP_H
@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "sparse.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "stats.h"
+
+#define BLOCK_SIZE 512
+#define INITIAL_CAPACITY 16
+// Longest map a sink accepts, so a corrupt count cannot exhaust memory
+#define MAX_MAP_LEN (16 << 20)
+
+void sparse_map_init(sparse_map_t *map) {
+    map->regions = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->real_size = 0;
+}
+
+void sparse_map_free(sparse_map_t *map) {
+    free(map->regions);
+    sparse_map_init(map);
+}
+
+int sparse_map_add(sparse_map_t *map, off_t offset, off_t size) {
+    if (map->count == map->capacity) {
+        int capacity = map->capacity > 0 ? map->capacity * 2 : INITIAL_CAPACITY;
+        sparse_region_t *regions = realloc(map->regions, sizeof(sparse_region_t) * capacity);
+        if (regions == NULL) {
+            return -1;
+        }
+        map->regions = regions;
+        map->capacity = capacity;
+    }
+    map->regions[map->count].offset = offset;
+    map->regions[map->count].size = size;
+    map->count++;
+    return 0;
+}
+
+int sparse_map_detect(int fd, const struct stat *stat_buf, sparse_map_t *map) {
+    // A file with a block allocated for every 512 bytes has no holes, which
+    // spares the seeks for nearly every file
+    off_t file_size = stat_buf->st_size;
+    if (!S_ISREG(stat_buf->st_mode) || file_size == 0 ||
+        (off_t) stat_buf->st_blocks * 512 >= file_size) {
+        return 0;
+    }
+
+    int result = 1;
+    off_t offset = 0;
+    while (offset < file_size) {
+        STATS_COUNT(STATS_SEEKS, 1);
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) {
+            // ENXIO means only a hole is left; other errors mean the file
+            // system cannot report holes, so the file is stored whole
+            result = errno == ENXIO ? 1 : 0;
+            break;
+        }
+        if (data >= file_size) {
+            break;
+        }
+        STATS_COUNT(STATS_SEEKS, 1);
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            result = -1;
+            break;
+        }
+        if (hole > file_size) {
+            hole = file_size;
+        }
+        if (sparse_map_add(map, data, hole - data) != 0) {
+            result = -1;
+            break;
+        }
+        offset = hole;
+    }
+
+    if (result == 1 && map->count == 1 && map->regions[0].size == file_size) {
+        result = 0;
+    }
+    // As GNU tar does, a file ending in a hole gets an empty last region
+    // marking where it ends
+    if (result == 1 && (map->count == 0 || map->regions[map->count - 1].offset +
+                                                   map->regions[map->count - 1].size <
+                                               file_size)) {
+        if (sparse_map_add(map, file_size, 0) != 0) {
+            result = -1;
+        }
+    }
+    STATS_COUNT(STATS_SEEKS, 1);
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        result = -1;
+    }
+    if (result != 1) {
+        sparse_map_free(map);
+    } else {
+        map->real_size = file_size;
+    }
+    return result;
+}
+
+off_t sparse_map_data_size(const sparse_map_t *map) {
+    off_t total = 0;
+    for (int i = 0; i < map->count; i++) {
+        total += map->regions[i].size;
+    }
+    return total;
+}
+
+char *sparse_map_encode(const sparse_map_t *map, size_t *len) {
+    // Each number takes at most 20 digits and a newline
+    size_t max_len = (2 * (size_t) map->count + 1) * 21;
+    size_t capacity = (max_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    char *text = calloc(capacity, 1);
+    if (text == NULL) {
+        return NULL;
+    }
+    size_t pos = sprintf(text, "%d\n", map->count);
+    for (int i = 0; i < map->count; i++) {
+        pos += sprintf(text + pos, "%lld\n%lld\n", (long long) map->regions[i].offset,
+                       (long long) map->regions[i].size);
+    }
+    *len = (pos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return text;
+}
+
+/*
+ * Parses the decimal number on the line starting at 'data[*pos]' into
+ * '*value' and moves '*pos' past the line
+ * Returns 0 on success, 1 if 'data' ends first, or -1 if the line is not a number
+ */
+static int parse_line(const char *data, size_t len, size_t *pos, uint64_t *value) {
+    uint64_t number = 0;
+    size_t i = *pos;
+    for (; i < len && data[i] != '\n'; i++) {
+        if (data[i] < '0' || data[i] > '9' || number > (INT64_MAX - 9) / 10) {
+            return -1;
+        }
+        number = number * 10 + (data[i] - '0');
+    }
+    if (i == len) {
+        return 1;
+    }
+    if (i == *pos) {
+        return -1;
+    }
+    *value = number;
+    *pos = i + 1;
+    return 0;
+}
+
+int sparse_map_parse(const char *data, size_t len, int ordered, sparse_map_t *map,
+                     size_t *map_len) {
+    size_t pos = 0;
+    uint64_t count;
+    int result = parse_line(data, len, &pos, &count);
+    if (result == 0 && count > INT32_MAX) {
+        result = -1;
+    }
+    off_t end = 0;
+    for (uint64_t i = 0; result == 0 && i < count; i++) {
+        uint64_t offset;
+        uint64_t size = 0;
+        result = parse_line(data, len, &pos, &offset);
+        if (result == 0) {
+            result = parse_line(data, len, &pos, &size);
+        }
+        if (result == 0 && size > (uint64_t) (INT64_MAX - offset)) {
+            result = -1;
+        }
+        // Regions of a sparse file must come in order without overlapping
+        if (result == 0 && ordered && (off_t) offset < end) {
+            result = -1;
+        }
+        if (result == 0) {
+            result = sparse_map_add(map, offset, size);
+            end = offset + size;
+        }
+    }
+    size_t padded_len = (pos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (result == 0 && padded_len > len) {
+        result = 1;
+    }
+    if (result == 0) {
+        *map_len = padded_len;
+    } else {
+        sparse_map_free(map);
+    }
+    return result;
+}
+
+int sparse_map_decode(const char *data, size_t len, sparse_map_t *map, size_t *map_len) {
+    return sparse_map_parse(data, len, 1, map, map_len);
+}
+
+void sparse_sink_init(sparse_sink_t *sink, int fd, off_t real_size) {
+    sink->fd = fd;
+    sink->real_size = real_size;
+    sparse_map_init(&sink->map);
+    sink->text = NULL;
+    sink->text_len = 0;
+    sink->have_map = 0;
+    sink->region = 0;
+    sink->region_done = 0;
+}
+
+/*
+ * Takes up to 'len' bytes of 'data' as map text, a block at a time, and
+ * decodes the map once it is complete
+ * Returns the number of bytes taken, or -1 if an error occurs
+ */
+static ssize_t take_map_text(sparse_sink_t *sink, const char *data, size_t len) {
+    if (sink->text == NULL) {
+        sink->text = malloc(BLOCK_SIZE);
+        if (sink->text == NULL) {
+            return -1;
+        }
+    }
+    size_t block_left = BLOCK_SIZE - sink->text_len % BLOCK_SIZE;
+    size_t take = len < block_left ? len : block_left;
+    memcpy(sink->text + sink->text_len, data, take);
+    sink->text_len += take;
+    if (sink->text_len % BLOCK_SIZE != 0) {
+        return take;
+    }
+
+    size_t map_len;
+    int result = sparse_map_decode(sink->text, sink->text_len, &sink->map, &map_len);
+    if (result < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (result == 0) {
+        sink->have_map = 1;
+        return take;
+    }
+    if (sink->text_len + BLOCK_SIZE > MAX_MAP_LEN) {
+        errno = EFBIG;
+        return -1;
+    }
+    char *text = realloc(sink->text, sink->text_len + BLOCK_SIZE);
+    if (text == NULL) {
+        return -1;
+    }
+    sink->text = text;
+    return take;
+}
+
+/*
+ * Finds the region the next data bytes belong to
+ * Returns the region, or NULL (with errno set) if the map has no room left
+ */
+static const sparse_region_t *current_region(sparse_sink_t *sink) {
+    while (sink->region < sink->map.count &&
+           sink->region_done == sink->map.regions[sink->region].size) {
+        sink->region++;
+        sink->region_done = 0;
+    }
+    if (sink->region == sink->map.count) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return &sink->map.regions[sink->region];
+}
+
+int sparse_sink_write(sparse_sink_t *sink, const void *data, size_t len) {
+    const char *bytes = data;
+    while (len > 0) {
+        if (!sink->have_map) {
+            ssize_t taken = take_map_text(sink, bytes, len);
+            if (taken < 0) {
+                return -1;
+            }
+            bytes += taken;
+            len -= taken;
+            continue;
+        }
+        const sparse_region_t *region = current_region(sink);
+        if (region == NULL) {
+            return -1;
+        }
+        off_t left = region->size - sink->region_done;
+        size_t n = (off_t) len < left ? len : (size_t) left;
+        off_t offset = region->offset + sink->region_done;
+        if (write_all(sink->fd, &offset, bytes, n) != 0) {
+            return -1;
+        }
+        sink->region_done += n;
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int sparse_sink_copy(sparse_sink_t *sink, int in_fd, off_t in_offset, off_t nbytes) {
+    while (nbytes > 0) {
+        if (!sink->have_map) {
+            char block[BLOCK_SIZE];
+            size_t to_read = nbytes < BLOCK_SIZE ? nbytes : BLOCK_SIZE;
+            ssize_t bytes_read = read_all(in_fd, &in_offset, block, to_read);
+            if (bytes_read != (ssize_t) to_read) {
+                if (bytes_read >= 0) {
+                    errno = ENODATA;
+                }
+                return -1;
+            }
+            if (sparse_sink_write(sink, block, to_read) != 0) {
+                return -1;
+            }
+            nbytes -= to_read;
+            continue;
+        }
+        const sparse_region_t *region = current_region(sink);
+        if (region == NULL) {
+            return -1;
+        }
+        off_t left = region->size - sink->region_done;
+        off_t n = nbytes < left ? nbytes : left;
+        off_t offset = region->offset + sink->region_done;
+        if (copy_file_data(sink->fd, &offset, in_fd, &in_offset, n) != 0) {
+            return -1;
+        }
+        sink->region_done += n;
+        nbytes -= n;
+    }
+    return 0;
+}
+
+int sparse_sink_finish(sparse_sink_t *sink) {
+    if (!sink->have_map) {
+        errno = ENODATA;
+        return -1;
+    }
+    for (int i = sink->region; i < sink->map.count; i++) {
+        if (sink->map.regions[i].size > (i == sink->region ? sink->region_done : 0)) {
+            errno = ENODATA;
+            return -1;
+        }
+    }
+    // Whatever follows the last region is a hole
+    return ftruncate(sink->fd, sink->real_size);
+}
+
+void sparse_sink_free(sparse_sink_t *sink) {
+    sparse_map_free(&sink->map);
+    free(sink->text);
+    sink->text = NULL;
+}
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _SPARSE_H
+#define _SPARSE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Sparse files are archived in the GNU/PAX 1.0 sparse format: only the
+ * regions holding data are stored, and the member's data starts with a map
+ * of where those regions go in the file. The map is text, padded with zeros
+ * to a whole number of blocks: the number of regions followed by the offset
+ * and size of each, every number on a line of its own. The regions' data
+ * follows back to back. The member's extended header names the real file
+ * and gives its full size, since the file may end in a hole.
+ */
+
+// One run of data within a sparse file
+typedef struct {
+    off_t offset;
+    off_t size;
+} sparse_region_t;
+
+// The data regions of a sparse file, in increasing order of offset
+typedef struct {
+    sparse_region_t *regions;
+    int count;
+    int capacity;
+    // Size of the whole file, holes included
+    off_t real_size;
+} sparse_map_t;
+
+// Initialize an empty map
+void sparse_map_init(sparse_map_t *map);
+
+// Free the memory held by 'map', leaving it empty
+void sparse_map_free(sparse_map_t *map);
+
+// Add a region to the end of 'map'
+// Returns 0 on success or -1 if memory could not be allocated
+int sparse_map_add(sparse_map_t *map, off_t offset, off_t size);
+
+// Find the data regions of the file open as 'fd', described by 'stat_buf',
+// with SEEK_DATA and SEEK_HOLE. The file position of 'fd' is reset to 0.
+// Returns 1 if the file has holes and 'map' now lists its data regions, 0 if
+// it is stored whole (it has no holes, or the file system cannot tell), or
+// -1 if an error occurs
+int sparse_map_detect(int fd, const struct stat *stat_buf, sparse_map_t *map);
+
+// Returns the number of data bytes in the regions of 'map'
+off_t sparse_map_data_size(const sparse_map_t *map);
+
+// Returns the encoded map for 'map' in a newly allocated buffer, padded to a
+// whole number of blocks, and stores its length in '*len'
+// Returns NULL if memory could not be allocated
+char *sparse_map_encode(const sparse_map_t *map, size_t *len);
+
+// Parse text in the map's form at the start of the 'len' bytes of 'data'
+// into the empty 'map', storing the number of bytes it takes up (padding
+// included) in '*map_len'. If 'ordered' is set, the regions must come in
+// increasing order of offset without overlapping.
+// Returns 0 on success, 1 if 'data' ends before the map does, or -1 if the
+// map is malformed or memory could not be allocated
+int sparse_map_parse(const char *data, size_t len, int ordered, sparse_map_t *map,
+                     size_t *map_len);
+
+// Decode the map of a sparse file at the start of the 'len' bytes of 'data'
+// with sparse_map_parse, requiring ordered regions
+int sparse_map_decode(const char *data, size_t len, sparse_map_t *map, size_t *map_len);
+
+/*
+ * A sparse sink rebuilds a sparse file from a member's data as it arrives:
+ * the map first, then the regions, each written at its offset in the file.
+ * The file must be empty to begin with, so the parts no region covers are
+ * left as holes.
+ */
+typedef struct {
+    int fd;
+    off_t real_size;
+    sparse_map_t map;
+    // Map text gathered until the whole map has arrived
+    char *text;
+    size_t text_len;
+    int have_map;
+    // Region being written and how much of it is written already
+    int region;
+    off_t region_done;
+} sparse_sink_t;
+
+// Set up 'sink' to rebuild a file of 'real_size' bytes into the empty 'fd'
+void sparse_sink_init(sparse_sink_t *sink, int fd, off_t real_size);
+
+// Consume the next 'len' bytes of the member's data
+// Returns 0 on success or -1 if an error occurs
+int sparse_sink_write(sparse_sink_t *sink, const void *data, size_t len);
+
+// Consume the next 'nbytes' bytes of the member's data from 'in_fd' at
+// 'in_offset'; region data is copied file to file by copy_file_data
+// Returns 0 on success or -1 if an error occurs
+int sparse_sink_copy(sparse_sink_t *sink, int in_fd, off_t in_offset, off_t nbytes);
+
+// Check that all the data arrived and extend the file to its full size
+// Returns 0 on success or -1 if an error occurs
+int sparse_sink_finish(sparse_sink_t *sink);
+
+// Free the memory held by 'sink'
+void sparse_sink_free(sparse_sink_t *sink);
+
+#endif    // _SPARSE_H
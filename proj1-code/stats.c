@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "stats.h"
+
+#ifdef MINITAR_STATS
+#include <time.h>
+
+static const char *phase_names[STATS_NUM_PHASES] = {"stat", "header", "name_lookup",
+                                                    "scan", "copy", "sync"};
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+    "bytes_read", "bytes_written", "read_calls", "write_calls",
+    "copy_calls", "seeks",         "ring_enters"};
+
+static uint64_t begin_ns;
+// Total nanoseconds spent in each phase, and how many times it was entered
+static uint64_t phase_ns[STATS_NUM_PHASES];
+static uint64_t phase_count[STATS_NUM_PHASES];
+static uint64_t counters[STATS_NUM_COUNTERS];
+static uint64_t member_latency[STATS_HISTOGRAM_BUCKETS];
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_begin(void) {
+    begin_ns = stats_now();
+}
+
+void stats_add(stats_counter_t counter, uint64_t n) {
+    __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_add_time(stats_phase_t phase, uint64_t start) {
+    __atomic_fetch_add(&phase_ns[phase], stats_now() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase_count[phase], 1, __ATOMIC_RELAXED);
+}
+
+void stats_add_member(uint64_t start) {
+    uint64_t us = (stats_now() - start) / 1000;
+    int bucket = 0;
+    while (us > 1 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    __atomic_fetch_add(&member_latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Lower bound of histogram bucket 'bucket', in microseconds
+static uint64_t bucket_start(int bucket) {
+    return bucket == 0 ? 0 : (uint64_t) 1 << bucket;
+}
+
+void stats_print(FILE *out, int json) {
+    double elapsed = (stats_now() - begin_ns) / 1e9;
+    uint64_t members = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        members += member_latency[i];
+    }
+
+    if (json) {
+        fprintf(out, "{\"elapsed_seconds\": %.6f, \"phases\": {", elapsed);
+        for (int i = 0; i < STATS_NUM_PHASES; i++) {
+            fprintf(out, "%s\"%s\": {\"seconds\": %.6f, \"count\": %llu}", i > 0 ? ", " : "",
+                    phase_names[i], phase_ns[i] / 1e9, (unsigned long long) phase_count[i]);
+        }
+        fprintf(out, "}, \"counters\": {");
+        for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+            fprintf(out, "%s\"%s\": %llu", i > 0 ? ", " : "", counter_names[i],
+                    (unsigned long long) counters[i]);
+        }
+        fprintf(out, "}, \"members\": %llu, \"member_latency_us\": [",
+                (unsigned long long) members);
+        int first = 1;
+        for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            if (member_latency[i] > 0) {
+                fprintf(out, "%s{\"min\": %llu, \"max\": %llu, \"count\": %llu}",
+                        first ? "" : ", ", (unsigned long long) bucket_start(i),
+                        (unsigned long long) bucket_start(i + 1),
+                        (unsigned long long) member_latency[i]);
+                first = 0;
+            }
+        }
+        fprintf(out, "]}\n");
+        return;
+    }
+
+    fprintf(out, "Elapsed: %.6f s\n", elapsed);
+    fprintf(out, "%-16s %14s %12s\n", "Phase", "Seconds", "Count");
+    for (int i = 0; i < STATS_NUM_PHASES; i++) {
+        fprintf(out, "%-16s %14.6f %12llu\n", phase_names[i], phase_ns[i] / 1e9,
+                (unsigned long long) phase_count[i]);
+    }
+    fprintf(out, "%-16s %27s\n", "Counter", "Value");
+    for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+        fprintf(out, "%-16s %27llu\n", counter_names[i], (unsigned long long) counters[i]);
+    }
+    fprintf(out, "Member latency (%llu members)\n", (unsigned long long) members);
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        if (member_latency[i] > 0) {
+            char range[48];
+            snprintf(range, sizeof(range), "%llu-%llu us", (unsigned long long) bucket_start(i),
+                     (unsigned long long) bucket_start(i + 1));
+            fprintf(out, "%-24s %19llu\n", range, (unsigned long long) member_latency[i]);
+        }
+    }
+}
+#endif
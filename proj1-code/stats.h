@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Optional instrumentation of where an operation spends its time, compiled
+ * in only when MINITAR_STATS is defined (make STATS=1). Without it, every
+ * STATS_* macro below expands to nothing, so the code paths they sit in,
+ * including the copy loops, are exactly what they would be without them.
+ *
+ * Counters and timers are shared by all threads and updated with relaxed
+ * atomic adds. Phase times are summed over threads, so with several threads
+ * they can add up to more than the elapsed time. Phases may also nest: name
+ * lookups happen while building headers, and count towards both.
+ */
+
+#ifdef MINITAR_STATS
+#include <stdint.h>
+#include <stdio.h>
+
+// Parts of an operation that are timed separately
+typedef enum {
+    // Opening and stat'ing files to be archived
+    STATS_PHASE_STAT,
+    // Laying out members: filling in headers and finding sparse files' holes
+    STATS_PHASE_HEADER,
+    // Looking up user and group names for headers (NSS)
+    STATS_PHASE_NAME_LOOKUP,
+    // Building the member index of an existing archive, from its headers or
+    // its sidecar
+    STATS_PHASE_SCAN,
+    // System calls that move data: reads, writes and kernel-side copies, and
+    // waits for io_uring completions
+    STATS_PHASE_COPY,
+    // Flushing an archive to stable storage
+    STATS_PHASE_SYNC,
+    STATS_NUM_PHASES,
+} stats_phase_t;
+
+typedef enum {
+    STATS_BYTES_READ,
+    STATS_BYTES_WRITTEN,
+    // read and pread calls
+    STATS_READ_CALLS,
+    // write and pwrite calls
+    STATS_WRITE_CALLS,
+    // copy_file_range, sendfile and splice calls, whose bytes count as both
+    // read and written
+    STATS_COPY_CALLS,
+    // lseek calls, including searches for the holes of sparse files
+    STATS_SEEKS,
+    // io_uring_enter calls; the reads and writes they carry out are counted
+    // in bytes only
+    STATS_RING_ENTERS,
+    STATS_NUM_COUNTERS,
+} stats_counter_t;
+
+// Member latencies fall in buckets of powers of two microseconds: bucket 0
+// holds times under 2us, and bucket i > 0 times in [2^i, 2^(i+1)) us
+#define STATS_HISTOGRAM_BUCKETS 32
+
+// Returns the monotonic clock in nanoseconds
+uint64_t stats_now(void);
+
+// Starts the elapsed time reported by stats_print
+void stats_begin(void);
+
+// Adds 'n' to 'counter'
+void stats_add(stats_counter_t counter, uint64_t n);
+
+// Adds the time since 'start' (from stats_now) to 'phase'
+void stats_add_time(stats_phase_t phase, uint64_t start);
+
+// Records one member that took from 'start' (from stats_now) until now
+void stats_add_member(uint64_t start);
+
+// Writes everything recorded so far to 'out', as a JSON object if 'json' is
+// set or else as a table
+void stats_print(FILE *out, int json);
+
+// Declares 'timer' and starts it
+#define STATS_START(timer) uint64_t timer = stats_now()
+// Adds the time since 'timer' was started to 'phase'
+#define STATS_PHASE(phase, timer) stats_add_time(phase, timer)
+#define STATS_COUNT(counter, n) stats_add(counter, n)
+// Records a member that took since 'timer' was started
+#define STATS_MEMBER(timer) stats_add_member(timer)
+#else
+#define STATS_START(timer) ((void) 0)
+#define STATS_PHASE(phase, timer) ((void) 0)
+#define STATS_COUNT(counter, n) ((void) 0)
+#define STATS_MEMBER(timer) ((void) 0)
+#endif
+
+#endif    // _STATS_H
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// State shared by all threads working through one parallel_for call
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next_task;
+    size_t num_tasks;
+    int failed;
+    task_fn_t task;
+    void *arg;
+} pool_state_t;
+
+static void *worker(void *state_ptr) {
+    pool_state_t *state = state_ptr;
+    while (1) {
+        pthread_mutex_lock(&state->lock);
+        if (state->failed || state->next_task >= state->num_tasks) {
+            pthread_mutex_unlock(&state->lock);
+            return NULL;
+        }
+        size_t index = state->next_task++;
+        pthread_mutex_unlock(&state->lock);
+
+        if (state->task(index, state->arg) != 0) {
+            pthread_mutex_lock(&state->lock);
+            state->failed = 1;
+            pthread_mutex_unlock(&state->lock);
+        }
+    }
+}
+
+int parallel_for(int num_threads, size_t num_tasks, task_fn_t task, void *arg) {
+    pool_state_t state = {.next_task = 0,
+                          .num_tasks = num_tasks,
+                          .failed = 0,
+                          .task = task,
+                          .arg = arg};
+    pthread_mutex_init(&state.lock, NULL);
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if ((size_t) num_threads > num_tasks) {
+        num_threads = num_tasks > 0 ? num_tasks : 1;
+    }
+
+    // The calling thread acts as one of the workers
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    if (threads == NULL) {
+        pthread_mutex_destroy(&state.lock);
+        return -1;
+    }
+    int num_started = 0;
+    for (int i = 1; i < num_threads; i++) {
+        // If a thread cannot be started, the threads we do have pick up its share
+        if (pthread_create(&threads[i], NULL, worker, &state) != 0) {
+            break;
+        }
+        num_started++;
+    }
+    worker(&state);
+    for (int i = 1; i <= num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&state.lock);
+    return state.failed ? -1 : 0;
+}
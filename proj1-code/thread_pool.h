@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <stddef.h>
+
+// A unit of work run by parallel_for; 'index' identifies the task
+// Returns 0 on success or -1 if an error occurs
+typedef int (*task_fn_t)(size_t index, void *arg);
+
+// Run 'task' once for every index in [0, num_tasks) using up to 'num_threads'
+// threads, including the calling thread. Tasks are handed out in index order.
+// Once any task fails, no further tasks are started.
+// Returns 0 if every task succeeded or -1 if any task failed
+int parallel_for(int num_threads, size_t num_tasks, task_fn_t task, void *arg);
+
+#endif    // _THREAD_POOL_H